@@ -17,6 +17,10 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include <pthread.h>
+
+/* The AioContext whose aio_poll() is running in the calling thread */
+static pthread_key_t current_context_key;
 
 struct AioHandler
 {
@@ -169,7 +173,7 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
-bool aio_poll(AioContext *ctx, bool blocking)
+static bool aio_poll_internal(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
@@ -253,3 +257,25 @@ bool aio_poll(AioContext *ctx, bool blocking)
     assert(progress || busy);
     return true;
 }
+
+static void __attribute__((constructor)) aio_current_context_init(void)
+{
+    pthread_key_create(&current_context_key, NULL);
+}
+
+AioContext *aio_get_current_context(void)
+{
+    return pthread_getspecific(current_context_key);
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    AioContext *old = pthread_getspecific(current_context_key);
+    bool progress;
+
+    /* aio_poll() can nest, e.g. through bdrv_drain_all() */
+    pthread_setspecific(current_context_key, ctx);
+    progress = aio_poll_internal(ctx, blocking);
+    pthread_setspecific(current_context_key, old);
+    return progress;
+}
@@ -20,6 +20,9 @@
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
 
+/* The AioContext whose aio_poll() is running in the calling thread */
+static DWORD current_context_index;
+
 struct AioHandler {
     EventNotifier *e;
     EventNotifierHandler *io_notify;
@@ -92,7 +95,7 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
-bool aio_poll(AioContext *ctx, bool blocking)
+static bool aio_poll_internal(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     HANDLE events[MAXIMUM_WAIT_OBJECTS + 1];
@@ -217,3 +220,25 @@ bool aio_poll(AioContext *ctx, bool blocking)
     assert(progress || busy);
     return true;
 }
+
+static void __attribute__((constructor)) aio_current_context_init(void)
+{
+    current_context_index = TlsAlloc();
+}
+
+AioContext *aio_get_current_context(void)
+{
+    return TlsGetValue(current_context_index);
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    AioContext *old = TlsGetValue(current_context_index);
+    bool progress;
+
+    /* aio_poll() can nest, e.g. through bdrv_drain_all() */
+    TlsSetValue(current_context_index, ctx);
+    progress = aio_poll_internal(ctx, blocking);
+    TlsSetValue(current_context_index, old);
+    return progress;
+}
@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
@@ -45,6 +46,9 @@
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/sockets.h"
+#include "qemu/error-report.h"
+#include "migration/postcopy.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
@@ -104,14 +108,12 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
-static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static void mig_throttle_set(double throttle);
 
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+#define RAM_SAVE_FLAG_POSTCOPY 0x01 /* Was RAM_SAVE_FLAG_FULL, obsolete */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -119,6 +121,8 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_CHANNEL  0x200
 
 
 static struct defconfig_file {
@@ -192,8 +196,13 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_conflict;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_raw_bytes;
+    uint64_t compress_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -243,16 +252,41 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_conflict(void)
+{
+    return acct_info.xbzrle_cache_conflict;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_raw_bytes_transferred(void)
+{
+    return acct_info.compress_raw_bytes;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -279,15 +313,16 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     int encoded_len = 0, bytes_sent = -1;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
-        if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr, current_data);
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
+        if (!last_stage &&
+            cache_insert(XBZRLE.cache, current_addr, current_data)) {
+            acct_info.xbzrle_cache_conflict++;
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    acct_info.xbzrle_cache_hit++;
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
@@ -336,6 +371,543 @@ static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/* Incremental snapshots.  Once a snapshot is saved, dirty logging can be
+ * left running so that the next one only saves the pages dirtied since.
+ */
+static bool snapshot_track;    /* keep logging once this save completes */
+static bool snapshot_delta;    /* this save only has the dirtied pages */
+static bool snapshot_tracking; /* logging since the last completed save */
+
+/* Multi-threaded page compression.
+ *
+ * The migration thread gathers runs of up to COMPRESS_BATCH_PAGES
+ * consecutive dirty pages of a RAMBlock and hands each run to an idle
+ * worker thread.  The worker copies the run out of guest memory before
+ * deflating it: vCPUs keep writing while it works, and a stream deflated
+ * from memory that changes underneath may not inflate back to the right
+ * length.  A page written after the copy is dirty again and is sent by a
+ * later iteration.  A batch
+ * stays in its worker until the worker is needed again, or until the end of
+ * the iteration, when all batches are written out: a page is thus never
+ * overtaken on the destination by an older copy of itself.
+ *
+ * On the wire, a batch is a RAM_SAVE_FLAG_COMPRESS_PAGE header for its first
+ * page, followed by the number of pages (be16), the compressed length (be32)
+ * and the zlib stream.  Batches that do not compress are sent as normal
+ * pages.
+ */
+#define COMPRESS_BATCH_PAGES 16
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;                 /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+    bool busy;                  /* protected by comp.done_lock */
+
+    /* Batch owned by the thread while busy, then waiting to be sent */
+    RAMBlock *block;
+    ram_addr_t offset;
+    int pages;
+    int level;
+    uint8_t *copy;              /* the run, as read from guest memory */
+    uint8_t *buf;
+    uLongf buf_size;
+    uLongf len;                 /* 0 if compression failed */
+} CompressParam;
+
+static struct {
+    CompressParam *params;
+    int nr_threads;
+    int next;                   /* round-robin start for idle threads */
+    QemuMutex done_lock;
+    QemuCond done_cond;
+
+    /* Batch being gathered by the migration thread */
+    RAMBlock *block;
+    ram_addr_t offset;
+    int pages;
+} comp;
+
+static void *do_compress_thread(void *opaque)
+{
+    CompressParam *param = opaque;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        memcpy(param->copy,
+               memory_region_get_ram_ptr(param->block->mr) + param->offset,
+               param->pages * TARGET_PAGE_SIZE);
+        param->len = param->buf_size;
+        ret = compress2(param->buf, &param->len, param->copy,
+                        param->pages * TARGET_PAGE_SIZE, param->level);
+        if (ret != Z_OK) {
+            param->len = 0;
+        }
+
+        qemu_mutex_lock(&comp.done_lock);
+        param->busy = false;
+        qemu_cond_signal(&comp.done_cond);
+        qemu_mutex_unlock(&comp.done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void compress_threads_create(void)
+{
+    int i;
+
+    memset(&comp, 0, sizeof(comp));
+    comp.nr_threads = migrate_compress_threads();
+    comp.params = g_new0(CompressParam, comp.nr_threads);
+    qemu_mutex_init(&comp.done_lock);
+    qemu_cond_init(&comp.done_cond);
+
+    for (i = 0; i < comp.nr_threads; i++) {
+        CompressParam *param = &comp.params[i];
+
+        param->buf_size = compressBound(COMPRESS_BATCH_PAGES *
+                                        TARGET_PAGE_SIZE);
+        param->buf = g_malloc(param->buf_size);
+        param->copy = g_malloc(COMPRESS_BATCH_PAGES * TARGET_PAGE_SIZE);
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_compress_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_join(void)
+{
+    int i;
+
+    if (!comp.params) {
+        return;
+    }
+
+    for (i = 0; i < comp.nr_threads; i++) {
+        CompressParam *param = &comp.params[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->buf);
+        g_free(param->copy);
+    }
+    qemu_mutex_destroy(&comp.done_lock);
+    qemu_cond_destroy(&comp.done_cond);
+    g_free(comp.params);
+    comp.params = NULL;
+}
+
+/* Writes out the batch of an idle thread */
+static int compress_send_batch(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + param->offset;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent, i;
+
+    if (param->len == 0 || param->len >= param->pages * TARGET_PAGE_SIZE) {
+        bytes_sent = 0;
+        for (i = 0; i < param->pages; i++) {
+            bytes_sent += save_block_hdr(f, block,
+                                         param->offset + i * TARGET_PAGE_SIZE,
+                                         cont, RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer_async(f, p + i * TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+            bytes_sent += TARGET_PAGE_SIZE;
+            cont = RAM_SAVE_FLAG_CONTINUE;
+        }
+        acct_info.norm_pages += param->pages;
+    } else {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be16(f, param->pages);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 2 + 4 + param->len;
+        acct_info.compress_pages += param->pages;
+        acct_info.compress_raw_bytes += param->pages * TARGET_PAGE_SIZE;
+        acct_info.compress_bytes += bytes_sent;
+    }
+
+    last_sent_block = block;
+    param->pages = 0;
+    return bytes_sent;
+}
+
+/* Hands the batch being gathered to an idle thread, writing out the batch
+ * that thread had compressed before.  Returns the number of bytes written. */
+static int compress_start_batch(QEMUFile *f)
+{
+    CompressParam *param = NULL;
+    int bytes_sent = 0;
+    int i, idx;
+
+    if (comp.pages == 0) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp.done_lock);
+    while (!param) {
+        for (i = 0; i < comp.nr_threads; i++) {
+            idx = (comp.next + i) % comp.nr_threads;
+            if (!comp.params[idx].busy) {
+                param = &comp.params[idx];
+                comp.next = (idx + 1) % comp.nr_threads;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&comp.done_cond, &comp.done_lock);
+        }
+    }
+    param->busy = true;
+    qemu_mutex_unlock(&comp.done_lock);
+
+    if (param->pages) {
+        bytes_sent = compress_send_batch(f, param);
+    }
+
+    param->block = comp.block;
+    param->offset = comp.offset;
+    param->pages = comp.pages;
+    param->level = migrate_compress_level();
+    comp.pages = 0;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/* Adds a page to the batch being gathered.  Returns the number of bytes
+ * written to f, if this started a new batch. */
+static int compress_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset)
+{
+    int bytes_sent = 0;
+
+    if (comp.pages &&
+        (block != comp.block ||
+         offset != comp.offset + comp.pages * TARGET_PAGE_SIZE ||
+         comp.pages == COMPRESS_BATCH_PAGES)) {
+        bytes_sent = compress_start_batch(f);
+    }
+    if (comp.pages == 0) {
+        comp.block = block;
+        comp.offset = offset;
+    }
+    comp.pages++;
+
+    return bytes_sent;
+}
+
+/* Writes out all batches.  Returns the number of bytes written. */
+static int compress_flush(QEMUFile *f)
+{
+    int bytes_sent;
+    int i;
+
+    if (!comp.params) {
+        return 0;
+    }
+
+    bytes_sent = compress_start_batch(f);
+    for (i = 0; i < comp.nr_threads; i++) {
+        CompressParam *param = &comp.params[i];
+
+        qemu_mutex_lock(&comp.done_lock);
+        while (param->busy) {
+            qemu_cond_wait(&comp.done_cond, &comp.done_lock);
+        }
+        qemu_mutex_unlock(&comp.done_lock);
+
+        if (param->pages) {
+            bytes_sent += compress_send_batch(f, param);
+        }
+    }
+
+    return bytes_sent;
+}
+
+/* Multi-channel RAM migration.
+ *
+ * With more than one channel, the source opens extra connections to the
+ * address of a tcp or unix migration and spreads normal pages over them by
+ * ranges of RAM_CHANNEL_RANGE_PAGES: the first range of every stride stays
+ * on the main stream, the others are queued to a sender thread per extra
+ * connection.  Zero, XBZRLE and compressed pages always go on the main
+ * stream, and so does the device state.
+ *
+ * Every round of pages ends with a sync: the destination applies all pages
+ * received on the channels before reading past the sync on the main stream,
+ * so that a page is never overwritten by an older copy of itself.
+ *
+ * On the main stream, a RAM_SAVE_FLAG_CHANNEL header is followed by a
+ * command byte: RAM_CHANNEL_OPEN (with the number of extra connections) in
+ * the setup section, RAM_CHANNEL_SYNC afterwards.  An extra connection
+ * starts with RAM_CHANNEL_MAGIC (be32) and its index (byte), then carries
+ * RAM_SAVE_FLAG_PAGE records, RAM_SAVE_FLAG_CHANNEL syncs and a final
+ * RAM_SAVE_FLAG_EOS.
+ */
+#define RAM_CHANNEL_MAGIC       0x5152434e
+#define RAM_CHANNEL_OPEN        1
+#define RAM_CHANNEL_SYNC        2
+
+#define RAM_CHANNEL_RANGE_PAGES 256
+#define RAM_CHANNEL_QUEUE_LEN   256
+
+typedef struct RAMChannelPage {
+    RAMBlock *block;            /* NULL for a sync or the end of stream */
+    ram_addr_t offset;
+    int flags;
+} RAMChannelPage;
+
+typedef struct RAMSendChannel {
+    QemuThread thread;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    RAMChannelPage queue[RAM_CHANNEL_QUEUE_LEN];    /* protected by mutex */
+    int head;                   /* protected by mutex */
+    int count;                  /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+    bool error;                 /* protected by mutex */
+
+    /* Last block queued, for RAM_SAVE_FLAG_CONTINUE */
+    RAMBlock *last_block;
+} RAMSendChannel;
+
+static struct {
+    RAMSendChannel *channels;
+    int nr;                     /* extra connections with a running thread */
+} send_chan;
+
+static void *do_channel_send_thread(void *opaque)
+{
+    RAMSendChannel *ch = opaque;
+    RAMChannelPage page;
+    uint8_t *p;
+
+    qemu_mutex_lock(&ch->mutex);
+    while (!ch->quit) {
+        if (ch->count == 0) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+            continue;
+        }
+        page = ch->queue[ch->head];
+        ch->head = (ch->head + 1) % RAM_CHANNEL_QUEUE_LEN;
+        ch->count--;
+        qemu_cond_signal(&ch->cond);
+
+        /* After an error, the queue is only drained */
+        if (!ch->error) {
+            qemu_mutex_unlock(&ch->mutex);
+
+            if (page.block) {
+                p = memory_region_get_ram_ptr(page.block->mr) + page.offset;
+                save_block_hdr(ch->file, page.block, page.offset,
+                               page.flags & RAM_SAVE_FLAG_CONTINUE,
+                               RAM_SAVE_FLAG_PAGE);
+                qemu_put_buffer_async(ch->file, p, TARGET_PAGE_SIZE);
+            } else {
+                qemu_put_be64(ch->file, page.flags);
+                qemu_fflush(ch->file);
+            }
+
+            qemu_mutex_lock(&ch->mutex);
+            ch->error = qemu_file_get_error(ch->file) != 0;
+        }
+        if (page.flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&ch->mutex);
+
+    return NULL;
+}
+
+/* Appends a page or marker to the queue of ch, waiting for room */
+static bool ram_channel_push(RAMSendChannel *ch, RAMBlock *block,
+                             ram_addr_t offset, int flags)
+{
+    RAMChannelPage *page;
+    bool error;
+
+    qemu_mutex_lock(&ch->mutex);
+    while (ch->count == RAM_CHANNEL_QUEUE_LEN) {
+        qemu_cond_wait(&ch->cond, &ch->mutex);
+    }
+    page = &ch->queue[(ch->head + ch->count) % RAM_CHANNEL_QUEUE_LEN];
+    page->block = block;
+    page->offset = offset;
+    page->flags = flags;
+    ch->count++;
+    qemu_cond_signal(&ch->cond);
+    error = ch->error;
+    qemu_mutex_unlock(&ch->mutex);
+
+    return !error;
+}
+
+static int ram_channels_open(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    int nr = migrate_ram_channels() - 1;
+    Error *local_err = NULL;
+    int i, fd;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+    qemu_put_byte(f, RAM_CHANNEL_OPEN);
+    qemu_put_byte(f, nr);
+    qemu_fflush(f);
+
+    /* The destination accepts the connections once it has read the above */
+    send_chan.channels = g_new0(RAMSendChannel, nr);
+    for (i = 0; i < nr; i++) {
+        RAMSendChannel *ch = &send_chan.channels[i];
+
+        fd = migrate_open_channel(s, &local_err);
+        if (fd < 0) {
+            error_report("Could not open RAM channel: %s",
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+
+        ch->file = qemu_fopen_socket(fd, "wb");
+        qemu_file_set_stats(ch->file, &s->stream_stats);
+        qemu_file_set_buffer_size(ch->file, migrate_buffer_size());
+        if (migrate_use_splice() && strstart(s->uri, "unix:", NULL)) {
+            qemu_file_enable_splice(ch->file);
+        }
+        qemu_put_be32(ch->file, RAM_CHANNEL_MAGIC);
+        qemu_put_byte(ch->file, i + 1);
+        qemu_fflush(ch->file);
+
+        qemu_mutex_init(&ch->mutex);
+        qemu_cond_init(&ch->cond);
+        qemu_thread_create(&ch->thread, do_channel_send_thread, ch,
+                           QEMU_THREAD_JOINABLE);
+        send_chan.nr++;
+    }
+
+    return 0;
+}
+
+/* Stops the sender threads.  If drain is true, they send everything they
+ * have queued and an end of stream first; otherwise their connections are
+ * shut down. */
+static void ram_channels_close(bool drain)
+{
+    int i;
+
+    if (!send_chan.channels) {
+        return;
+    }
+
+    for (i = 0; i < send_chan.nr; i++) {
+        RAMSendChannel *ch = &send_chan.channels[i];
+
+        if (drain) {
+            ram_channel_push(ch, NULL, 0, RAM_SAVE_FLAG_EOS);
+        } else {
+            qemu_mutex_lock(&ch->mutex);
+            ch->quit = true;
+            qemu_cond_signal(&ch->cond);
+            qemu_mutex_unlock(&ch->mutex);
+            shutdown(qemu_get_fd(ch->file), 2);
+        }
+        qemu_thread_join(&ch->thread);
+
+        qemu_fclose(ch->file);
+        qemu_mutex_destroy(&ch->mutex);
+        qemu_cond_destroy(&ch->cond);
+    }
+    g_free(send_chan.channels);
+    send_chan.channels = NULL;
+    send_chan.nr = 0;
+}
+
+/* Queues a normal page to the channel its range belongs to.  Returns the
+ * number of bytes it will take on the wire, which are accounted to f, or -1
+ * if the page belongs to the main stream. */
+static int ram_channel_queue_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset)
+{
+    RAMSendChannel *ch;
+    int idx, cont, size;
+
+    if (!send_chan.nr) {
+        return -1;
+    }
+
+    idx = ((block->offset + offset) >> TARGET_PAGE_BITS) /
+          RAM_CHANNEL_RANGE_PAGES % (send_chan.nr + 1);
+    if (idx == 0) {
+        return -1;
+    }
+
+    ch = &send_chan.channels[idx - 1];
+    cont = (block == ch->last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    ram_channel_push(ch, block, offset, cont);
+    ch->last_block = block;
+
+    size = 8 + TARGET_PAGE_SIZE;
+    if (!cont) {
+        size += 1 + strlen(block->idstr);
+    }
+    qemu_file_update_transfer(f, size);
+    qemu_update_position(f, size);
+    return size;
+}
+
+/* Ends a round of pages on all channels.  Returns the number of bytes
+ * written to f, or a negative value if a channel failed. */
+static int ram_channels_sync(QEMUFile *f)
+{
+    bool ok = true;
+    int i;
+
+    if (!send_chan.nr) {
+        return 0;
+    }
+
+    for (i = 0; i < send_chan.nr; i++) {
+        ok &= ram_channel_push(&send_chan.channels[i], NULL, 0,
+                               RAM_SAVE_FLAG_CHANNEL);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+    qemu_put_byte(f, RAM_CHANNEL_SYNC);
+
+    /* The destination holds the channels at the sync until it reads this */
+    qemu_fflush(f);
+
+    return ok ? 9 : -EIO;
+}
+
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
                                                  ram_addr_t start)
@@ -373,6 +945,121 @@ static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
     return ret;
 }
 
+static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
+                                                         ram_addr_t offset)
+{
+    bool ret;
+    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+
+    ret = test_and_clear_bit(nr, migration_bitmap);
+
+    if (ret) {
+        migration_dirty_pages--;
+    }
+    return ret;
+}
+
+/* Dirty rate estimation and auto-converge, protected by the iothread lock.
+ *
+ * Every page found dirty by migration_bitmap_sync() is accounted to its
+ * RAMBlock.  Once per DIRTY_RATE_PERIOD, the counts are turned into a rate
+ * that is smoothed over the last few periods, and the auto-converge
+ * controller adjusts mig_throttle, the fraction of the time the vCPUs are
+ * kept out of the guest.
+ */
+#define DIRTY_RATE_PERIOD 1000 /* ms */
+/* A period contributes 1/DIRTY_RATE_WEIGHT of the smoothed rate */
+#define DIRTY_RATE_WEIGHT 2
+/* Fraction of the error corrected by the controller in one period */
+#define MIG_THROTTLE_GAIN 0.5
+#define MIG_THROTTLE_MAX 0.99
+
+static int64_t dirty_period_start;
+static uint64_t dirty_period_pages_sent;
+static bool dirty_rate_valid;
+static double mig_throttle;
+
+/* Pages sent so far, whatever their encoding */
+static uint64_t ram_pages_sent(void)
+{
+    return acct_info.dup_pages + acct_info.norm_pages +
+           acct_info.xbzrle_pages + acct_info.compress_pages;
+}
+
+static void dirty_rate_reset(void)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        block->dirty_pages_period = 0;
+        block->dirty_pages_rate = 0;
+    }
+    dirty_period_start = qemu_get_clock_ms(rt_clock);
+    dirty_period_pages_sent = ram_pages_sent();
+    dirty_rate_valid = false;
+}
+
+/*
+ * Proportional controller: the remaining RAM must drain, at the rate pages
+ * are sent minus the rate they are dirtied, within the convergence time.
+ * The dirty rate scales with the share of the time the vCPUs run, so
+ * throttling by the returned fraction brings it to the target.
+ */
+static double mig_throttle_compute(uint64_t dirty_rate, double send_rate)
+{
+    double target, unthrottled, throttle;
+
+    target = send_rate - (double)ram_bytes_remaining() /
+                         migrate_convergence_time();
+    target = MAX(target, 0);
+    unthrottled = dirty_rate / (1 - mig_throttle);
+    if (unthrottled == 0) {
+        return 0;
+    }
+
+    throttle = mig_throttle + MIG_THROTTLE_GAIN *
+                              (dirty_rate - target) / unthrottled;
+    return MIN(MAX(throttle, 0), MIG_THROTTLE_MAX);
+}
+
+static void dirty_rate_update(MigrationState *s, int64_t end_time)
+{
+    RAMBlock *block;
+    int64_t period = end_time - dirty_period_start;
+    uint64_t pages_sent = ram_pages_sent();
+    uint64_t dirty_pages_rate = 0;
+    double send_rate;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t rate = block->dirty_pages_period * 1000 / period;
+
+        if (dirty_rate_valid) {
+            rate = (block->dirty_pages_rate * (DIRTY_RATE_WEIGHT - 1) + rate)
+                   / DIRTY_RATE_WEIGHT;
+        }
+        block->dirty_pages_rate = rate;
+        block->dirty_pages_period = 0;
+        dirty_pages_rate += rate;
+    }
+    dirty_rate_valid = true;
+
+    s->dirty_pages_rate = dirty_pages_rate;
+    s->dirty_bytes_rate = dirty_pages_rate * TARGET_PAGE_SIZE;
+
+    /* The first pass sends every page anyway, only throttle afterwards */
+    if (migrate_auto_converge() && !ram_bulk_stage) {
+        send_rate = (double)(pages_sent - dirty_period_pages_sent) *
+                    TARGET_PAGE_SIZE * 1000 / period;
+        mig_throttle_set(mig_throttle_compute(s->dirty_bytes_rate,
+                                              send_rate));
+    } else {
+        mig_throttle_set(0);
+    }
+
+    dirty_period_start = end_time;
+    dirty_period_pages_sent = pages_sent;
+}
+
 /* Needs iothread lock! */
 
 static void migration_bitmap_sync(void)
@@ -381,19 +1068,7 @@ static void migration_bitmap_sync(void)
     ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
-    static int64_t start_time;
-    static int64_t bytes_xfer_prev;
-    static int64_t num_dirty_pages_period;
     int64_t end_time;
-    int64_t bytes_xfer_now;
-
-    if (!bytes_xfer_prev) {
-        bytes_xfer_prev = ram_bytes_transferred();
-    }
-
-    if (!start_time) {
-        start_time = qemu_get_clock_ms(rt_clock);
-    }
 
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
@@ -404,56 +1079,62 @@ static void migration_bitmap_sync(void)
                                                    addr, TARGET_PAGE_SIZE,
                                                    DIRTY_MEMORY_MIGRATION)) {
                 migration_bitmap_set_dirty(block->mr, addr);
+                block->dirty_pages_period++;
             }
         }
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
-            bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+    if (end_time >= dirty_period_start + DIRTY_RATE_PERIOD) {
+        dirty_rate_update(s, end_time);
+    }
+}
+
+int ram_throttle_percentage(void)
+{
+    return mig_throttle * 100 + 0.5;
+}
+
+RAMBlockDirtyRateList *ram_dirty_rates(void)
+{
+    RAMBlockDirtyRateList *head = NULL, *entry, *prev = NULL;
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->dirty_pages_rate = block->dirty_pages_rate;
+        if (prev) {
+            prev->next = entry;
         } else {
-             mig_throttle_on = false;
+            head = entry;
         }
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
-            / (end_time - start_time);
-        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
-        start_time = end_time;
-        num_dirty_pages_period = 0;
+        prev = entry;
     }
+
+    return head;
 }
 
 /*
- * ram_save_block: Writes a page of memory to the stream f
+ * ram_save_block: Writes a page of memory to the stream f, or queues it for
+ *                 compression
  *
- * Returns:  The number of bytes written.
+ * Returns:  The number of pages written or queued.
  *           0 means no dirty pages
+ *
+ * The number of bytes written to f is added to *bytes_written.
  */
 
-static int ram_save_block(QEMUFile *f, bool last_stage)
+static int ram_save_block(QEMUFile *f, bool last_stage, int *bytes_written)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
     int bytes_sent = 0;
+    int pages = 0;
     MemoryRegion *mr;
     ram_addr_t current_addr;
 
@@ -509,19 +1190,42 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                 if (!last_stage) {
                     p = get_cached_data(XBZRLE.cache, current_addr);
                 }
+            } else if (migrate_use_compression()) {
+                *bytes_written += compress_queue_page(f, block, offset);
+                pages = 1;
+                break;
+            }
+
+            /* Normal pages of guest memory may go on another channel */
+            if (bytes_sent == -1 &&
+                p == memory_region_get_ram_ptr(mr) + offset) {
+                bytes_sent = ram_channel_queue_page(f, block, offset);
+                if (bytes_sent > 0) {
+                    acct_info.norm_pages++;
+                    *bytes_written += bytes_sent;
+                    pages = 1;
+                    break;
+                }
             }
 
             /* XBZRLE overflow or normal page */
             if (bytes_sent == -1) {
                 bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                if (p == memory_region_get_ram_ptr(mr) + offset) {
+                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                } else {
+                    /* the cache entry can change before it is sent */
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                }
                 bytes_sent += TARGET_PAGE_SIZE;
                 acct_info.norm_pages++;
             }
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
+                *bytes_written += bytes_sent;
                 last_sent_block = block;
+                pages = 1;
                 break;
             }
         }
@@ -529,7 +1233,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
 static uint64_t bytes_transferred;
@@ -575,10 +1279,18 @@ uint64_t ram_bytes_total(void)
 static void migration_end(void)
 {
     if (migration_bitmap) {
-        memory_global_dirty_log_stop();
+        if (!snapshot_tracking) {
+            memory_global_dirty_log_stop();
+        }
         g_free(migration_bitmap);
         migration_bitmap = NULL;
     }
+    snapshot_track = false;
+    snapshot_delta = false;
+
+    mig_throttle_set(0);
+    compress_threads_join();
+    ram_channels_close(false);
 
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
@@ -595,6 +1307,33 @@ static void ram_migration_cancel(void *opaque)
     migration_end();
 }
 
+/**
+ * Prepares the next save of the RAM for a VM snapshot.  With @track, dirty
+ * logging goes on once the save completes, until ram_snapshot_stop().  With
+ * @delta, only the pages dirtied since the previous tracked save are saved.
+ */
+void ram_snapshot_begin(bool track, bool delta)
+{
+    snapshot_track = track;
+    snapshot_delta = delta;
+}
+
+/* Whether the pages dirtied since the last saved snapshot are known */
+bool ram_snapshot_tracking(void)
+{
+    return snapshot_tracking;
+}
+
+void ram_snapshot_stop(void)
+{
+    if (snapshot_tracking) {
+        memory_global_dirty_log_stop();
+        snapshot_tracking = false;
+    }
+    snapshot_track = false;
+    snapshot_delta = false;
+}
+
 static void reset_ram_globals(void)
 {
     last_seen_block = NULL;
@@ -610,12 +1349,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    bool logging = snapshot_tracking;
+    bool delta = snapshot_delta && logging;
+
+    /* This save owns the dirty log from now on */
+    snapshot_tracking = false;
 
     migration_bitmap = bitmap_new(ram_pages);
-    bitmap_set(migration_bitmap, 0, ram_pages);
-    migration_dirty_pages = ram_pages;
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
+    if (delta) {
+        /* Filled by the sync below with what changed since the last save */
+        migration_dirty_pages = 0;
+    } else {
+        bitmap_set(migration_bitmap, 0, ram_pages);
+        migration_dirty_pages = ram_pages;
+    }
 
     if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -625,216 +1372,1126 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             DPRINTF("Error creating cache\n");
             return -1;
         }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
+        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        acct_clear();
+    }
+
+    if (migrate_use_compression()) {
+        acct_info.compress_pages = 0;
+        acct_info.compress_raw_bytes = 0;
+        acct_info.compress_bytes = 0;
+        compress_threads_create();
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock_ramlist();
+    bytes_transferred = 0;
+    reset_ram_globals();
+    if (delta) {
+        /* The bulk stage assumes that every page is dirty */
+        ram_bulk_stage = false;
+    }
+
+    if (!logging) {
+        memory_global_dirty_log_start();
+    }
+    migration_bitmap_sync();
+    /* Every page was dirty so far, start measuring from here */
+    dirty_rate_reset();
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    qemu_mutex_unlock_ramlist();
+
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+
+    if (migrate_ram_channels() > 1 && ram_channels_open(f) < 0) {
+        return -1;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int total_sent = 0;
+    int sync_sent;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+    t0 = qemu_get_clock_ns(rt_clock);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int pages;
+
+        pages = ram_save_block(f, false, &total_sent);
+        /* no more blocks to sent */
+        if (pages == 0) {
+            break;
+        }
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    total_sent += compress_flush(f);
+    sync_sent = ram_channels_sync(f);
+    if (sync_sent < 0) {
+        ret = sync_sent;
+    } else {
+        total_sent += sync_sent;
+    }
+
+    qemu_mutex_unlock_ramlist();
+
+    /*
+     * Must occur before EOS (or any QEMUFile operation)
+     * because of RDMA protocol.
+     */
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+
+    if (ret < 0) {
+        bytes_transferred += total_sent;
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    total_sent += 8;
+    bytes_transferred += total_sent;
+
+    return total_sent;
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    int ret;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int pages, bytes_sent = 0;
+
+        pages = ram_save_block(f, true, &bytes_sent);
+        /* no more blocks to sent */
+        if (pages == 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    bytes_transferred += compress_flush(f);
+    ret = ram_channels_sync(f);
+    if (ret >= 0) {
+        bytes_transferred += ret;
+        ret = 0;
+    }
+    ram_channels_close(ret == 0);
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    snapshot_tracking = snapshot_track && ret == 0;
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return ret;
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+/* Post-copy migration, source side
+ *
+ * When the migration switches to post-copy, the VM is stopped and
+ * ram_save_postcopy() sends the list of pages that are still dirty: the
+ * destination discards them, so that the guest faults when it touches one.
+ * One more connection is then opened to the destination.  A sender thread
+ * pushes the dirty pages over it in RAM order, jumping ahead to the pages
+ * the destination asks for on the same connection, while the device state
+ * goes on over the main stream and the guest resumes on the destination.
+ *
+ * The discard list is a sequence of blocks, each made of its idstr (byte
+ * length and bytes) and runs of (be64 offset, be64 number of pages) ended
+ * by an empty run; an empty idstr ends the list.  Page requests are made of
+ * the idstr and the be64 offset of the page.
+ */
+typedef struct RAMPostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPostcopyRequest) next;
+} RAMPostcopyRequest;
+
+static struct {
+    QEMUFile *file;             /* pages to the destination */
+    QEMUFile *return_file;      /* requests from the destination */
+    QemuThread send_thread;
+    QemuThread return_thread;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, RAMPostcopyRequest) requests;   /* protected by lock */
+    bool done;                  /* all pages were sent */
+} postcopy_src;
+
+static void postcopy_send_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, RAMBlock **last_block)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int cont = (block == *last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    size_t bytes;
+
+    if (is_zero_page(p)) {
+        bytes = save_block_hdr(f, block, offset, cont,
+                               RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_transferred += bytes + 1;
+        acct_info.dup_pages++;
+    } else {
+        bytes = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += bytes + TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    *last_block = block;
+}
+
+static void *do_postcopy_send_thread(void *opaque)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *f = postcopy_src.file;
+    RAMBlock *block = QTAILQ_FIRST(&ram_list.blocks);
+    RAMBlock *last_block = NULL;
+    RAMPostcopyRequest *req;
+    ram_addr_t offset = 0;
+
+    while (block) {
+        if (migration_has_failed(s) || qemu_file_get_error(f)) {
+            return NULL;
+        }
+
+        qemu_mutex_lock(&postcopy_src.lock);
+        req = QSIMPLEQ_FIRST(&postcopy_src.requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&postcopy_src.requests, next);
+        }
+        qemu_mutex_unlock(&postcopy_src.lock);
+
+        if (req) {
+            /* The page may already be on its way */
+            if (migration_bitmap_test_and_reset_dirty(req->block->mr,
+                                                      req->offset)) {
+                postcopy_send_page(f, req->block, req->offset, &last_block);
+                qemu_fflush(f);
+            }
+            g_free(req);
+            continue;
+        }
+
+        offset = migration_bitmap_find_and_reset_dirty(block->mr, offset);
+        if (offset >= block->length) {
+            block = QTAILQ_NEXT(block, next);
+            offset = 0;
+            continue;
+        }
+        postcopy_send_page(f, block, offset, &last_block);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+    postcopy_src.done = !qemu_file_get_error(f);
+
+    return NULL;
+}
+
+static void *do_postcopy_return_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_src.return_file;
+    RAMPostcopyRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+
+    /* Runs until the destination closes the connection */
+    while (true) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        offset = qemu_get_be64(f);
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "Bad post-copy page request %s:" RAM_ADDR_FMT
+                    "\n", id, offset);
+            break;
+        }
+
+        req = g_new0(RAMPostcopyRequest, 1);
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+        qemu_mutex_lock(&postcopy_src.lock);
+        QSIMPLEQ_INSERT_TAIL(&postcopy_src.requests, req, next);
+        qemu_mutex_unlock(&postcopy_src.lock);
+    }
+
+    return NULL;
+}
+
+static void ram_postcopy_send_discards(QEMUFile *f)
+{
+    RAMBlock *block;
+    unsigned long base, end, start, stop;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        base = block->offset >> TARGET_PAGE_BITS;
+        end = base + (block->length >> TARGET_PAGE_BITS);
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        for (start = find_next_bit(migration_bitmap, end, base);
+             start < end;
+             start = find_next_bit(migration_bitmap, end, stop)) {
+            stop = find_next_zero_bit(migration_bitmap, end, start);
+            qemu_put_be64(f, (ram_addr_t)(start - base) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, stop - start);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+}
+
+/* Called with the VM stopped, instead of ram_save_complete() */
+static int ram_save_postcopy(QEMUFile *f, void *opaque)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    int fd, ret;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Post-copy migration needs the host page size to "
+                "match the target page size\n");
+        return -ENOTSUP;
+    }
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+    ram_bulk_stage = false;
+
+    bytes_transferred += compress_flush(f);
+    ret = ram_channels_sync(f);
+    ram_channels_close(ret >= 0);
+    if (ret < 0) {
+        goto out;
+    }
+    bytes_transferred += ret;
+
+    ram_postcopy_send_discards(f);
+    qemu_fflush(f);
+
+    /* The destination accepts the connection once it has read the above */
+    fd = migrate_open_channel(s, &local_err);
+    if (fd < 0) {
+        error_report("Could not open post-copy channel: %s",
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        ret = -EIO;
+        goto out;
+    }
+
+    postcopy_src.file = qemu_fopen_socket(fd, "wb");
+    postcopy_src.return_file = qemu_fopen_socket(dup(fd), "rb");
+    qemu_file_set_stats(postcopy_src.file, &s->stream_stats);
+    qemu_file_set_buffer_size(postcopy_src.file, migrate_buffer_size());
+    qemu_put_be32(postcopy_src.file, RAM_CHANNEL_MAGIC);
+    qemu_put_byte(postcopy_src.file, 0);
+
+    qemu_mutex_init(&postcopy_src.lock);
+    QSIMPLEQ_INIT(&postcopy_src.requests);
+    qemu_thread_create(&postcopy_src.send_thread, do_postcopy_send_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&postcopy_src.return_thread,
+                       do_postcopy_return_thread, NULL, QEMU_THREAD_JOINABLE);
+    ret = 0;
+
+out:
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return ret;
+}
+
+/* Waits until the destination has all its pages, or until the migration
+ * fails or is cancelled.  Returns 0 if all pages were sent. */
+int ram_postcopy_wait(void)
+{
+    RAMPostcopyRequest *req;
+    int ret;
+
+    if (!postcopy_src.file) {
+        return -1;
+    }
+
+    qemu_thread_join(&postcopy_src.send_thread);
+    ret = postcopy_src.done ? 0 : -1;
+    if (ret < 0) {
+        shutdown(qemu_get_fd(postcopy_src.file), 2);
+    }
+    qemu_thread_join(&postcopy_src.return_thread);
+
+    qemu_fclose(postcopy_src.file);
+    qemu_fclose(postcopy_src.return_file);
+    while ((req = QSIMPLEQ_FIRST(&postcopy_src.requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_src.requests, next);
+        g_free(req);
+    }
+    qemu_mutex_destroy(&postcopy_src.lock);
+    memset(&postcopy_src, 0, sizeof(postcopy_src));
+
+    qemu_mutex_lock_iothread();
+    migration_end();
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    int ret, rc = 0;
+    unsigned int xh_len;
+    int xh_flags;
+
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+    /* load data and decode */
+    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+    /* decode RLE */
+    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+                               TARGET_PAGE_SIZE);
+    if (ret == -1) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        rc = -1;
+    } else  if (ret > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
+                ret, TARGET_PAGE_SIZE);
+        abort();
+    }
+
+    return rc;
+}
+
+/* Compressed batches are inflated by a pool of threads straight into guest
+ * memory.  ram_load() waits for all of them before returning, so that the
+ * next section cannot race with a pending batch for the same pages. */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;                 /* protected by mutex */
+    bool quit;                  /* protected by mutex */
+    bool busy;                  /* protected by decomp.done_lock */
+
+    uint8_t *host;
+    uLongf host_len;
+    uint8_t *buf;
+    uLongf len;
+} DecompressParam;
+
+static struct {
+    DecompressParam *params;
+    int nr_threads;
+    int next;
+    bool error;                 /* protected by done_lock */
+    QemuMutex done_lock;
+    QemuCond done_cond;
+} decomp;
+
+static bool decompress_batch(uint8_t *host, uLongf host_len,
+                             const uint8_t *buf, uLongf len)
+{
+    uLongf out_len = host_len;
+
+    return uncompress(host, &out_len, buf, len) == Z_OK &&
+           out_len == host_len;
+}
+
+static void *do_decompress_thread(void *opaque)
+{
+    DecompressParam *param = opaque;
+    bool ok;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        ok = decompress_batch(param->host, param->host_len,
+                              param->buf, param->len);
+
+        qemu_mutex_lock(&decomp.done_lock);
+        if (!ok) {
+            decomp.error = true;
+        }
+        param->busy = false;
+        qemu_cond_signal(&decomp.done_cond);
+        qemu_mutex_unlock(&decomp.done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    memset(&decomp, 0, sizeof(decomp));
+    decomp.nr_threads = migrate_decompress_threads();
+    decomp.params = g_new0(DecompressParam, decomp.nr_threads);
+    qemu_mutex_init(&decomp.done_lock);
+    qemu_cond_init(&decomp.done_cond);
+
+    for (i = 0; i < decomp.nr_threads; i++) {
+        DecompressParam *param = &decomp.params[i];
+
+        param->buf = g_malloc(compressBound(COMPRESS_BATCH_PAGES *
+                                            TARGET_PAGE_SIZE));
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_decompress_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp.params) {
+        return;
+    }
+
+    for (i = 0; i < decomp.nr_threads; i++) {
+        DecompressParam *param = &decomp.params[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->buf);
+    }
+    qemu_mutex_destroy(&decomp.done_lock);
+    qemu_cond_destroy(&decomp.done_cond);
+    g_free(decomp.params);
+    decomp.params = NULL;
+}
+
+/* Reads a compressed batch of len bytes from f and inflates it to host,
+ * in a worker thread if there are any (e.g. not for loadvm). */
+static int load_compressed_batch(QEMUFile *f, void *host, int pages, int len)
+{
+    DecompressParam *param = NULL;
+    uint8_t *buf;
+    int i, idx, ret;
+
+    if (!decomp.params) {
+        buf = g_malloc(len);
+        qemu_get_buffer(f, buf, len);
+        ret = decompress_batch(host, pages * TARGET_PAGE_SIZE, buf, len) ?
+              0 : -1;
+        g_free(buf);
+        return ret;
+    }
+
+    qemu_mutex_lock(&decomp.done_lock);
+    while (!param) {
+        for (i = 0; i < decomp.nr_threads; i++) {
+            idx = (decomp.next + i) % decomp.nr_threads;
+            if (!decomp.params[idx].busy) {
+                param = &decomp.params[idx];
+                decomp.next = (idx + 1) % decomp.nr_threads;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp.done_cond, &decomp.done_lock);
+        }
+    }
+    param->busy = true;
+    qemu_mutex_unlock(&decomp.done_lock);
+
+    qemu_get_buffer(f, param->buf, len);
+    param->host = host;
+    param->host_len = pages * TARGET_PAGE_SIZE;
+    param->len = len;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return 0;
+}
+
+/* Waits for all compressed batches to be inflated */
+static int wait_for_decompress_done(void)
+{
+    int i, ret;
+
+    if (!decomp.params) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp.done_lock);
+    for (i = 0; i < decomp.nr_threads; i++) {
+        while (decomp.params[i].busy) {
+            qemu_cond_wait(&decomp.done_cond, &decomp.done_lock);
+        }
+    }
+    ret = decomp.error ? -1 : 0;
+    decomp.error = false;
+    qemu_mutex_unlock(&decomp.done_lock);
+
+    return ret;
+}
+
+static void *ram_host_from_stream(QEMUFile *f, ram_addr_t offset, int flags,
+                                  RAMBlock **last_block)
+{
+    RAMBlock *block = *last_block;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *last_block = block;
+            return memory_region_get_ram_ptr(block->mr) + offset;
+        }
+    }
+
+    *last_block = NULL;
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+/* Block of the last page read from the main stream */
+static RAMBlock *load_block;
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    return ram_host_from_stream(f, offset, flags, &load_block);
+}
+
+/* Pages received on the extra channels of a multi-channel migration are
+ * written to guest memory by a thread per connection.  At a sync on the
+ * main stream, ram_load() waits for every thread to reach the matching sync
+ * on its connection, then releases them all. */
+typedef struct RAMRecvChannel {
+    QemuThread thread;
+    QEMUFile *file;
+    bool running;
+    RAMBlock *block;            /* for RAM_SAVE_FLAG_CONTINUE */
+} RAMRecvChannel;
+
+static struct {
+    RAMRecvChannel *channels;
+    int nr;
+    QemuMutex lock;
+    QemuCond cond;
+    int arrived;                /* protected by lock */
+    uint64_t generation;        /* protected by lock */
+    bool error;                 /* protected by lock */
+    bool quit;                  /* protected by lock */
+} recv_chan;
+
+static void *do_channel_recv_thread(void *opaque)
+{
+    RAMRecvChannel *ch = opaque;
+    QEMUFile *f = ch->file;
+    ram_addr_t addr;
+    uint64_t generation;
+    void *host;
+    int flags;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_PAGE) {
+            host = ram_host_from_stream(f, addr, flags, &ch->block);
+            if (!host) {
+                break;
+            }
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_CHANNEL) {
+            qemu_mutex_lock(&recv_chan.lock);
+            generation = recv_chan.generation;
+            recv_chan.arrived++;
+            qemu_cond_broadcast(&recv_chan.cond);
+            while (recv_chan.generation == generation && !recv_chan.quit) {
+                qemu_cond_wait(&recv_chan.cond, &recv_chan.lock);
+            }
+            qemu_mutex_unlock(&recv_chan.lock);
+        } else if (flags & RAM_SAVE_FLAG_EOS) {
+            return NULL;
+        } else {
+            fprintf(stderr, "Unexpected flags %#x on a RAM channel\n", flags);
+            break;
+        }
+
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+    }
+
+    qemu_mutex_lock(&recv_chan.lock);
+    recv_chan.error = true;
+    qemu_cond_broadcast(&recv_chan.cond);
+    qemu_mutex_unlock(&recv_chan.lock);
+
+    return NULL;
+}
+
+/* Accepts nr extra connections and starts their threads */
+static int ram_channels_accept(int nr)
+{
+    QEMUFile *f;
+    int i, idx, fd;
+
+    if (recv_chan.channels || nr < 1) {
+        return -1;
+    }
+
+    recv_chan.channels = g_new0(RAMRecvChannel, nr);
+    recv_chan.nr = nr;
+    qemu_mutex_init(&recv_chan.lock);
+    qemu_cond_init(&recv_chan.cond);
+
+    for (i = 0; i < nr; i++) {
+        fd = migrate_incoming_accept_channel();
+        if (fd < 0) {
+            fprintf(stderr, "Could not accept RAM channel\n");
+            return -1;
+        }
+
+        f = qemu_fopen_socket(fd, "rb");
+        if (qemu_get_be32(f) != RAM_CHANNEL_MAGIC) {
+            fprintf(stderr, "Bad RAM channel header\n");
+            qemu_fclose(f);
+            return -1;
+        }
+        idx = qemu_get_byte(f);
+        if (idx < 1 || idx > nr || recv_chan.channels[idx - 1].file) {
+            fprintf(stderr, "Bad RAM channel index %d\n", idx);
+            qemu_fclose(f);
+            return -1;
+        }
+        recv_chan.channels[idx - 1].file = f;
     }
 
-    qemu_mutex_lock_iothread();
-    qemu_mutex_lock_ramlist();
-    bytes_transferred = 0;
-    reset_ram_globals();
+    for (i = 0; i < nr; i++) {
+        RAMRecvChannel *ch = &recv_chan.channels[i];
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-    qemu_mutex_unlock_iothread();
+        qemu_thread_create(&ch->thread, do_channel_recv_thread, ch,
+                           QEMU_THREAD_JOINABLE);
+        ch->running = true;
+    }
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    return 0;
+}
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
-    }
+/* Waits for all channels to reach a sync, then releases them */
+static int ram_channels_wait_sync(void)
+{
+    int ret;
 
-    qemu_mutex_unlock_ramlist();
+    if (!recv_chan.channels) {
+        return -1;
+    }
 
-    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
-    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+    qemu_mutex_lock(&recv_chan.lock);
+    while (recv_chan.arrived < recv_chan.nr && !recv_chan.error) {
+        qemu_cond_wait(&recv_chan.cond, &recv_chan.lock);
+    }
+    ret = recv_chan.error ? -1 : 0;
+    recv_chan.arrived = 0;
+    recv_chan.generation++;
+    qemu_cond_broadcast(&recv_chan.cond);
+    qemu_mutex_unlock(&recv_chan.lock);
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return ret;
+}
 
-    return 0;
+static int load_channel_command(QEMUFile *f)
+{
+    switch (qemu_get_byte(f)) {
+    case RAM_CHANNEL_OPEN:
+        return ram_channels_accept(qemu_get_byte(f));
+    case RAM_CHANNEL_SYNC:
+        return ram_channels_wait_sync();
+    default:
+        return -1;
+    }
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+/* Called once the whole migration stream is loaded.  All pages have been
+ * applied at the last sync, so the connections are simply shut down. */
+void migrate_ram_channels_join(void)
 {
-    int ret;
     int i;
-    int64_t t0;
-    int total_sent = 0;
-
-    qemu_mutex_lock_ramlist();
 
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
+    if (!recv_chan.channels) {
+        return;
     }
 
-    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    qemu_mutex_lock(&recv_chan.lock);
+    recv_chan.quit = true;
+    qemu_cond_broadcast(&recv_chan.cond);
+    qemu_mutex_unlock(&recv_chan.lock);
 
-    t0 = qemu_get_clock_ns(rt_clock);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+    for (i = 0; i < recv_chan.nr; i++) {
+        RAMRecvChannel *ch = &recv_chan.channels[i];
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
+        if (ch->running) {
+            shutdown(qemu_get_fd(ch->file), 2);
+            qemu_thread_join(&ch->thread);
         }
-        total_sent += bytes_sent;
-        acct_info.iterations++;
-        check_guest_throttling();
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
-                break;
-            }
+        if (ch->file) {
+            qemu_fclose(ch->file);
         }
-        i++;
     }
+    qemu_mutex_destroy(&recv_chan.lock);
+    qemu_cond_destroy(&recv_chan.cond);
+    g_free(recv_chan.channels);
+    memset(&recv_chan, 0, sizeof(recv_chan));
+}
 
-    qemu_mutex_unlock_ramlist();
+/* Post-copy migration, destination side
+ *
+ * The pages listed by the source are discarded and the post-copy layer
+ * catches the accesses to them; each is requested from the source on the
+ * post-copy connection.  A thread writes the pages that arrive on it, and
+ * a bottom half tears everything down once they have all arrived.
+ */
+typedef struct RAMPostcopyDiscard {
+    void *host;
+    size_t length;
+} RAMPostcopyDiscard;
 
-    /*
-     * Must occur before EOS (or any QEMUFile operation)
-     * because of RDMA protocol.
-     */
-    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+static struct {
+    QEMUFile *file;             /* pages from the source */
+    QEMUFile *return_file;      /* requests to the source */
+    QemuThread thread;
+    QEMUBH *bh;
+    bool error;
+} postcopy_dst;
+
+/* Called from the fault thread */
+static void ram_postcopy_request(void *host, void *opaque)
+{
+    QEMUFile *f = postcopy_dst.return_file;
+    RAMBlock *block;
 
-    if (ret < 0) {
-        bytes_transferred += total_sent;
-        return ret;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if ((uint8_t *)host >= block->host &&
+            (uint8_t *)host < block->host + block->length) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, (uint8_t *)host - block->host);
+            qemu_fflush(f);
+            return;
+        }
     }
-
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    total_sent += 8;
-    bytes_transferred += total_sent;
-
-    return total_sent;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+static void *do_postcopy_recv_thread(void *opaque)
 {
-    qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
+    QEMUFile *f = postcopy_dst.file;
+    RAMBlock *block = NULL;
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    void *host;
+    int flags;
 
-    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+    while (true) {
+        addr = qemu_get_be64(f);
 
-    /* try transferring iterative blocks of memory */
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (!(flags & (RAM_SAVE_FLAG_PAGE | RAM_SAVE_FLAG_COMPRESS))) {
+            fprintf(stderr, "Unexpected flags %#x on the post-copy "
+                    "channel\n", flags);
+            postcopy_dst.error = true;
+            break;
+        }
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        host = ram_host_from_stream(f, addr, flags, &block);
+        if (!host) {
+            postcopy_dst.error = true;
             break;
         }
-        bytes_transferred += bytes_sent;
-    }
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(buf, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        } else {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        }
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+        if (qemu_file_get_error(f) ||
+            postcopy_incoming_place(host, buf) < 0) {
+            postcopy_dst.error = true;
+            break;
+        }
+    }
+    g_free(buf);
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_bh_schedule(postcopy_dst.bh);
 
-    return 0;
+    return NULL;
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+static void ram_postcopy_incoming_done(void *opaque)
 {
-    uint64_t remaining_size;
-
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    qemu_thread_join(&postcopy_dst.thread);
+    qemu_bh_delete(postcopy_dst.bh);
 
-    if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    if (postcopy_dst.error) {
+        /* The guest cannot run without its missing pages */
+        fprintf(stderr, "Post-copy migration failed\n");
+        exit(EXIT_FAILURE);
     }
-    return remaining_size;
+
+    postcopy_incoming_cleanup();
+    qemu_fclose(postcopy_dst.file);
+    qemu_fclose(postcopy_dst.return_file);
+    memset(&postcopy_dst, 0, sizeof(postcopy_dst));
+    DPRINTF("Post-copy migration completed\n");
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+static GArray *ram_postcopy_load_discards(QEMUFile *f)
 {
-    int ret, rc = 0;
-    unsigned int xh_len;
-    int xh_flags;
-
-    if (!XBZRLE.decoded_buf) {
-        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
-    }
+    GArray *discards = g_array_new(false, false, sizeof(RAMPostcopyDiscard));
+    RAMPostcopyDiscard d;
+    RAMBlock *block;
+    uint64_t offset, npages;
+    char id[256];
+    uint8_t len;
 
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    while ((len = qemu_get_byte(f)) != 0) {
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
-        return -1;
-    }
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            goto fail;
+        }
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
-        return -1;
+        while (true) {
+            offset = qemu_get_be64(f);
+            npages = qemu_get_be64(f);
+            if (!npages) {
+                break;
+            }
+            if (offset >= block->length ||
+                npages > (block->length - offset) >> TARGET_PAGE_BITS) {
+                fprintf(stderr, "Bad post-copy discard %s:" RAM_ADDR_FMT
+                        "\n", id, (ram_addr_t)offset);
+                goto fail;
+            }
+            d.host = block->host + offset;
+            d.length = npages << TARGET_PAGE_BITS;
+            g_array_append_val(discards, d);
+        }
+        if (qemu_file_get_error(f)) {
+            goto fail;
+        }
     }
-    /* load data and decode */
-    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
-        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
-    }
+    return discards;
 
-    return rc;
+fail:
+    g_array_free(discards, true);
+    return NULL;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static int ram_postcopy_incoming(QEMUFile *f)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    RAMPostcopyDiscard *d;
+    GArray *discards;
+    RAMBlock *block;
+    int i, fd, ret = -1;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
+    if (postcopy_dst.file || getpagesize() != TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+#if defined(__linux__) && !defined(TARGET_S390X)
+    /* Discarding a page of a file mapping does not drop its contents */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd) {
+            fprintf(stderr, "Post-copy does not support -mem-path RAM\n");
+            return -1;
         }
+    }
+#endif
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
+    /* Read the whole list first: the source only connects afterwards */
+    discards = ram_postcopy_load_discards(f);
+    if (!discards) {
+        return -1;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+    fd = migrate_incoming_accept_channel();
+    if (fd < 0) {
+        fprintf(stderr, "Could not accept post-copy channel\n");
+        goto out;
+    }
+    postcopy_dst.file = qemu_fopen_socket(fd, "rb");
+    postcopy_dst.return_file = qemu_fopen_socket(dup(fd), "wb");
+    if (qemu_get_be32(postcopy_dst.file) != RAM_CHANNEL_MAGIC ||
+        qemu_get_byte(postcopy_dst.file) != 0) {
+        fprintf(stderr, "Bad post-copy channel header\n");
+        goto out;
+    }
 
+    if (postcopy_incoming_init(ram_postcopy_request, NULL) < 0) {
+        fprintf(stderr, "Could not catch accesses to missing pages\n");
+        goto out;
+    }
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+        if (postcopy_incoming_add_range(block->host, block->length) < 0) {
+            goto out_cleanup;
+        }
+    }
+    for (i = 0; i < discards->len; i++) {
+        d = &g_array_index(discards, RAMPostcopyDiscard, i);
+        if (postcopy_incoming_discard(d->host, d->length) < 0) {
+            goto out_cleanup;
+        }
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+    postcopy_dst.bh = qemu_bh_new(ram_postcopy_incoming_done, NULL);
+    qemu_thread_create(&postcopy_dst.thread, do_postcopy_recv_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    ret = 0;
+    goto out;
+
+out_cleanup:
+    postcopy_incoming_cleanup();
+out:
+    if (ret < 0 && postcopy_dst.file) {
+        qemu_fclose(postcopy_dst.file);
+        qemu_fclose(postcopy_dst.return_file);
+        memset(&postcopy_dst, 0, sizeof(postcopy_dst));
+    }
+    g_array_free(discards, true);
+    return ret;
 }
 
 /*
@@ -922,7 +2579,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             ch = qemu_get_byte(f);
@@ -932,20 +2590,67 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             if (load_xbzrle(f, addr, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            int pages, len;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            pages = qemu_get_be16(f);
+            len = qemu_get_be32(f);
+            if (pages < 1 || pages > COMPRESS_BATCH_PAGES || len < 0 ||
+                len > compressBound(COMPRESS_BATCH_PAGES * TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed batch: %d pages, "
+                        "%d bytes\n", pages, len);
+                ret = -EINVAL;
+                goto done;
+            }
+            if (addr >= load_block->length ||
+                (load_block->length - addr) / TARGET_PAGE_SIZE < pages) {
+                fprintf(stderr, "Compressed batch at " RAM_ADDR_FMT
+                        " runs past the end of block %s\n", addr,
+                        load_block->idstr);
+                ret = -EINVAL;
+                goto done;
+            }
+            if (load_compressed_batch(f, host, pages, len) < 0) {
+                fprintf(stderr, "Failed to decompress pages at "
+                        RAM_ADDR_FMT "\n", addr);
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_CHANNEL) {
+            if (load_channel_command(f) < 0) {
+                fprintf(stderr, "Failed to load pages from RAM channels\n");
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (ram_postcopy_incoming(f) < 0) {
+                fprintf(stderr, "Failed to switch to post-copy migration\n");
+                ret = -EINVAL;
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         }
@@ -957,6 +2662,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        fprintf(stderr, "Failed to decompress pages\n");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -966,6 +2675,7 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_postcopy = ram_save_postcopy,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
@@ -1182,13 +2892,27 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
+/* Auto-converge lets the vCPUs run for MIG_THROTTLE_TIMESLICE, then puts
+ * them to sleep for long enough that they spend mig_throttle of the time
+ * outside the guest.
+ */
+#define MIG_THROTTLE_TIMESLICE 10 /* ms */
+
+static QEMUTimer *mig_throttle_timer;
+/* Sleeps queued by the last round that did not complete yet */
+static int mig_throttle_pending;
+
 /* Stub function that's gets run on the vcpu when its brought out of the
    VM to run inside qemu via async_run_on_cpu()*/
 static void mig_sleep_cpu(void *opq)
 {
+    int64_t sleep_us = MIG_THROTTLE_TIMESLICE * 1000 * mig_throttle /
+                       (1 - mig_throttle);
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(sleep_us);
     qemu_mutex_lock_iothread();
+    mig_throttle_pending--;
 }
 
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
@@ -1197,37 +2921,39 @@ static void mig_sleep_cpu(void *opq)
 */
 static void mig_throttle_cpu_down(CPUState *cpu, void *data)
 {
+    mig_throttle_pending++;
     async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
 }
 
-static void mig_throttle_guest_down(void)
+static void mig_throttle_timer_cb(void *opaque)
 {
-    qemu_mutex_lock_iothread();
-    qemu_for_each_cpu(mig_throttle_cpu_down, NULL);
-    qemu_mutex_unlock_iothread();
+    /* Do not pile up sleeps if a vCPU is slow to pick them up */
+    if (!mig_throttle_pending) {
+        qemu_for_each_cpu(mig_throttle_cpu_down, NULL);
+    }
+    qemu_mod_timer(mig_throttle_timer, qemu_get_clock_ms(rt_clock) +
+                   MIG_THROTTLE_TIMESLICE / (1 - mig_throttle));
 }
 
-static void check_guest_throttling(void)
+static void mig_throttle_set(double throttle)
 {
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
+    if (throttle != mig_throttle) {
+        trace_migration_throttle(throttle * 100 + 0.5);
     }
+    mig_throttle = throttle;
 
-    if (!t0)  {
-        t0 = qemu_get_clock_ns(rt_clock);
+    if (throttle == 0) {
+        if (mig_throttle_timer) {
+            qemu_del_timer(mig_throttle_timer);
+        }
         return;
     }
 
-    t1 = qemu_get_clock_ns(rt_clock);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
+    if (!mig_throttle_timer) {
+        mig_throttle_timer = qemu_new_timer_ms(rt_clock,
+                                               mig_throttle_timer_cb, NULL);
+    }
+    if (!qemu_timer_pending(mig_throttle_timer)) {
+        qemu_mod_timer(mig_throttle_timer, qemu_get_clock_ms(rt_clock));
     }
 }
@@ -31,7 +31,18 @@
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
-#define MAX_IS_ALLOCATED_SEARCH 65536
+/* Largest read issued by the bulk phase, in chunks of BLOCK_SIZE bytes.
+ * Reads cover whole allocated extents up to this size.
+ */
+#define BLK_MIG_MAX_CHUNKS 16
+
+/* Alignment of the chunk buffers, enough for O_DIRECT */
+#define BLK_MIG_BUF_ALIGN 4096
+
+/* Allocation status lookups done by one call of mig_save_device_bulk */
+#define BLK_MIG_MAX_LOOKUPS 64
+
+#define MAX_IS_ALLOCATED_SEARCH (1 << 21)
 
 //#define DEBUG_BLK_MIGRATION
 
@@ -55,18 +66,26 @@ typedef struct BlkMigDevState {
     int64_t cur_sector;
     int64_t cur_dirty;
 
+    /* Allocation status of the sectors up to alloc_end, looked up ahead
+     * of cur_sector by the bulk phase.  Only used by migration thread.
+     */
+    int64_t alloc_end;
+    bool allocated;
+
     /* Protected by block migration lock.  */
     unsigned long *aio_bitmap;
     int64_t completed_sectors;
+    int inflight;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
     /* Only used by migration thread.  */
-    uint8_t *buf;
+    uint8_t *buf[BLK_MIG_MAX_CHUNKS];
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
-    struct iovec iov;
+    int nr_chunks;
+    struct iovec iov[BLK_MIG_MAX_CHUNKS];
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
 
@@ -82,17 +101,26 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    int max_inflight;
 
-    /* Protected by lock.  */
+    /* Protected by lock.  Counted in chunks.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
     int read_done;
 
     /* Only used by migration thread.  Does not need a lock.  */
+    QSIMPLEQ_HEAD(ready_list, BlkMigBlock) ready_list;
+    int ready;
     int transferred;
     int prev_progress;
     int bulk_completed;
 
+    /* Pool of chunk buffers, only used by migration thread.  */
+    uint8_t **free_bufs;
+    int nr_free_bufs;
+    int max_free_bufs;
+    uint8_t *zero_buf;
+
     /* Lock must be taken _inside_ the iothread lock.  */
     QemuMutex lock;
 } BlkMigState;
@@ -109,38 +137,133 @@ static void blk_mig_unlock(void)
     qemu_mutex_unlock(&block_mig_state.lock);
 }
 
-/* Must run outside of the iothread lock during the bulk phase,
- * or the VM will stall.
- */
+static uint8_t *blk_mig_buf_get(void)
+{
+    if (block_mig_state.nr_free_bufs) {
+        return block_mig_state.free_bufs[--block_mig_state.nr_free_bufs];
+    }
+    return qemu_memalign(BLK_MIG_BUF_ALIGN, BLOCK_SIZE);
+}
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_mig_buf_put(uint8_t *buf)
 {
-    int len;
-    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+    if (block_mig_state.nr_free_bufs == block_mig_state.max_free_bufs) {
+        block_mig_state.max_free_bufs =
+            MAX(BLK_MIG_MAX_CHUNKS, block_mig_state.max_free_bufs * 2);
+        block_mig_state.free_bufs = g_renew(uint8_t *,
+                                            block_mig_state.free_bufs,
+                                            block_mig_state.max_free_bufs);
+    }
+    block_mig_state.free_bufs[block_mig_state.nr_free_bufs++] = buf;
+}
+
+static BlkMigBlock *blk_mig_alloc_block(BlkMigDevState *bmds, int64_t sector,
+                                        int nr_sectors)
+{
+    BlkMigBlock *blk = g_malloc(sizeof(BlkMigBlock));
+    int i, len;
 
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
-        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->nr_chunks = DIV_ROUND_UP(nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+    assert(blk->nr_chunks <= BLK_MIG_MAX_CHUNKS);
+
+    for (i = 0; i < blk->nr_chunks; i++) {
+        len = MIN(nr_sectors - i * BDRV_SECTORS_PER_DIRTY_CHUNK,
+                  BDRV_SECTORS_PER_DIRTY_CHUNK) << BDRV_SECTOR_BITS;
+        blk->buf[i] = blk_mig_buf_get();
+        blk->iov[i].iov_base = blk->buf[i];
+        blk->iov[i].iov_len = len;
+
+        /* the whole chunk goes on the wire, don't leak stale data */
+        if (len < BLOCK_SIZE) {
+            memset(blk->buf[i] + len, 0, BLOCK_SIZE - len);
+        }
     }
+    qemu_iovec_init_external(&blk->qiov, blk->iov, blk->nr_chunks);
+    return blk;
+}
+
+static void blk_mig_free_block(BlkMigBlock *blk)
+{
+    int i;
+
+    for (i = 0; i < blk->nr_chunks; i++) {
+        blk_mig_buf_put(blk->buf[i]);
+    }
+    g_free(blk);
+}
+
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
+{
+    int len;
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
                      | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
+    len = strlen(bmds->bs->device_name);
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
 
-    /* if a block is zero we need to flush here since the network
-     * bandwidth is now a lot higher than the storage device bandwidth.
-     * thus if we queue zero blocks we slow down the migration */
-    if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
-        qemu_fflush(f);
-        return;
+/* Must run outside of the iothread lock during the bulk phase,
+ * or the VM will stall.
+ */
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    int64_t sector;
+    int i;
+
+    for (i = 0; i < blk->nr_chunks; i++) {
+        sector = blk->sector + i * BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+        /* if a block is zero we need to flush here since the network
+         * bandwidth is now a lot higher than the storage device bandwidth.
+         * thus if we queue zero blocks we slow down the migration */
+        if (block_mig_state.zero_blocks &&
+            buffer_is_zero(blk->buf[i], BLOCK_SIZE)) {
+            blk_send_header(f, blk->bmds, sector,
+                            BLK_MIG_FLAG_DEVICE_BLOCK |
+                            BLK_MIG_FLAG_ZERO_BLOCK);
+            qemu_fflush(f);
+            continue;
+        }
+
+        blk_send_header(f, blk->bmds, sector, BLK_MIG_FLAG_DEVICE_BLOCK);
+        qemu_put_buffer(f, blk->buf[i], BLOCK_SIZE);
     }
+}
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+/* Send the chunks from sector to end, which read as zeroes, without
+ * reading them.
+ */
+
+static void blk_send_zeroes(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, int64_t end)
+{
+    for (; sector < end; sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        if (block_mig_state.zero_blocks) {
+            blk_send_header(f, bmds, sector,
+                            BLK_MIG_FLAG_DEVICE_BLOCK |
+                            BLK_MIG_FLAG_ZERO_BLOCK);
+            continue;
+        }
+
+        if (!block_mig_state.zero_buf) {
+            block_mig_state.zero_buf = g_malloc0(BLOCK_SIZE);
+        }
+        blk_send_header(f, bmds, sector, BLK_MIG_FLAG_DEVICE_BLOCK);
+        qemu_put_buffer(f, block_mig_state.zero_buf, BLOCK_SIZE);
+    }
+
+    if (block_mig_state.zero_blocks) {
+        qemu_fflush(f);
+    }
 }
 
 int blk_mig_active(void)
@@ -239,31 +362,97 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+    blk->bmds->inflight--;
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
+    block_mig_state.submitted -= blk->nr_chunks;
+    block_mig_state.read_done += blk->nr_chunks;
     assert(block_mig_state.submitted >= 0);
     blk_mig_unlock();
 }
 
+/* Look up the allocation status of the sectors starting at sector.
+ * Extents are usually much larger than a chunk, so this is done once
+ * for many chunks rather than for every chunk that is read.
+ *
+ * Called with iothread lock taken.
+ */
+
+static void bmds_lookup_allocation(BlkMigDevState *bmds, int64_t sector)
+{
+    int nr_sectors;
+    int ret;
+
+    if (bmds->shared_base) {
+        /* the destination has the backing file already */
+        ret = bdrv_is_allocated(bmds->bs, sector, MAX_IS_ALLOCATED_SEARCH,
+                                &nr_sectors);
+    } else {
+        /* sectors that no image of the chain has read as zeroes */
+        ret = bdrv_is_allocated_above(bmds->bs, NULL, sector,
+                                      MAX_IS_ALLOCATED_SEARCH, &nr_sectors);
+    }
+
+    if (ret < 0 || nr_sectors <= 0) {
+        /* just read what cannot be looked up */
+        ret = 1;
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+
+    bmds->alloc_end = sector + nr_sectors;
+    bmds->allocated = ret;
+}
+
 /* Called with no lock taken.  */
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds,
+                                int max_chunks)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
+    int64_t max_sectors = (int64_t)max_chunks * BDRV_SECTORS_PER_DIRTY_CHUNK;
+    int64_t skip_end, end;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
     int nr_sectors;
+    int i;
 
-    if (bmds->shared_base) {
-        qemu_mutex_lock_iothread();
-        while (cur_sector < total_sectors &&
-               !bdrv_is_allocated(bs, cur_sector, MAX_IS_ALLOCATED_SEARCH,
-                                  &nr_sectors)) {
-            cur_sector += nr_sectors;
+    /* skip the chunks that are not allocated at all.  With a shared base
+     * they are not sent; otherwise they are sent as zeroes, so only skip
+     * as many as the rate limit allows.
+     */
+    skip_end = cur_sector;
+    qemu_mutex_lock_iothread();
+    for (i = 0; i < BLK_MIG_MAX_LOOKUPS && skip_end < total_sectors; i++) {
+        if (skip_end >= bmds->alloc_end) {
+            bmds_lookup_allocation(bmds, skip_end);
+        }
+        if (bmds->allocated) {
+            break;
+        }
+
+        end = bmds->alloc_end & ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        if (bmds->alloc_end >= total_sectors) {
+            end = total_sectors;
+        }
+        if (end <= skip_end) {
+            /* the chunk is partly allocated */
+            break;
+        }
+        skip_end = end;
+
+        if (!bmds->shared_base && skip_end - cur_sector >= max_sectors) {
+            skip_end = cur_sector + max_sectors;
+            break;
         }
-        qemu_mutex_unlock_iothread();
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (skip_end > cur_sector) {
+        if (!bmds->shared_base) {
+            blk_send_zeroes(f, bmds, cur_sector, skip_end);
+        }
+        bmds->cur_sector = bmds->completed_sectors = skip_end;
+        return (bmds->cur_sector >= total_sectors);
     }
 
     if (cur_sector >= total_sectors) {
@@ -273,27 +462,23 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     bmds->completed_sectors = cur_sector;
 
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
-
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
+    /* read the whole allocated extent if the rate limit allows it, or the
+     * partly allocated chunk.
+     */
+    if (bmds->allocated) {
+        end = MIN(bmds->alloc_end, cur_sector + max_sectors);
+        end = ROUND_UP(end, (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK);
+    } else {
+        end = cur_sector + BDRV_SECTORS_PER_DIRTY_CHUNK;
     }
+    nr_sectors = MIN(end, total_sectors) - cur_sector;
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
-
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    blk = blk_mig_alloc_block(bmds, cur_sector, nr_sectors);
 
     blk_mig_lock();
-    block_mig_state.submitted++;
+    block_mig_state.submitted += blk->nr_chunks;
+    bmds->inflight++;
+    bmds_set_aio_inflight(bmds, cur_sector, nr_sectors, 1);
     blk_mig_unlock();
 
     qemu_mutex_lock_iothread();
@@ -356,36 +541,52 @@ static void init_blk_migration(QEMUFile *f)
 {
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
+    block_mig_state.ready = 0;
     block_mig_state.transferred = 0;
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.max_inflight = migrate_block_inflight();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
 
-/* Called with no lock taken.  */
-
-static int blk_mig_save_bulked_block(QEMUFile *f)
+/* Called with no lock taken.
+ *
+ * Reads up to max_chunks chunks from the first device that has less than
+ * the maximum number of reads in flight.
+ *
+ * return value:
+ * 0: bulk phase completed on all devices
+ * 1: more chunks to read
+ * 2: all devices have the maximum number of reads in flight
+ */
+static int blk_mig_save_bulked_block(QEMUFile *f, int max_chunks)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
     int progress;
     int ret = 0;
+    bool busy;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
-                /* completed bulk section for this device */
-                bmds->bulk_completed = 1;
+        if (bmds->bulk_completed == 0 && ret != 1) {
+            blk_mig_lock();
+            busy = bmds->inflight >= block_mig_state.max_inflight;
+            blk_mig_unlock();
+
+            if (busy) {
+                ret = 2;
+            } else {
+                if (mig_save_device_bulk(f, bmds, max_chunks) == 1) {
+                    /* completed bulk section for this device */
+                    bmds->bulk_completed = 1;
+                }
+                ret = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -439,33 +640,25 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
+            blk = blk_mig_alloc_block(bmds, sector, nr_sectors);
 
             if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
                 blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
                                             nr_sectors, blk_mig_read_cb, blk);
 
                 blk_mig_lock();
-                block_mig_state.submitted++;
+                block_mig_state.submitted += blk->nr_chunks;
+                bmds->inflight++;
                 bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
                 blk_mig_unlock();
             } else {
-                ret = bdrv_sync_read(bmds->bs, sector, blk->buf, nr_sectors);
+                ret = bdrv_sync_read(bmds->bs, sector, blk->buf[0],
+                                     nr_sectors);
                 if (ret < 0) {
                     goto error;
                 }
                 blk_send(f, blk);
-
-                g_free(blk->buf);
-                g_free(blk);
+                blk_mig_free_block(blk);
             }
 
             bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
@@ -479,8 +672,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_mig_free_block(blk);
     return ret;
 }
 
@@ -516,8 +708,14 @@ static int flush_blks(QEMUFile *f)
             __FUNCTION__, block_mig_state.submitted, block_mig_state.read_done,
             block_mig_state.transferred);
 
+    /* take all completed reads at once, then send them without the lock */
     blk_mig_lock();
-    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
+    QSIMPLEQ_CONCAT(&block_mig_state.ready_list, &block_mig_state.blk_list);
+    block_mig_state.ready += block_mig_state.read_done;
+    block_mig_state.read_done = 0;
+    blk_mig_unlock();
+
+    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.ready_list)) != NULL) {
         if (qemu_file_rate_limit(f)) {
             break;
         }
@@ -526,19 +724,15 @@ static int flush_blks(QEMUFile *f)
             break;
         }
 
-        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        blk_mig_unlock();
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.ready_list, entry);
         blk_send(f, blk);
-        blk_mig_lock();
 
-        g_free(blk->buf);
-        g_free(blk);
+        block_mig_state.ready -= blk->nr_chunks;
+        block_mig_state.transferred += blk->nr_chunks;
+        assert(block_mig_state.ready >= 0);
 
-        block_mig_state.read_done--;
-        block_mig_state.transferred++;
-        assert(block_mig_state.read_done >= 0);
+        blk_mig_free_block(blk);
     }
-    blk_mig_unlock();
 
     DPRINTF("%s Exit submitted %d read_done %d transferred %d\n", __FUNCTION__,
             block_mig_state.submitted, block_mig_state.read_done,
@@ -580,12 +774,21 @@ static void blk_mig_cleanup(void)
         g_free(bmds);
     }
 
-    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+    QSIMPLEQ_CONCAT(&block_mig_state.ready_list, &block_mig_state.blk_list);
+    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.ready_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.ready_list, entry);
+        blk_mig_free_block(blk);
     }
     blk_mig_unlock();
+
+    while (block_mig_state.nr_free_bufs) {
+        qemu_vfree(block_mig_state.free_bufs[--block_mig_state.nr_free_bufs]);
+    }
+    g_free(block_mig_state.free_bufs);
+    block_mig_state.free_bufs = NULL;
+    block_mig_state.max_free_bufs = 0;
+    g_free(block_mig_state.zero_buf);
+    block_mig_state.zero_buf = NULL;
 }
 
 static void block_migration_cancel(void *opaque)
@@ -614,10 +817,25 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     return ret;
 }
 
+/* Called with migration lock held.
+ *
+ * Returns the number of chunks that can still be read without going
+ * over the rate limit.  Reads never complete within one period if
+ * they are not allowed to be bigger than the limit, so one chunk can
+ * always be read when none is pending.
+ */
+static int64_t blk_mig_budget(QEMUFile *f)
+{
+    return DIV_ROUND_UP(qemu_file_get_rate_limit(f), BLOCK_SIZE) -
+           (block_mig_state.submitted + block_mig_state.read_done +
+            block_mig_state.ready);
+}
+
 static int block_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
     int64_t last_ftell = qemu_ftell(f);
+    int64_t budget;
 
     DPRINTF("Enter save live iterate submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
@@ -631,17 +849,18 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     /* control the rate of transfer */
     blk_mig_lock();
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    while ((budget = blk_mig_budget(f)) > 0 && !qemu_file_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f, MIN(budget,
+                                                   BLK_MIG_MAX_CHUNKS));
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
             }
-            ret = 0;
+            /* if all devices are busy, wait for reads to complete */
+            ret = (ret == 2);
         } else {
             /* Always called with iothread lock taken for
              * simplicity, block_save_complete also calls it.
@@ -655,7 +874,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
         }
         blk_mig_lock();
         if (ret != 0) {
-            /* no more dirty blocks */
+            /* no more dirty blocks, or no device can take more reads */
             break;
         }
     }
@@ -719,7 +938,8 @@ static uint64_t block_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     blk_mig_lock();
     pending = get_remaining_dirty() +
                        block_mig_state.submitted * BLOCK_SIZE +
-                       block_mig_state.read_done * BLOCK_SIZE;
+                       block_mig_state.read_done * BLOCK_SIZE +
+                       block_mig_state.ready * BLOCK_SIZE;
 
     /* Report at least one block pending during bulk phase */
     if (pending == 0 && !block_mig_state.bulk_completed) {
@@ -841,6 +1061,7 @@ void blk_mig_init(void)
 {
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
+    QSIMPLEQ_INIT(&block_mig_state.ready_list);
     qemu_mutex_init(&block_mig_state.lock);
 
     register_savevm_live(NULL, "block", 0, 1, &savevm_block_handlers,
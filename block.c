@@ -3085,6 +3085,56 @@ int bdrv_sync_truncate(BlockDriverState *bs, int64_t offset)
 
 
 
+struct ResizeCacheCo {
+    BlockDriverState *bs;
+    const char *name;
+    int64_t size;
+    int ret;
+};
+
+static void coroutine_fn bdrv_resize_cache_co_entry(void *opaque)
+{
+    struct ResizeCacheCo *rcco = opaque;
+    rcco->ret = bdrv_resize_cache(rcco->bs, rcco->name, rcco->size);
+}
+
+int bdrv_sync_resize_cache(BlockDriverState *bs, const char *name,
+                           int64_t size)
+{
+    Coroutine *co;
+    struct ResizeCacheCo rcco = {
+        .bs = bs,
+        .name = name,
+        .size = size,
+        .ret = NOT_DONE,
+    };
+
+    co = qemu_coroutine_create(bdrv_resize_cache_co_entry);
+    qemu_coroutine_enter(co, &rcco);
+    while (rcco.ret == NOT_DONE) {
+        qemu_aio_wait();
+    }
+
+    return rcco.ret;
+}
+
+/**
+ * Change the size in bytes of a metadata cache of the image format driver
+ */
+int coroutine_fn bdrv_resize_cache(BlockDriverState *bs, const char *name,
+                                   int64_t size)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_resize_cache) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_resize_cache(bs, name, size);
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
@@ -289,6 +289,11 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
         s->parent = bdrv_query_stats(bs->file);
     }
 
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->caches = bs->drv->bdrv_get_cache_stats(bs);
+        s->has_caches = s->caches != NULL;
+    }
+
     return s;
 }
 
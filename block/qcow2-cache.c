@@ -27,35 +27,151 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are replaced using the 2Q policy: a table read from disk enters the
+ * a1in FIFO and is only promoted to the am LRU list if it is requested again
+ * after having been evicted from a1in.  A scan over many tables thus only
+ * pollutes a1in, while frequently used tables stay in am.  The offsets of the
+ * tables recently evicted from a1in are remembered in a ghost FIFO.
+ */
+
+typedef enum {
+    QCOW2_CACHE_FREE,
+    QCOW2_CACHE_A1IN,
+    QCOW2_CACHE_AM,
+} Qcow2CacheQueue;
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;
+    Qcow2CacheQueue queue;
+    QTAILQ_ENTRY(Qcow2CachedTable) next;
 } Qcow2CachedTable;
 
+typedef QTAILQ_HEAD(Qcow2CacheList, Qcow2CachedTable) Qcow2CacheList;
+
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    void*                   table_array;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+
+    /* Entries by offset, chained through hash_next */
+    int*                    buckets;
+    unsigned int            hash_mask;
+
+    /* Newest entries are at the head of each list */
+    Qcow2CacheList          free;
+    Qcow2CacheList          a1in;
+    Qcow2CacheList          am;
+    int                     a1in_len;
+    int                     a1in_max;
+
+    /* Ring of offsets evicted from a1in, hashed like the entries */
+    int64_t*                ghosts;
+    int*                    ghost_next;
+    int*                    ghost_buckets;
+    unsigned int            ghost_mask;
+    int                     ghost_max;
+    int                     ghost_head;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static unsigned int qcow2_cache_hash_size(int n)
 {
-    BDRVQcowState *s = bs->opaque;
-    Qcow2Cache *c;
+    unsigned int size = 1;
+
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static unsigned int qcow2_cache_hash(uint64_t offset, unsigned int mask)
+{
+    return ((offset >> 9) * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+}
+
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t offset = (uint8_t *) table - (uint8_t *) c->table_array;
+
+    if (offset < 0 || offset % c->table_size ||
+        offset / c->table_size >= c->size) {
+        return -1;
+    }
+    return offset / c->table_size;
+}
+
+static void qcow2_cache_init_tables(BlockDriverState *bs, Qcow2Cache *c,
+                                    int num_tables)
+{
+    unsigned int nb_buckets;
     int i;
 
-    c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t) num_tables * c->table_size);
 
+    nb_buckets = qcow2_cache_hash_size(num_tables);
+    c->hash_mask = nb_buckets - 1;
+    c->buckets = g_malloc(sizeof(*c->buckets) * nb_buckets);
+    memset(c->buckets, -1, sizeof(*c->buckets) * nb_buckets);
+
+    QTAILQ_INIT(&c->free);
+    QTAILQ_INIT(&c->a1in);
+    QTAILQ_INIT(&c->am);
+    c->a1in_len = 0;
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->free, &c->entries[i], next);
     }
 
+    /* The sizes suggested in the 2Q paper */
+    c->a1in_max = MAX(num_tables / 4, 1);
+    c->ghost_max = MAX(num_tables / 2, 1);
+    c->ghost_head = 0;
+    c->ghosts = g_malloc0(sizeof(*c->ghosts) * c->ghost_max);
+    c->ghost_next = g_malloc(sizeof(*c->ghost_next) * c->ghost_max);
+    memset(c->ghost_next, -1, sizeof(*c->ghost_next) * c->ghost_max);
+
+    nb_buckets = qcow2_cache_hash_size(c->ghost_max);
+    c->ghost_mask = nb_buckets - 1;
+    c->ghost_buckets = g_malloc(sizeof(*c->ghost_buckets) * nb_buckets);
+    memset(c->ghost_buckets, -1, sizeof(*c->ghost_buckets) * nb_buckets);
+}
+
+static void qcow2_cache_free_tables(Qcow2Cache *c)
+{
+    qemu_vfree(c->table_array);
+    g_free(c->entries);
+    g_free(c->buckets);
+    g_free(c->ghosts);
+    g_free(c->ghost_next);
+    g_free(c->ghost_buckets);
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+
+    c = g_malloc0(sizeof(*c));
+    c->table_size = s->cluster_size;
+    qcow2_cache_init_tables(bs, c, num_tables);
+
     return c;
 }
 
@@ -65,15 +181,156 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
-    g_free(c->entries);
+    qcow2_cache_free_tables(c);
     g_free(c);
 
     return 0;
 }
 
+int qcow2_cache_get_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats)
+{
+    stats->size = c->size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    i = c->buckets[qcow2_cache_hash(offset, c->hash_mask)];
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = &c->buckets[qcow2_cache_hash(c->entries[i].offset,
+                                               c->hash_mask)];
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c->entries[i].offset,
+                                          c->hash_mask)];
+
+    while (*p != i) {
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int *qcow2_cache_ghost_find(Qcow2Cache *c, uint64_t offset)
+{
+    int *p = &c->ghost_buckets[qcow2_cache_hash(offset, c->ghost_mask)];
+
+    while (*p != -1 && c->ghosts[*p] != offset) {
+        p = &c->ghost_next[*p];
+    }
+    return p;
+}
+
+static void qcow2_cache_ghost_add(Qcow2Cache *c, uint64_t offset)
+{
+    int g = c->ghost_head;
+    int *p;
+
+    /* Overwrite the oldest ghost */
+    if (c->ghosts[g]) {
+        p = qcow2_cache_ghost_find(c, c->ghosts[g]);
+        assert(*p == g);
+        *p = c->ghost_next[g];
+    }
+
+    p = &c->ghost_buckets[qcow2_cache_hash(offset, c->ghost_mask)];
+    c->ghosts[g] = offset;
+    c->ghost_next[g] = *p;
+    *p = g;
+
+    c->ghost_head = (g + 1) % c->ghost_max;
+}
+
+/* Returns whether offset was evicted from a1in recently, and forgets it */
+static bool qcow2_cache_ghost_take(Qcow2Cache *c, uint64_t offset)
+{
+    int *p = qcow2_cache_ghost_find(c, offset);
+    int g = *p;
+
+    if (g == -1) {
+        return false;
+    }
+
+    *p = c->ghost_next[g];
+    c->ghost_next[g] = -1;
+    c->ghosts[g] = 0;
+    return true;
+}
+
+static Qcow2CacheList *qcow2_cache_queue(Qcow2Cache *c, Qcow2CacheQueue q)
+{
+    switch (q) {
+    case QCOW2_CACHE_FREE:
+        return &c->free;
+    case QCOW2_CACHE_A1IN:
+        return &c->a1in;
+    case QCOW2_CACHE_AM:
+        return &c->am;
+    default:
+        abort();
+    }
+}
+
+static void qcow2_cache_move(Qcow2Cache *c, int i, Qcow2CacheQueue q)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    QTAILQ_REMOVE(qcow2_cache_queue(c, t->queue), t, next);
+    if (t->queue == QCOW2_CACHE_A1IN) {
+        c->a1in_len--;
+    }
+
+    t->queue = q;
+    QTAILQ_INSERT_HEAD(qcow2_cache_queue(c, q), t, next);
+    if (q == QCOW2_CACHE_A1IN) {
+        c->a1in_len++;
+    }
+}
+
+/* Frees the table of entry i, which must not be referenced */
+static void qcow2_cache_evict(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->queue == QCOW2_CACHE_FREE) {
+        return;
+    }
+
+    if (t->queue == QCOW2_CACHE_A1IN) {
+        qcow2_cache_ghost_add(c, t->offset);
+    }
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    c->evictions++;
+
+    t->offset = 0;
+    qcow2_cache_move(c, i, QCOW2_CACHE_FREE);
+}
+
 static int coroutine_fn qcow2_cache_flush_dependency(BlockDriverState *bs,
                                                      Qcow2Cache *c)
 {
@@ -122,8 +379,8 @@ static int coroutine_fn qcow2_cache_entry_flush(BlockDriverState *bs,
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -189,32 +446,37 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CacheList *first, *second;
+    Qcow2CachedTable *t;
+
+    if (!QTAILQ_EMPTY(&c->free)) {
+        return QTAILQ_FIRST(&c->free) - c->entries;
+    }
 
+    /* Evict the oldest table of a1in once it exceeds its share of the cache,
+     * otherwise the least recently used table of am */
+    if (c->a1in_len > c->a1in_max || QTAILQ_EMPTY(&c->am)) {
+        first = &c->a1in;
+        second = &c->am;
+    } else {
+        first = &c->am;
+        second = &c->a1in;
+    }
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    QTAILQ_FOREACH_REVERSE(t, first, Qcow2CacheList, next) {
+        if (!t->ref) {
+            return t - c->entries;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    }
+    QTAILQ_FOREACH_REVERSE(t, second, Qcow2CacheList, next) {
+        if (!t->ref) {
+            return t - c->entries;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int coroutine_fn qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -228,11 +490,15 @@ static int coroutine_fn qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i != -1) {
+        c->hits++;
+        if (c->entries[i].queue == QCOW2_CACHE_AM) {
+            qcow2_cache_move(c, i, QCOW2_CACHE_AM);
         }
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -249,28 +515,31 @@ static int coroutine_fn qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_evict(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
+    if (qcow2_cache_ghost_take(c, offset)) {
+        qcow2_cache_move(c, i, QCOW2_CACHE_AM);
+    } else {
+        qcow2_cache_move(c, i, QCOW2_CACHE_A1IN);
+    }
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -292,16 +561,12 @@ int coroutine_fn qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -311,15 +576,71 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
+
+    if (i < 0) {
+        abort();
+    }
+    c->entries[i].dirty = true;
+}
+
+/*
+ * Change the number of tables the cache can hold.  All tables are written
+ * back first; as many of them as fit in the new size are kept, preferring
+ * those of am.  Fails with -EBUSY if a table is in use.
+ */
+int coroutine_fn qcow2_cache_resize(BlockDriverState *bs, Qcow2Cache *c,
+                                    int num_tables)
+{
+    Qcow2Cache old;
+    Qcow2CachedTable *t;
+    int *keep;
+    int i, j, n;
+    int ret;
+
+    if (num_tables == c->size) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, c);
+    if (ret < 0) {
+        return ret;
+    }
 
     for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
+        if (c->entries[i].ref) {
+            return -EBUSY;
         }
     }
-    abort();
 
-found:
-    c->entries[i].dirty = true;
+    /* Most valuable tables first */
+    keep = g_new(int, c->size);
+    n = 0;
+    QTAILQ_FOREACH(t, &c->am, next) {
+        keep[n++] = t - c->entries;
+    }
+    QTAILQ_FOREACH(t, &c->a1in, next) {
+        keep[n++] = t - c->entries;
+    }
+    c->evictions += MAX(n - num_tables, 0);
+    n = MIN(n, num_tables);
+
+    old = *c;
+    qcow2_cache_init_tables(bs, c, num_tables);
+
+    /* Insert in reverse so that the lists keep their order */
+    for (j = n - 1; j >= 0; j--) {
+        t = &old.entries[keep[j]];
+        i = QTAILQ_FIRST(&c->free) - c->entries;
+        memcpy(qcow2_cache_get_table_addr(c, i),
+               (uint8_t *) old.table_array + (size_t) keep[j] * c->table_size,
+               c->table_size);
+        c->entries[i].offset = t->offset;
+        qcow2_cache_hash_insert(c, i);
+        qcow2_cache_move(c, i, t->queue);
+    }
+
+    g_free(keep);
+    qcow2_cache_free_tables(&old);
+    return 0;
 }
@@ -26,6 +26,7 @@
 
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "block/qcow2.h"
 #include "trace.h"
 
@@ -1291,10 +1292,28 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+/* Runs in a worker thread */
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
 int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
                                           uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
+    ThreadPool *pool;
+    Qcow2DecompressData data;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
 
@@ -1308,8 +1327,15 @@ int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = s->cluster_cache,
+            .out_buf_size   = s->cluster_size,
+            .buf            = s->cluster_data + sector_offset,
+            .buf_size       = csize,
+        };
+        s->cluster_cache_offset = -1;
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        if (thread_pool_submit_co(pool, decompress_worker, &data) < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
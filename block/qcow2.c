@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qemu/module.h"
 #include <zlib.h>
 #include "qemu/aes.h"
@@ -319,10 +320,86 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_CACHE_BUDGET,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size the caches to cover the whole image, using at most "
+                    "this much memory",
+        },
         { /* end of list */ }
     },
 };
 
+/* Caching more tables than the image can currently reference would only
+ * waste memory, so the size is clamped to that */
+static int cache_size_to_tables(BDRVQcowState *s, uint64_t size, int min,
+                                uint64_t max)
+{
+    uint64_t tables = MIN(size / s->cluster_size, MIN(max, INT_MAX));
+
+    return MAX(tables, min);
+}
+
+static int l2_cache_max_tables(BDRVQcowState *s)
+{
+    return s->l1_size;
+}
+
+static int refcount_cache_max_tables(BDRVQcowState *s)
+{
+    return MIN(s->refcount_table_size, INT_MAX);
+}
+
+static int read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                            int *l2_tables, int *refcount_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_cache_size, refcount_cache_size, budget, l2_needed;
+
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
+    refcount_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+    budget = qemu_opt_get_size(opts, QCOW2_OPT_CACHE_BUDGET, 0);
+
+    if (budget) {
+        if (l2_cache_size || refcount_cache_size) {
+            qerror_report(ERROR_CLASS_GENERIC_ERROR, QCOW2_OPT_CACHE_BUDGET
+                          " cannot be combined with explicit cache sizes");
+            return -EINVAL;
+        }
+
+        /* Enough L2 tables to map the whole image, and a refcount cache a
+         * quarter of that size, within the budget */
+        l2_needed = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                 (uint64_t) s->cluster_size * s->l2_size);
+        l2_cache_size = MIN(l2_needed * s->cluster_size, budget / 5 * 4);
+        refcount_cache_size = l2_cache_size / 4;
+    }
+
+    *l2_tables = L2_CACHE_SIZE;
+    *refcount_tables = REFCOUNT_CACHE_SIZE;
+    if (l2_cache_size) {
+        *l2_tables = cache_size_to_tables(s, l2_cache_size, MIN_L2_CACHE_SIZE,
+                                          l2_cache_max_tables(s));
+    }
+    if (refcount_cache_size) {
+        *refcount_tables = cache_size_to_tables(s, refcount_cache_size,
+                                                REFCOUNT_CACHE_SIZE,
+                                                refcount_cache_max_tables(s));
+    }
+    return 0;
+}
+
 static int coroutine_fn qcow2_co_open(BlockDriverState *bs, QDict *options, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -332,6 +409,7 @@ static int coroutine_fn qcow2_co_open(BlockDriverState *bs, QDict *options, int
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    int l2_tables, refcount_tables;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -532,6 +610,7 @@ static int coroutine_fn qcow2_co_open(BlockDriverState *bs, QDict *options, int
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -567,7 +646,22 @@ static int coroutine_fn qcow2_co_open(BlockDriverState *bs, QDict *options, int
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    ret = read_cache_sizes(bs, opts, &l2_tables, &refcount_tables);
     qemu_opts_del(opts);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The caches were needed to check the image; tables read so far are
+     * kept when resizing */
+    ret = qcow2_cache_resize(bs, s->l2_table_cache, l2_tables);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = qcow2_cache_resize(bs, s->refcount_block_cache, refcount_tables);
+    if (ret < 0) {
+        goto fail;
+    }
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
@@ -1594,6 +1688,45 @@ static int coroutine_fn qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    const uint8_t *in_buf;
+    int in_len;
+    uint8_t *out_buf;
+    int out_len;
+} Qcow2CompressData;
+
+/* Runs in a worker thread.  Returns 0 and sets out_len on success, -EINVAL if
+ * the data could not be compressed into less than in_len bytes. */
+static int qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->in_len;
+    strm.next_in = (uint8_t *)data->in_buf;
+    strm.avail_out = data->in_len;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    data->out_len = strm.next_out - data->out_buf;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || data->out_len >= data->in_len) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int coroutine_fn qcow2_write_compressed(BlockDriverState *bs,
@@ -1602,10 +1735,10 @@ static int coroutine_fn qcow2_write_compressed(BlockDriverState *bs,
                                                int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    Qcow2CompressData data;
+    int ret;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, seq;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -1632,49 +1765,50 @@ static int coroutine_fn qcow2_write_compressed(BlockDriverState *bs,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    /* Take a ticket before yielding for the first time, so that clusters
+     * are laid out in the order the requests were issued no matter which
+     * worker finishes first */
+    seq = s->compress_seq_next++;
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    data = (Qcow2CompressData) {
+        .in_buf     = buf,
+        .in_len     = s->cluster_size,
+        .out_buf    = out_buf,
+    };
+#ifdef CONFIG_COROUTINE_CPC
+    /* deflate() only touches data, so the coroutine itself can move to a
+     * worker thread; it comes back to this AioContext before going on. */
+    cpc_attach(cpc_default_threadpool);
+    ret = qcow2_compress_worker(&data);
+    cpc_attach(cpc_default_sched);
+#else
+    ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                qcow2_compress_worker, &data);
+#endif
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_queue);
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret < 0) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            sector_num << 9, data.out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (!cluster_offset) {
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, data.out_len);
         if (ret < 0) {
             goto fail;
         }
@@ -1682,6 +1816,8 @@ static int coroutine_fn qcow2_write_compressed(BlockDriverState *bs,
 
     ret = 0;
 fail:
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_queue);
     g_free(out_buf);
     return ret;
 }
@@ -1723,6 +1859,58 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *l2, *refcount;
+
+    refcount = g_new0(BlockCacheStatsList, 1);
+    refcount->value = g_new0(BlockCacheStats, 1);
+    refcount->value->name = g_strdup("refcount");
+    qcow2_cache_get_stats(s->refcount_block_cache, refcount->value);
+
+    l2 = g_new0(BlockCacheStatsList, 1);
+    l2->value = g_new0(BlockCacheStats, 1);
+    l2->value->name = g_strdup("l2");
+    qcow2_cache_get_stats(s->l2_table_cache, l2->value);
+    l2->next = refcount;
+
+    return l2;
+}
+
+static int coroutine_fn qcow2_resize_cache(BlockDriverState *bs,
+                                           const char *name, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int min_tables, max_tables, num_tables;
+    int ret;
+
+    if (size <= 0) {
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!strcmp(name, "l2")) {
+        c = s->l2_table_cache;
+        min_tables = MIN_L2_CACHE_SIZE;
+        max_tables = l2_cache_max_tables(s);
+    } else if (!strcmp(name, "refcount")) {
+        c = s->refcount_block_cache;
+        min_tables = REFCOUNT_CACHE_SIZE;
+        max_tables = refcount_cache_max_tables(s);
+    } else {
+        qemu_co_mutex_unlock(&s->lock);
+        return -ENOENT;
+    }
+
+    num_tables = cache_size_to_tables(s, size, min_tables, max_tables);
+    ret = qcow2_cache_resize(bs, c, num_tables);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1847,6 +2035,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
+    .bdrv_resize_cache  = qcow2_resize_cache,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
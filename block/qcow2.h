@@ -52,6 +52,7 @@
 #define MAX_CLUSTER_BITS 21
 
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2 /* tables */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
@@ -63,6 +64,9 @@
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_CACHE_BUDGET "cache-budget"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -184,6 +188,12 @@ typedef struct BDRVQcowState {
 
     CoMutex lock;
 
+    /* Compressed writes are deflated concurrently in the thread pool, but
+     * allocate their clusters in the order they were issued */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -442,5 +452,9 @@ int coroutine_fn qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c,
 int coroutine_fn qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats);
+int qcow2_cache_get_size(Qcow2Cache *c);
+int coroutine_fn qcow2_cache_resize(BlockDriverState *bs, Qcow2Cache *c,
+                                    int num_tables);
 
 #endif
@@ -217,3 +217,292 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
     }
     return -ENOTSUP;
 }
+
+/* Incremental snapshots */
+
+#define FLATTEN_BUF_SIZE (1024 * 1024)
+
+typedef struct VMStateCo {
+    BlockDriverState *bs;
+    uint8_t *buf;
+    int64_t pos;
+    int size;
+    bool is_write;
+    int ret;
+} VMStateCo;
+
+static void coroutine_fn bdrv_vmstate_co_entry(void *opaque)
+{
+    VMStateCo *vco = opaque;
+
+    if (vco->is_write) {
+        vco->ret = bdrv_save_vmstate(vco->bs, vco->buf, vco->pos, vco->size);
+    } else {
+        vco->ret = bdrv_load_vmstate(vco->bs, vco->buf, vco->pos, vco->size);
+    }
+}
+
+static int bdrv_vmstate_rw(BlockDriverState *bs, uint8_t *buf, int64_t pos,
+                           int size, bool is_write)
+{
+    Coroutine *co;
+    VMStateCo vco = {
+        .bs = bs,
+        .buf = buf,
+        .pos = pos,
+        .size = size,
+        .is_write = is_write,
+        .ret = NOT_DONE,
+    };
+
+    co = qemu_coroutine_create(bdrv_vmstate_co_entry);
+    qemu_coroutine_enter(co, &vco);
+    while (vco.ret == NOT_DONE) {
+        qemu_aio_wait();
+    }
+
+    return vco.ret;
+}
+
+/* Returns 1 if the VM state of the active layer is incremental, 0 if not */
+static int bdrv_vmstate_read_delta(BlockDriverState *bs,
+                                   SnapshotDeltaHeader *hdr)
+{
+    int ret;
+
+    ret = bdrv_vmstate_rw(bs, (uint8_t *)hdr, 0, sizeof(*hdr), false);
+    if (ret < 0) {
+        return ret;
+    }
+    if (be32_to_cpu(hdr->magic) != SNAPSHOT_DELTA_MAGIC) {
+        return 0;
+    }
+    if (be32_to_cpu(hdr->version) != SNAPSHOT_DELTA_VERSION) {
+        return -ENOTSUP;
+    }
+    hdr->parent_id[sizeof(hdr->parent_id) - 1] = '\0';
+    return 1;
+}
+
+void bdrv_snapshot_delta_header(SnapshotDeltaHeader *hdr,
+                                const QEMUSnapshotInfo *parent)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = cpu_to_be32(SNAPSHOT_DELTA_MAGIC);
+    hdr->version = cpu_to_be32(SNAPSHOT_DELTA_VERSION);
+    hdr->parent_date_sec = cpu_to_be32(parent->date_sec);
+    hdr->parent_date_nsec = cpu_to_be32(parent->date_nsec);
+    pstrcpy(hdr->parent_id, sizeof(hdr->parent_id), parent->id_str);
+}
+
+static QEMUSnapshotInfo *snapshot_find_id(QEMUSnapshotInfo *sn_tab,
+                                          int nb_sns, const char *id)
+{
+    int i;
+
+    for (i = 0; i < nb_sns; i++) {
+        if (!strcmp(sn_tab[i].id_str, id)) {
+            return &sn_tab[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Lists the snapshots whose VM state restores the one of @snapshot_id when
+ * loaded in order: a full snapshot, then the incremental snapshots up to
+ * @snapshot_id.  The VM states are read by reverting @bs to each snapshot
+ * in turn, so the caller must revert it to the snapshot it wants afterwards.
+ *
+ * Returns the length of the chain stored in *@pchain, to be freed with
+ * g_free(), or a negative errno value.
+ */
+int bdrv_snapshot_vmstate_chain(BlockDriverState *bs, const char *snapshot_id,
+                                QEMUSnapshotInfo **pchain)
+{
+    QEMUSnapshotInfo *sn_tab, *sn, *chain, tmp;
+    SnapshotDeltaHeader hdr;
+    int nb_sns, n = 0, i, ret;
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    if (nb_sns < 0) {
+        return nb_sns;
+    }
+
+    chain = g_new(QEMUSnapshotInfo, MAX(nb_sns, 1));
+    sn = snapshot_find_id(sn_tab, nb_sns, snapshot_id);
+    while (true) {
+        if (!sn) {
+            ret = -ENOENT;
+            goto fail;
+        }
+        if (sn->vm_state_size == 0) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (n == nb_sns) {
+            ret = -ELOOP;
+            goto fail;
+        }
+        chain[n++] = *sn;
+
+        ret = bdrv_snapshot_goto(bs, sn->id_str);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_vmstate_read_delta(bs, &hdr);
+        if (ret < 0) {
+            goto fail;
+        } else if (ret == 0) {
+            break;
+        }
+
+        sn = snapshot_find_id(sn_tab, nb_sns, hdr.parent_id);
+        if (sn && (sn->date_sec != be32_to_cpu(hdr.parent_date_sec) ||
+                   sn->date_nsec != be32_to_cpu(hdr.parent_date_nsec))) {
+            /* The parent was deleted and its ID reused */
+            sn = NULL;
+        }
+    }
+
+    for (i = 0; i < n / 2; i++) {
+        tmp = chain[i];
+        chain[i] = chain[n - 1 - i];
+        chain[n - 1 - i] = tmp;
+    }
+
+    g_free(sn_tab);
+    *pchain = chain;
+    return n;
+
+fail:
+    g_free(chain);
+    g_free(sn_tab);
+    return ret;
+}
+
+static int bdrv_vmstate_copy_out(BlockDriverState *bs, int64_t pos,
+                                 int64_t end, FILE *file, uint8_t *buf)
+{
+    int len, ret;
+
+    while (pos < end) {
+        len = MIN(end - pos, FLATTEN_BUF_SIZE);
+        ret = bdrv_vmstate_rw(bs, buf, pos, len, false);
+        if (ret < 0) {
+            return ret;
+        }
+        if (fwrite(buf, 1, len, file) != len) {
+            return -EIO;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+static int bdrv_vmstate_copy_in(BlockDriverState *bs, FILE *file,
+                                int64_t size, uint8_t *buf)
+{
+    int64_t pos = 0;
+    int len, ret;
+
+    while (pos < size) {
+        len = MIN(size - pos, FLATTEN_BUF_SIZE);
+        if (fread(buf, 1, len, file) != len) {
+            return -EIO;
+        }
+        ret = bdrv_vmstate_rw(bs, buf, pos, len, true);
+        if (ret < 0) {
+            return ret;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+/**
+ * Makes @snapshot_id a full snapshot that no longer depends on the ones it
+ * was incrementally taken from.  Its VM state becomes the migration streams
+ * of the whole chain one after the other, which restore the VM just like
+ * loading the chain does.  The active layer of @bs is left as it was.
+ */
+int bdrv_snapshot_flatten(BlockDriverState *bs, const char *snapshot_id)
+{
+    QEMUSnapshotInfo *chain = NULL, sn, tmp_sn;
+    uint8_t *buf = NULL;
+    FILE *file = NULL;
+    int64_t start, size = 0;
+    qemu_timeval tv;
+    int nb_chain, i, ret;
+
+    /* Switching between snapshots discards the active layer, keep it */
+    memset(&tmp_sn, 0, sizeof(tmp_sn));
+    snprintf(tmp_sn.name, sizeof(tmp_sn.name), "flatten-%s", snapshot_id);
+    qemu_gettimeofday(&tv);
+    tmp_sn.date_sec = tv.tv_sec;
+    tmp_sn.date_nsec = tv.tv_usec * 1000;
+    ret = bdrv_snapshot_create(bs, &tmp_sn);
+    if (ret < 0) {
+        return ret;
+    }
+
+    nb_chain = bdrv_snapshot_vmstate_chain(bs, snapshot_id, &chain);
+    if (nb_chain <= 1) {
+        ret = MIN(nb_chain, 0);
+        goto out;
+    }
+
+    file = tmpfile();
+    if (!file) {
+        ret = -errno;
+        goto out;
+    }
+    buf = g_malloc(FLATTEN_BUF_SIZE);
+
+    for (i = 0; i < nb_chain; i++) {
+        start = i ? sizeof(SnapshotDeltaHeader) : 0;
+        ret = bdrv_snapshot_goto(bs, chain[i].id_str);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_vmstate_copy_out(bs, start, chain[i].vm_state_size,
+                                    file, buf);
+        if (ret < 0) {
+            goto out;
+        }
+        size += chain[i].vm_state_size - start;
+    }
+
+    sn = chain[nb_chain - 1];
+    ret = bdrv_snapshot_goto(bs, sn.id_str);
+    if (ret < 0) {
+        goto out;
+    }
+    rewind(file);
+    ret = bdrv_vmstate_copy_in(bs, file, size, buf);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Keep the ID, the snapshots taken from this one refer to it */
+    ret = bdrv_snapshot_delete(bs, sn.id_str);
+    if (ret < 0) {
+        goto out;
+    }
+    sn.vm_state_size = size;
+    ret = bdrv_snapshot_create(bs, &sn);
+
+out:
+    /* On failure the temporary snapshot is left for the user to apply */
+    if (bdrv_snapshot_goto(bs, tmp_sn.id_str) == 0) {
+        bdrv_snapshot_delete(bs, tmp_sn.id_str);
+    } else if (ret == 0) {
+        ret = -EIO;
+    }
+    if (file) {
+        fclose(file);
+    }
+    g_free(buf);
+    g_free(chain);
+    return ret;
+}
@@ -1374,6 +1374,48 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
+void qmp_block_set_cache_size(const char *device, const char *name,
+                              int64_t size, Error **errp)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (size <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "size", "a >0 size");
+        return;
+    }
+
+    ret = bdrv_sync_resize_cache(bs, name, size);
+    switch (ret) {
+    case 0:
+        break;
+    case -ENOMEDIUM:
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        break;
+    case -ENOTSUP:
+        error_set(errp, QERR_UNSUPPORTED);
+        break;
+    case -ENOENT:
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "name",
+                  "a cache name listed by query-blockstats");
+        break;
+    case -EBUSY:
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        break;
+    default:
+        /* Dirty tables are written back first, so this is usually an I/O
+         * error; the size itself was checked above. */
+        error_setg_errno(errp, -ret, "Could not resize the cache");
+        break;
+    }
+}
+
 static void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
@@ -33,111 +33,740 @@ THE SOFTWARE.
 #include <assert.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <sched.h>
 
 #define QEMU_COROUTINE_CPC
 #include "cpc/cpc_runtime.h"
 #include "block/coroutine_int.h"
+#include "qemu/thread.h"
+#include "qemu/tls.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "trace.h"
 
+enum {
+    /* Chunk sizes are powers of two between 1 << CPC_POOL_MIN_SHIFT and
+     * 1 << CPC_POOL_MAX_SHIFT bytes; each new chunk of a continuation is
+     * twice as large as the previous one, up to the maximum.
+     */
+    CPC_POOL_MIN_SHIFT = 8,
+    CPC_POOL_MAX_SHIFT = 16,
 
+    /* Maximum number of free objects cached per size class and thread */
+    CPC_POOL_MAX_FREE = 64,
+};
 
-typedef struct {
+typedef struct CoroutineCPC {
     Coroutine base;
     struct cpc_continuation *cont;
+    QSLIST_ENTRY(CoroutineCPC) free_next;
+
+    /* Thread pool the coroutine is currently detached to, or NULL */
+    cpc_sched *sched;
+    /* Target of the cpc_attach() call that stopped the continuation */
+    cpc_sched *attach_to;
+    /* Re-enters the coroutine in the AioContext that detached it */
+    QEMUBH *attach_bh;
+    /* The continuation ran to completion on a worker thread */
+    bool finished;
+    QTAILQ_ENTRY(CoroutineCPC) sched_next;
 } CoroutineCPC;
 
+typedef enum {
+    CPC_STOP_DONE,      /* the continuation is empty */
+    CPC_STOP_YIELD,     /* qemu_coroutine_yield() was called */
+    CPC_STOP_ATTACH,    /* cpc_attach() asked for a different scheduler */
+} CPCStopReason;
+
+cpc_function cpc_attach;
+
+/**
+ * Per-thread allocation cache
+ *
+ * Chunks and CoroutineCPC objects are recycled through free lists that are
+ * only ever touched by the owning thread, so no locking is needed on the fast
+ * path.  Cached coroutines keep their continuation and all of its chunks, so
+ * a recycled coroutine starts with the capacity it had grown to.
+ *
+ * The generic pool in qemu-coroutine.c sits in front of this one: it only
+ * calls qemu_coroutine_new() on a miss and qemu_coroutine_delete() when it
+ * overflows, and it is compiled out with --disable-coroutine-pool.
+ */
+typedef struct CPCProfile CPCProfile;
+
+typedef struct CoroutineCPCThreadState {
+    cpc_chunk *free_chunks[CPC_POOL_NR_CLASSES];
+    unsigned int nr_free_chunks[CPC_POOL_NR_CLASSES];
+    QSLIST_HEAD(, CoroutineCPC) free_coroutines;
+    unsigned int nr_free_coroutines;
+
+    struct cpc_pool_stats stats;
+#ifdef CONFIG_CPC_PROFILE
+    CPCProfile *profile;
+#endif
+    QLIST_ENTRY(CoroutineCPCThreadState) next;
+} CoroutineCPCThreadState;
+
+static pthread_key_t thread_state_key;
+
+/* All live thread states, plus the totals of threads that have exited.  Only
+ * taken when a thread starts or stops and when statistics are queried. */
+static QemuMutex thread_states_lock;
+static QLIST_HEAD(, CoroutineCPCThreadState) thread_states =
+    QLIST_HEAD_INITIALIZER(thread_states);
+static struct cpc_pool_stats retired_stats;
+
+static CoroutineCPCThreadState *coroutine_get_thread_state(void)
+{
+    CoroutineCPCThreadState *s = pthread_getspecific(thread_state_key);
+
+    if (!s) {
+        s = g_malloc0(sizeof(*s));
+        QSLIST_INIT(&s->free_coroutines);
+        pthread_setspecific(thread_state_key, s);
+
+        qemu_mutex_lock(&thread_states_lock);
+        QLIST_INSERT_HEAD(&thread_states, s, next);
+        qemu_mutex_unlock(&thread_states_lock);
+    }
+    return s;
+}
+
+static void cpc_pool_stats_add(struct cpc_pool_stats *dst,
+                               const struct cpc_pool_stats *src)
+{
+    int i;
+
+    for (i = 0; i < CPC_POOL_NR_CLASSES; i++) {
+        dst->chunk_hits[i] += src->chunk_hits[i];
+        dst->chunk_misses[i] += src->chunk_misses[i];
+    }
+    dst->coroutine_hits += src->coroutine_hits;
+    dst->coroutine_misses += src->coroutine_misses;
+}
+
+static void cont_free(CoroutineCPCThreadState *s, struct cpc_continuation *c);
+#ifdef CONFIG_CPC_PROFILE
+static void cpc_profile_retire(CoroutineCPCThreadState *s);
+#endif
+
+static void qemu_coroutine_thread_cleanup(void *opaque)
+{
+    CoroutineCPCThreadState *s = opaque;
+    CoroutineCPC *co, *next_co;
+    cpc_chunk *k;
+    int i;
+
+    qemu_mutex_lock(&thread_states_lock);
+    QLIST_REMOVE(s, next);
+    cpc_pool_stats_add(&retired_stats, &s->stats);
+#ifdef CONFIG_CPC_PROFILE
+    cpc_profile_retire(s);
+#endif
+    qemu_mutex_unlock(&thread_states_lock);
+
+    /* The thread-specific value is already cleared at this point, so pass
+     * NULL to release chunks straight to the allocator. */
+    QSLIST_FOREACH_SAFE(co, &s->free_coroutines, free_next, next_co) {
+        cont_free(NULL, co->cont);
+        g_free(co);
+    }
+
+    for (i = 0; i < CPC_POOL_NR_CLASSES; i++) {
+        while ((k = s->free_chunks[i]) != NULL) {
+            s->free_chunks[i] = k->next;
+            g_free(k);
+        }
+    }
+    g_free(s);
+}
+
+static void __attribute__((constructor)) coroutine_init(void)
+{
+    int ret;
+
+    QEMU_BUILD_BUG_ON(CPC_POOL_NR_CLASSES !=
+                      CPC_POOL_MAX_SHIFT - CPC_POOL_MIN_SHIFT + 1);
+
+    qemu_mutex_init(&thread_states_lock);
+    ret = pthread_key_create(&thread_state_key, qemu_coroutine_thread_cleanup);
+    if (ret != 0) {
+        fprintf(stderr, "unable to create thread state key: %s\n",
+                strerror(errno));
+        abort();
+    }
+}
+
+void cpc_pool_get_stats(struct cpc_pool_stats *stats)
+{
+    CoroutineCPCThreadState *s;
+
+    memset(stats, 0, sizeof(*stats));
+
+    /* Counters of other threads are read without synchronization; they are
+     * only ever incremented, so at worst the snapshot is slightly stale. */
+    qemu_mutex_lock(&thread_states_lock);
+    cpc_pool_stats_add(stats, &retired_stats);
+    QLIST_FOREACH(s, &thread_states, next) {
+        cpc_pool_stats_add(stats, &s->stats);
+    }
+    qemu_mutex_unlock(&thread_states_lock);
+}
+
+/* Return the index of the smallest size class holding at least size bytes,
+ * or -1 if size is too large to be pooled */
+static int chunk_size_class(size_t size)
+{
+    int shift = CPC_POOL_MIN_SHIFT;
+
+    while (((size_t)1 << shift) < size) {
+        if (++shift > CPC_POOL_MAX_SHIFT) {
+            return -1;
+        }
+    }
+    return shift - CPC_POOL_MIN_SHIFT;
+}
+
+static cpc_chunk *chunk_alloc(size_t size)
+{
+    CoroutineCPCThreadState *s = coroutine_get_thread_state();
+    cpc_chunk *k;
+    int cls = chunk_size_class(size);
+
+    if (cls < 0) {
+        k = g_malloc(offsetof(cpc_chunk, c) + size);
+        k->size = size;
+    } else if (s->free_chunks[cls]) {
+        k = s->free_chunks[cls];
+        s->free_chunks[cls] = k->next;
+        s->nr_free_chunks[cls]--;
+        s->stats.chunk_hits[cls]++;
+    } else {
+        k = g_malloc(offsetof(cpc_chunk, c) + (1 << (cls + CPC_POOL_MIN_SHIFT)));
+        k->size = 1 << (cls + CPC_POOL_MIN_SHIFT);
+        s->stats.chunk_misses[cls]++;
+    }
+    k->prev = NULL;
+    k->next = NULL;
+    k->length = 0;
+    return k;
+}
+
+static void chunk_free(CoroutineCPCThreadState *s, cpc_chunk *k)
+{
+    int cls = chunk_size_class(k->size);
+
+    if (!s || cls < 0 || s->nr_free_chunks[cls] >= CPC_POOL_MAX_FREE) {
+        g_free(k);
+        return;
+    }
+    k->next = s->free_chunks[cls];
+    s->free_chunks[cls] = k;
+    s->nr_free_chunks[cls]++;
+}
+
 static struct cpc_continuation *cont_alloc(unsigned size)
 {
     struct cpc_continuation *r;
-    if (size < 16) {
-        size = 16;
-    }
-    r = g_malloc(sizeof(*r) + size - 1);
-    r->size = size - 1;
-    r->length = 0;
+
+    r = g_malloc0(sizeof(*r));
+    r->top = chunk_alloc(MAX(size, 1U << CPC_POOL_MIN_SHIFT));
     return r;
 }
 
-static void cpc_continuation_free(struct cpc_continuation *c)
+/* Empty a continuation, keeping its chunks for reuse */
+static void cont_reset(struct cpc_continuation *c)
 {
+    while (c->top->prev) {
+        c->top = c->top->prev;
+    }
+    c->top->length = 0;
+    c->coroutine = NULL;
+#ifdef CONFIG_CPC_PROFILE
+    c->prof_length = 0;
+    c->prof_peak = 0;
+    c->prof_frame = 0;
+    c->prof_expands = 0;
+#endif
+}
+
+static void cont_free(CoroutineCPCThreadState *s, struct cpc_continuation *c)
+{
+    cpc_chunk *k, *next;
+
+    if (c == NULL) {
+        return;
+    }
+
+    cont_reset(c);
+    for (k = c->top; k; k = next) {
+        next = k->next;
+        chunk_free(s, k);
+    }
     g_free(c);
 }
 
 cpc_continuation *
 cpc_continuation_expand(struct cpc_continuation *c, int n)
 {
-    struct cpc_continuation *r;
-    int size;
+    cpc_chunk *k, *spare;
 
     if (c == NULL) {
         return cont_alloc(n + 20);
     }
 
-    size = c->size * 2 + n;
-    r = cont_alloc(size);
+    k = c->top;
+    spare = k->next;
+    if (!spare || spare->size < n) {
+        /* Insert a new chunk below the spare one, which is too small */
+        spare = chunk_alloc(MAX((size_t)n,
+                                MIN(k->size * 2,
+                                    (size_t)1 << CPC_POOL_MAX_SHIFT)));
+        spare->prev = k;
+        spare->next = k->next;
+        if (k->next) {
+            k->next->prev = spare;
+        }
+        k->next = spare;
+    }
 
-    memcpy(r->c, c->c, c->length);
-    r->length = c->length;
-    r->coroutine = c->coroutine;
-    cpc_continuation_free(c);
+    spare->length = 0;
+    c->top = spare;
+#ifdef CONFIG_CPC_PROFILE
+    c->prof_expands++;
+#endif
+    return c;
+}
 
-    return r;
+
+#ifdef CONFIG_CPC_PROFILE
+/**
+ * Continuation profiler
+ *
+ * Every push is attributed to the pushed function together with the bytes
+ * allocated since the previous push, which is the frame CPC saved for it.
+ * When a coroutine terminates, the peak length of its continuation and the
+ * number of chunk switches are attributed to its entry point.  Sizes are
+ * kept as log2 histograms.
+ *
+ * Each thread counts into its own fixed-size tables without any locking.
+ * Slots are never freed, so the tables can be merged at any time under
+ * thread_states_lock; as with the pool statistics, a snapshot of another
+ * thread's counters may be slightly stale.
+ */
+enum {
+    CPC_PROFILE_BUCKETS = 24,
+    /* Must be powers of two; events that find no free slot are dropped */
+    CPC_PROFILE_FUNC_SLOTS = 1024,
+    CPC_PROFILE_ENTRY_SLOTS = 256,
+};
+
+typedef struct CPCProfileFunc {
+    void *func;
+    uint64_t pushes;
+    uint64_t bytes;
+    size_t max_frame;
+} CPCProfileFunc;
+
+typedef struct CPCProfileEntry {
+    void *entry;
+    uint64_t coroutines;
+    uint64_t expands;
+    size_t max_peak;
+    uint64_t peak_hist[CPC_PROFILE_BUCKETS];
+} CPCProfileEntry;
+
+struct CPCProfile {
+    CPCProfileFunc funcs[CPC_PROFILE_FUNC_SLOTS];
+    CPCProfileEntry entries[CPC_PROFILE_ENTRY_SLOTS];
+    uint64_t frame_hist[CPC_PROFILE_BUCKETS];
+    uint64_t dropped;
+};
+
+/* Totals of the threads that have exited, protected by thread_states_lock */
+static CPCProfile retired_profile;
+
+static int cpc_profile_bucket(size_t size)
+{
+    int bucket = 0;
+
+    while (size > 1 && bucket < CPC_PROFILE_BUCKETS - 1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static unsigned int cpc_profile_hash(void *key)
+{
+    return ((uintptr_t)key >> 2) * 2654435761U;
+}
+
+static CPCProfileFunc *cpc_profile_func(CPCProfile *p, void *func)
+{
+    unsigned int i, h = cpc_profile_hash(func);
+
+    for (i = 0; i < CPC_PROFILE_FUNC_SLOTS; i++) {
+        CPCProfileFunc *pf = &p->funcs[(h + i) & (CPC_PROFILE_FUNC_SLOTS - 1)];
+
+        if (pf->func == func) {
+            return pf;
+        }
+        if (!pf->func) {
+            atomic_set(&pf->func, func);
+            return pf;
+        }
+    }
+    return NULL;
+}
+
+static CPCProfileEntry *cpc_profile_entry(CPCProfile *p, void *entry)
+{
+    unsigned int i, h = cpc_profile_hash(entry);
+
+    for (i = 0; i < CPC_PROFILE_ENTRY_SLOTS; i++) {
+        CPCProfileEntry *pe =
+            &p->entries[(h + i) & (CPC_PROFILE_ENTRY_SLOTS - 1)];
+
+        if (pe->entry == entry) {
+            return pe;
+        }
+        if (!pe->entry) {
+            atomic_set(&pe->entry, entry);
+            return pe;
+        }
+    }
+    return NULL;
+}
+
+static CPCProfile *cpc_profile_get(void)
+{
+    CoroutineCPCThreadState *s = coroutine_get_thread_state();
+
+    if (!s->profile) {
+        s->profile = g_new0(CPCProfile, 1);
+    }
+    return s->profile;
+}
+
+void cpc_profile_push(struct cpc_continuation *c, cpc_function *f)
+{
+    CPCProfile *p = cpc_profile_get();
+    CPCProfileFunc *pf = cpc_profile_func(p, f);
+    size_t frame = c->prof_frame;
+
+    c->prof_frame = 0;
+
+    p->frame_hist[cpc_profile_bucket(frame)]++;
+    if (!pf) {
+        p->dropped++;
+        return;
+    }
+    pf->pushes++;
+    pf->bytes += frame;
+    pf->max_frame = MAX(pf->max_frame, frame);
+}
+
+static void cpc_profile_terminate(CoroutineCPC *co)
+{
+    struct cpc_continuation *c = co->cont;
+    CPCProfile *p = cpc_profile_get();
+    CPCProfileEntry *pe = cpc_profile_entry(p, co->base.entry);
+
+    if (!pe) {
+        p->dropped++;
+        return;
+    }
+    pe->coroutines++;
+    pe->expands += c->prof_expands;
+    pe->max_peak = MAX(pe->max_peak, c->prof_peak);
+    pe->peak_hist[cpc_profile_bucket(c->prof_peak)]++;
+}
+
+/* Add the counters of src, which may be live, to dst */
+static void cpc_profile_merge(CPCProfile *dst, CPCProfile *src)
+{
+    int i, j;
+
+    for (i = 0; i < CPC_PROFILE_FUNC_SLOTS; i++) {
+        CPCProfileFunc *from = &src->funcs[i], *to;
+        void *func = atomic_read(&from->func);
+
+        if (!func) {
+            continue;
+        }
+        to = cpc_profile_func(dst, func);
+        if (!to) {
+            dst->dropped += from->pushes;
+            continue;
+        }
+        to->pushes += from->pushes;
+        to->bytes += from->bytes;
+        to->max_frame = MAX(to->max_frame, from->max_frame);
+    }
+
+    for (i = 0; i < CPC_PROFILE_ENTRY_SLOTS; i++) {
+        CPCProfileEntry *from = &src->entries[i], *to;
+        void *entry = atomic_read(&from->entry);
+
+        if (!entry) {
+            continue;
+        }
+        to = cpc_profile_entry(dst, entry);
+        if (!to) {
+            dst->dropped += from->coroutines;
+            continue;
+        }
+        to->coroutines += from->coroutines;
+        to->expands += from->expands;
+        to->max_peak = MAX(to->max_peak, from->max_peak);
+        for (j = 0; j < CPC_PROFILE_BUCKETS; j++) {
+            to->peak_hist[j] += from->peak_hist[j];
+        }
+    }
+
+    for (j = 0; j < CPC_PROFILE_BUCKETS; j++) {
+        dst->frame_hist[j] += src->frame_hist[j];
+    }
+    dst->dropped += src->dropped;
+}
+
+static void cpc_profile_retire(CoroutineCPCThreadState *s)
+{
+    if (s->profile) {
+        cpc_profile_merge(&retired_profile, s->profile);
+        g_free(s->profile);
+    }
+}
+
+/* Return the counters of all threads, to be freed with g_free() */
+static CPCProfile *cpc_profile_snapshot(void)
+{
+    CPCProfile *p = g_new0(CPCProfile, 1);
+    CoroutineCPCThreadState *s;
+
+    qemu_mutex_lock(&thread_states_lock);
+    cpc_profile_merge(p, &retired_profile);
+    QLIST_FOREACH(s, &thread_states, next) {
+        if (s->profile) {
+            cpc_profile_merge(p, s->profile);
+        }
+    }
+    qemu_mutex_unlock(&thread_states_lock);
+    return p;
+}
+
+static void cpc_profile_trace(CPCProfile *p)
+{
+    int i;
+
+    for (i = 0; i < CPC_PROFILE_BUCKETS; i++) {
+        if (p->frame_hist[i]) {
+            trace_cpc_profile_frame_hist(i ? (size_t)1 << i : 0,
+                                         ((size_t)2 << i) - 1,
+                                         p->frame_hist[i]);
+        }
+    }
+}
+
+static void cpc_profile_exit(void)
+{
+    CPCProfile *p = cpc_profile_snapshot();
+
+    cpc_profile_trace(p);
+    g_free(p);
+}
+
+static void __attribute__((constructor)) cpc_profile_init(void)
+{
+    atexit(cpc_profile_exit);
+}
+
+static void cpc_profile_dump_hist(FILE *f, fprintf_function cpu_fprintf,
+                                  const uint64_t *hist)
+{
+    int i;
+
+    /* Bucket i holds sizes from 2^i to 2^(i+1)-1, bucket 0 also holds 0 */
+    for (i = 0; i < CPC_PROFILE_BUCKETS; i++) {
+        if (hist[i]) {
+            cpu_fprintf(f, "  %8zu-%-8zu %" PRIu64 "\n",
+                        i ? (size_t)1 << i : 0, ((size_t)2 << i) - 1,
+                        hist[i]);
+        }
+    }
+}
+
+static int cpc_profile_func_compare(const void *a, const void *b)
+{
+    const CPCProfileFunc *fa = *(CPCProfileFunc * const *)a;
+    const CPCProfileFunc *fb = *(CPCProfileFunc * const *)b;
+
+    return fa->bytes < fb->bytes ? 1 : fa->bytes > fb->bytes ? -1 : 0;
 }
 
+static void cpc_profile_dump(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPCProfile *p = cpc_profile_snapshot();
+    CPCProfileFunc *funcs[CPC_PROFILE_FUNC_SLOTS];
+    CPCProfileEntry *pe;
+    int i, n;
+
+    cpu_fprintf(f, "Frame size histogram (bytes, pushes):\n");
+    cpc_profile_dump_hist(f, cpu_fprintf, p->frame_hist);
+    cpc_profile_trace(p);
+
+    n = 0;
+    for (i = 0; i < CPC_PROFILE_FUNC_SLOTS; i++) {
+        if (p->funcs[i].func) {
+            funcs[n++] = &p->funcs[i];
+        }
+    }
+    qsort(funcs, n, sizeof(*funcs), cpc_profile_func_compare);
+
+    cpu_fprintf(f, "\nPushed functions by total frame bytes:\n");
+    cpu_fprintf(f, "  %-18s %12s %14s %10s\n",
+                "function", "pushes", "bytes", "max frame");
+    for (i = 0; i < n; i++) {
+        cpu_fprintf(f, "  %-18p %12" PRIu64 " %14" PRIu64 " %10zu\n",
+                    funcs[i]->func, funcs[i]->pushes, funcs[i]->bytes,
+                    funcs[i]->max_frame);
+    }
+
+    cpu_fprintf(f, "\nCoroutine entry points:\n");
+    for (i = 0; i < CPC_PROFILE_ENTRY_SLOTS; i++) {
+        pe = &p->entries[i];
+        if (!pe->entry) {
+            continue;
+        }
+        cpu_fprintf(f, "  %p: %" PRIu64 " coroutines, peak %zu bytes, "
+                    "%" PRIu64 " expands\n", pe->entry, pe->coroutines,
+                    pe->max_peak, pe->expands);
+        cpu_fprintf(f, "  peak length histogram (bytes, coroutines):\n");
+        cpc_profile_dump_hist(f, cpu_fprintf, pe->peak_hist);
+    }
+
+    if (p->dropped) {
+        cpu_fprintf(f, "\n%" PRIu64 " events dropped, tables full\n",
+                    p->dropped);
+    }
+    g_free(p);
+}
+#endif
+
+struct arglist {
+   void *arg  __attribute__((__aligned__)) ;
+};
 
-static struct cpc_continuation *
-cpc_invoke_continuation(struct cpc_continuation *c)
+static CPCStopReason cpc_invoke_continuation(CoroutineCPC *co)
 {
+    struct cpc_continuation *c = co->cont;
     cpc_function *f = NULL;
     const cpc_function *yield_func = qemu_coroutine_yield;
+    CPCStopReason ret;
 
     while (1) {
-        /* If the continuation is empty, free it and return NULL, signalling
-         * this continuation terminated. */
-        if (c->length == 0) {
-            return c;
+        /* If the continuation is empty, return it, signalling this
+         * continuation terminated. */
+        if (cpc_continuation_empty(c)) {
+            ret = CPC_STOP_DONE;
+            break;
         }
 
         /* Extract the next function from the continuation. */
-        c->length -= PTR_SIZE;
-        f = *(cpc_function **)(c->c + c->length);
+        f = *(cpc_function **)cpc_dealloc(c, PTR_SIZE);
 
         /* If we need to yield, return immediately.  This hack is necessary to
          * avoid modifying the implementation of qemu_coroutine_yield.  */
         if (f == yield_func) {
-            return c;
+            ret = CPC_STOP_YIELD;
+            break;
+        }
+
+        /* Likewise for cpc_attach(), whose argument sits right below.
+         * Attaching to the current scheduler is a no-op. */
+        if (f == cpc_attach) {
+            struct arglist *a = cpc_dealloc(c, sizeof(struct arglist));
+
+            if (a->arg != co->sched) {
+                co->attach_to = a->arg;
+                ret = CPC_STOP_ATTACH;
+                break;
+            }
+            continue;
         }
         c = (*f)(c);
     }
+
+    co->cont = c;
+    if (ret == CPC_STOP_DONE) {
+#ifdef CONFIG_CPC_PROFILE
+        cpc_profile_terminate(co);
+#endif
+        /* The pool may reuse the coroutine without deleting it */
+        cont_reset(c);
+    }
+    return ret;
 }
 
 Coroutine *qemu_coroutine_new(void)
 {
+    CoroutineCPCThreadState *s = coroutine_get_thread_state();
     CoroutineCPC *co;
 
-    co = g_malloc0(sizeof(*co));
-    co->cont = NULL;
-
+    co = QSLIST_FIRST(&s->free_coroutines);
+    if (co) {
+        QSLIST_REMOVE_HEAD(&s->free_coroutines, free_next);
+        s->nr_free_coroutines--;
+        s->stats.coroutine_hits++;
+        /* Everything but the continuation, which was reset when the
+         * coroutine terminated, belongs to the previous run. */
+        memset(&co->base, 0, sizeof(co->base));
+        co->sched = NULL;
+        co->attach_to = NULL;
+        co->attach_bh = NULL;
+        co->finished = false;
+    } else {
+        co = g_malloc0(sizeof(*co));
+        s->stats.coroutine_misses++;
+    }
     return &co->base;
 }
 
 void qemu_coroutine_delete(Coroutine *co_)
 {
+    CoroutineCPCThreadState *s = coroutine_get_thread_state();
     CoroutineCPC *co = DO_UPCAST(CoroutineCPC, base, co_);
 
-    cpc_continuation_free(co->cont);
-    g_free(co);
+    if (s->nr_free_coroutines >= CPC_POOL_MAX_FREE) {
+        cont_free(s, co->cont);
+        g_free(co);
+        return;
+    }
+    if (co->cont) {
+        cont_reset(co->cont);
+    }
+    QSLIST_INSERT_HEAD(&s->free_coroutines, co, free_next);
+    s->nr_free_coroutines++;
 }
 
-struct arglist {
-   void *arg  __attribute__((__aligned__)) ;
-};
+static void cpc_sched_submit(cpc_sched *sched, CoroutineCPC *co);
+static void cpc_sched_attach_bh(void *opaque);
 
 CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
                                       CoroutineAction action)
 {
     CoroutineCPC *to = DO_UPCAST(CoroutineCPC, base, to_);
+    CPCStopReason reason;
 
-    if (!to->cont || to->cont->length == 0) {
+    /* Came back from a worker thread after running to completion.  The
+     * coroutine may be handed out again by the pool, so reset the flag. */
+    if (to->finished) {
+        to->finished = false;
+        return COROUTINE_TERMINATE;
+    }
+
+    if (!to->cont || cpc_continuation_empty(to->cont)) {
         struct arglist *a = cpc_alloc(&to->cont, sizeof(struct arglist));
         a->arg = to_->entry_arg;
         to->cont = cpc_continuation_push(to->cont, to_->entry);
@@ -145,17 +774,30 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
 
     to->cont->coroutine = to_;
 
-    to->cont = cpc_invoke_continuation(to->cont);
+    reason = cpc_invoke_continuation(to);
 
-    if (to->cont->length == 0) {
+    if (reason == CPC_STOP_DONE) {
         return COROUTINE_TERMINATE;
-    } else {
-        /* Fix the caller. This is normally done in qemu_coroutine_yield
-         * but we bypass it for CPC. */
-        to->cont->coroutine = to_->caller;
-        to_->caller = NULL;
-        return COROUTINE_YIELD;
     }
+
+    /* Fix the caller. This is normally done in qemu_coroutine_yield
+     * but we bypass it for CPC. */
+    to->cont->coroutine = to_->caller;
+    to_->caller = NULL;
+
+    if (reason == CPC_STOP_ATTACH) {
+        /* Detaching looks like a yield to the caller, which then wakes up
+         * whoever the coroutine queued.  The coroutine comes back to the
+         * AioContext that is running it now, or to the main loop if it was
+         * entered outside aio_poll().
+         */
+        AioContext *ctx = aio_get_current_context();
+
+        to->attach_bh = aio_bh_new(ctx ? ctx : qemu_get_aio_context(),
+                                   cpc_sched_attach_bh, to);
+        cpc_sched_submit(to->attach_to, to);
+    }
+    return COROUTINE_YIELD;
 }
 
 Coroutine *qemu_coroutine_self_int(cpc_continuation *c)
@@ -167,3 +809,255 @@ bool qemu_in_coroutine(cpc_continuation *c)
 {
     return (c != NULL);
 }
+
+/**
+ * Work-stealing thread pool
+ *
+ * A detached coroutine is just a continuation, so moving it to another thread
+ * costs nothing more than queueing a pointer.  Each worker has its own deque;
+ * it pushes and pops at the tail, and idle workers steal from the head of
+ * the others.  The semaphore counts queued coroutines, so a worker that gets
+ * past it is guaranteed to find one.
+ *
+ * Re-attaching schedules a bottom half, created when the coroutine detached,
+ * in the AioContext the coroutine detached from.
+ */
+typedef struct CPCWorker {
+    cpc_sched *sched;
+    QemuThread thread;
+
+    QemuMutex lock;
+    QTAILQ_HEAD(CPCWorkerQueue, CoroutineCPC) queue;
+} CPCWorker;
+
+struct cpc_sched {
+    int nr_workers;
+    CPCWorker *workers;
+    QemuSemaphore sem;
+    unsigned int next_worker;
+    bool stopping;
+};
+
+static DEFINE_TLS(CPCWorker *, current_worker);
+
+/* The default pool is started on first use */
+static cpc_sched default_threadpool;
+static QemuMutex default_threadpool_lock;
+cpc_sched *cpc_default_threadpool = &default_threadpool;
+
+static void __attribute__((constructor)) cpc_sched_init(void)
+{
+    qemu_mutex_init(&default_threadpool_lock);
+}
+
+/* Only the owner pops from the tail; thieves take the oldest entry */
+static CoroutineCPC *cpc_worker_pop(CPCWorker *w, bool steal)
+{
+    CoroutineCPC *co;
+
+    qemu_mutex_lock(&w->lock);
+    if (steal) {
+        co = QTAILQ_FIRST(&w->queue);
+    } else {
+        co = QTAILQ_LAST(&w->queue, CPCWorkerQueue);
+    }
+    if (co) {
+        QTAILQ_REMOVE(&w->queue, co, sched_next);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return co;
+}
+
+static CoroutineCPC *cpc_worker_take(CPCWorker *w)
+{
+    cpc_sched *sched = w->sched;
+    CoroutineCPC *co;
+    int i, start;
+
+    for (;;) {
+        co = cpc_worker_pop(w, false);
+        if (co) {
+            return co;
+        }
+
+        start = w - sched->workers;
+        for (i = 1; i < sched->nr_workers; i++) {
+            co = cpc_worker_pop(&sched->workers[(start + i) %
+                                                sched->nr_workers], true);
+            if (co) {
+                return co;
+            }
+        }
+
+        /* The coroutine we were counted for is still being queued */
+        sched_yield();
+    }
+}
+
+static void cpc_sched_attach_bh(void *opaque)
+{
+    CoroutineCPC *co = opaque;
+
+    qemu_bh_delete(co->attach_bh);
+    co->attach_bh = NULL;
+    trace_cpc_sched_attach(co);
+    qemu_coroutine_enter(&co->base, NULL);
+}
+
+static void cpc_sched_run(CPCWorker *w, CoroutineCPC *co)
+{
+    cpc_sched *sched = w->sched;
+
+    co->sched = sched;
+    co->cont->coroutine = &co->base;
+
+    switch (cpc_invoke_continuation(co)) {
+    case CPC_STOP_YIELD:
+        fprintf(stderr, "Co-routine yielded while detached\n");
+        abort();
+    case CPC_STOP_ATTACH:
+        if (co->attach_to) {
+            cpc_sched_submit(co->attach_to, co);
+            return;
+        }
+        break;
+    case CPC_STOP_DONE:
+        /* Termination happens in the home context, like everything else
+         * that touches the coroutine pool. */
+        co->finished = true;
+        break;
+    }
+
+    co->sched = NULL;
+    qemu_bh_schedule(co->attach_bh);
+}
+
+static void *cpc_worker_thread(void *opaque)
+{
+    CPCWorker *w = opaque;
+    cpc_sched *sched = w->sched;
+
+    tls_var(current_worker) = w;
+
+    for (;;) {
+        qemu_sem_wait(&sched->sem);
+        if (sched->stopping) {
+            break;
+        }
+        cpc_sched_run(w, cpc_worker_take(w));
+    }
+    return NULL;
+}
+
+static void cpc_sched_start(cpc_sched *sched, int max_threads)
+{
+    CPCWorker *workers;
+    int i;
+
+    if (max_threads <= 0) {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (max_threads <= 0) {
+            max_threads = 1;
+        }
+    }
+
+    sched->nr_workers = max_threads;
+    qemu_sem_init(&sched->sem, 0);
+
+    workers = g_new0(CPCWorker, max_threads);
+    for (i = 0; i < max_threads; i++) {
+        workers[i].sched = sched;
+        qemu_mutex_init(&workers[i].lock);
+        QTAILQ_INIT(&workers[i].queue);
+    }
+
+    /* Publish the pool only once it is usable, see cpc_sched_submit() */
+    atomic_mb_set(&sched->workers, workers);
+
+    for (i = 0; i < max_threads; i++) {
+        qemu_thread_create(&workers[i].thread, cpc_worker_thread, &workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+cpc_sched *cpc_sched_new(int max_threads)
+{
+    cpc_sched *sched = g_new0(cpc_sched, 1);
+
+    cpc_sched_start(sched, max_threads);
+    return sched;
+}
+
+void cpc_sched_free(cpc_sched *sched)
+{
+    int i;
+
+    assert(sched != cpc_default_threadpool);
+
+    sched->stopping = true;
+    for (i = 0; i < sched->nr_workers; i++) {
+        qemu_sem_post(&sched->sem);
+    }
+    for (i = 0; i < sched->nr_workers; i++) {
+        qemu_thread_join(&sched->workers[i].thread);
+        assert(QTAILQ_EMPTY(&sched->workers[i].queue));
+        qemu_mutex_destroy(&sched->workers[i].lock);
+    }
+
+    qemu_sem_destroy(&sched->sem);
+    g_free(sched->workers);
+    g_free(sched);
+}
+
+static void cpc_sched_submit(cpc_sched *sched, CoroutineCPC *co)
+{
+    CPCWorker *w = tls_var(current_worker);
+
+    if (sched == &default_threadpool && !atomic_mb_read(&sched->workers)) {
+        qemu_mutex_lock(&default_threadpool_lock);
+        if (!sched->workers) {
+            cpc_sched_start(sched, 0);
+        }
+        qemu_mutex_unlock(&default_threadpool_lock);
+    }
+
+    trace_cpc_sched_detach(sched, co);
+
+    /* Keep work local when a worker re-submits to its own pool */
+    if (!w || w->sched != sched) {
+        w = &sched->workers[atomic_fetch_inc(&sched->next_worker) %
+                            sched->nr_workers];
+    }
+
+    qemu_mutex_lock(&w->lock);
+    QTAILQ_INSERT_TAIL(&w->queue, co, sched_next);
+    qemu_mutex_unlock(&w->lock);
+    qemu_sem_post(&sched->sem);
+}
+
+/* Never called: cpc_invoke_continuation() intercepts it */
+struct cpc_continuation *cpc_attach(void *c)
+{
+    abort();
+}
+
+void qemu_coroutine_backend_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    struct cpc_pool_stats stats;
+    int i;
+
+    cpc_pool_get_stats(&stats);
+
+    cpu_fprintf(f, "CoroutineCPC pool: %lu hits, %lu misses\n",
+                stats.coroutine_hits, stats.coroutine_misses);
+    cpu_fprintf(f, "Chunk pool (size, hits, misses):\n");
+    for (i = 0; i < CPC_POOL_NR_CLASSES; i++) {
+        cpu_fprintf(f, "  %8u %12lu %12lu\n", 1U << (i + CPC_POOL_MIN_SHIFT),
+                    stats.chunk_hits[i], stats.chunk_misses[i]);
+    }
+
+#ifdef CONFIG_CPC_PROFILE
+    cpu_fprintf(f, "\n");
+    cpc_profile_dump(f, cpu_fprintf);
+#endif
+}
@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
 
 bool qemu_cpu_has_work(CPUState *cpu)
 {
@@ -169,7 +170,12 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        /* the physical hash table and the translator are shared by all
+           vCPU threads */
+        bool locked = tcg_lock_iothread();
+
         tb = tb_find_slow(env, pc, cs_base, flags);
+        tcg_unlock_iothread(locked);
     }
     return tb;
 }
@@ -273,7 +279,10 @@ int cpu_exec(CPUArchState *env)
                     /* exit request from the cpu execution loop */
                     ret = env->exception_index;
                     if (ret == EXCP_DEBUG) {
+                        bool locked = tcg_lock_iothread();
+
                         cpu_handle_debug_exception(env);
+                        tcg_unlock_iothread(locked);
                     }
                     break;
                 } else {
@@ -287,8 +296,11 @@ int cpu_exec(CPUArchState *env)
                     ret = env->exception_index;
                     break;
 #else
+                    bool locked = tcg_lock_iothread();
+
                     cc->do_interrupt(cpu);
                     env->exception_index = -1;
+                    tcg_unlock_iothread(locked);
 #endif
                 }
             }
@@ -297,6 +309,9 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* interrupt_request is also updated by device code */
+                    bool locked = tcg_lock_iothread();
+
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -573,6 +588,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    tcg_unlock_iothread(locked);
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -606,6 +622,34 @@ int cpu_exec(CPUArchState *env)
                     next_tb = 0;
                     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
                 }
+#ifdef TARGET_HAS_TRACES
+                /* profile the TB until it is hot, then replace it with
+                   a trace.  Do not chain out of a TB until its exits have
+                   been profiled, nor into a TB that is still counting its
+                   entries.  Other vCPU threads update the same counters.  */
+                if (next_tb != 0) {
+                    TranslationBlock *prev_tb =
+                        (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+
+                    if (atomic_read(&prev_tb->exec_count) <
+                        TB_TRACE_THRESHOLD) {
+                        atomic_inc(&prev_tb->exit_count[next_tb &
+                                                        TB_EXIT_MASK]);
+                        next_tb = 0;
+                    }
+                }
+                if (unlikely(atomic_read(&tb->exec_count) <
+                             TB_TRACE_THRESHOLD)) {
+                    if (atomic_fetch_inc(&tb->exec_count) ==
+                        TB_TRACE_THRESHOLD - 1) {
+                        bool locked = tcg_lock_iothread();
+
+                        tb = tb_gen_trace(env, tb);
+                        tcg_unlock_iothread(locked);
+                    }
+                    next_tb = 0;
+                }
+#endif
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
@@ -614,8 +658,11 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
+                    bool locked = tcg_lock_iothread();
+
                     tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
                                 next_tb & TB_EXIT_MASK, tb);
+                    tcg_unlock_iothread(locked);
                 }
                 spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
@@ -681,6 +728,11 @@ int cpu_exec(CPUArchState *env)
              * local variables as longjmp is marked 'noreturn'. */
             cpu = current_cpu;
             env = cpu->env_ptr;
+#if !defined(CONFIG_USER_ONLY)
+            if (qemu_tcg_mttcg_enabled()) {
+                qemu_tcg_release_locks();
+            }
+#endif
         }
     } /* for(;;) */
 
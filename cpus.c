@@ -475,7 +475,11 @@ static void cpu_signal(int sig)
     if (current_cpu) {
         cpu_exit(current_cpu);
     }
-    exit_request = 1;
+    /* With one thread per vCPU the kick is aimed at current_cpu only;
+       the global flag would stop every other vCPU thread as well.  */
+    if (!mttcg_enabled) {
+        exit_request = 1;
+    }
 }
 
 #ifdef CONFIG_LINUX
@@ -616,6 +620,7 @@ static void qemu_tcg_init_cpu_signals(void)
 #endif /* _WIN32 */
 
 static QemuMutex qemu_global_mutex;
+static DEFINE_TLS(bool, iothread_locked);
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
@@ -624,6 +629,13 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Multi-threaded TCG.  vCPU threads run translated code without the
+ * iothread mutex; tcg_running_vcpus counts them and, like the safe work
+ * list, is protected by the iothread mutex.  */
+bool mttcg_enabled;
+static int tcg_running_vcpus;
+static struct qemu_work_item *safe_work_first, *safe_work_last;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -717,6 +729,53 @@ static void flush_queued_work(CPUState *cpu)
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+    CPUState *other;
+
+    if (tcg_running_vcpus == 0) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (safe_work_first == NULL) {
+        safe_work_first = wi;
+    } else {
+        safe_work_last->next = wi;
+    }
+    safe_work_last = wi;
+
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        cpu_exit(other);
+        if (other != cpu) {
+            qemu_cpu_kick(other);
+        }
+    }
+}
+
+static void flush_safe_work(void)
+{
+    struct qemu_work_item *wi;
+    CPUState *cpu;
+
+    while ((wi = safe_work_first)) {
+        safe_work_first = wi->next;
+        wi->func(wi->data);
+        g_free(wi);
+    }
+    safe_work_last = NULL;
+
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        qemu_cond_broadcast(cpu->halt_cond);
+    }
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -748,6 +807,21 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (safe_work_first || cpu_thread_is_idle(cpu)) {
+        if (safe_work_first && tcg_running_vcpus == 0) {
+            flush_safe_work();
+            continue;
+        }
+        /* keep answering stop requests while other vCPUs drain */
+        qemu_wait_io_event_common(cpu);
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -875,6 +949,44 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
+
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+
+    qemu_mutex_lock_iothread();
+    cpu->thread_id = qemu_get_thread_id();
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu) && !safe_work_first) {
+            tcg_running_vcpus++;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            tcg_running_vcpus--;
+            /* cpu_exec() clears it on the way out */
+            current_cpu = cpu;
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_mttcg_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -917,7 +1029,7 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if ((!tcg_enabled() || mttcg_enabled) && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -949,7 +1061,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -960,13 +1072,50 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
+/* A helper may leave translated code through cpu_loop_exit() while holding
+ * the iothread mutex; cpu_exec() calls this on its longjmp landing pad.  */
+void qemu_tcg_release_locks(void)
+{
+    if (tls_var(iothread_locked)) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+void qemu_tcg_configure(const char *threads)
+{
+    if (!threads || !strcmp(threads, "single")) {
+        mttcg_enabled = false;
+    } else if (!strcmp(threads, "multi")) {
+        if (!tcg_mttcg_supported()) {
+            fprintf(stderr, "tcg_threads=multi is not supported for this "
+                    "guest on this host\n");
+            exit(1);
+        }
+        if (use_icount) {
+            fprintf(stderr, "tcg_threads=multi is not allowed with -icount\n");
+            exit(1);
+        }
+        mttcg_enabled = true;
+    } else {
+        fprintf(stderr, "Invalid tcg_threads value: %s\n", threads);
+        exit(1);
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu = first_cpu;
@@ -994,7 +1143,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             cpu = first_cpu;
             while (cpu) {
                 cpu->stop = false;
@@ -1035,6 +1184,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_mttcg_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -26,6 +26,7 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "translate-all.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -358,6 +359,55 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Return the host address of a LEN byte guest store at ADDR, for callers
+ * that write guest RAM directly, e.g. with a host atomic operation.  Fills
+ * the TLB if needed (this can trigger an exception), and invalidates the
+ * translated code on the page and marks it dirty as notdirty_mem_write
+ * would.  Returns NULL if the store must go through the I/O path: MMIO,
+ * ROM, watchpoints, or a store crossing a page boundary.
+ */
+void *tlb_vaddr_to_host_write(CPUArchState *env, target_ulong addr, int len,
+                              int mmu_idx, uintptr_t retaddr)
+{
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    ram_addr_t ram_addr;
+    int dirty_flags;
+    bool locked;
+    void *p;
+
+    if (((addr & ~TARGET_PAGE_MASK) + len) > TARGET_PAGE_SIZE) {
+        return NULL;
+    }
+    if ((addr & TARGET_PAGE_MASK) !=
+        (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        locked = tcg_lock_iothread();
+        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        tcg_unlock_iothread(locked);
+    }
+    if (te->addr_write & TLB_MMIO) {
+        return NULL;
+    }
+
+    p = (void *)((uintptr_t)addr + te->addend);
+    if (te->addr_write & TLB_NOTDIRTY) {
+        locked = tcg_lock_iothread();
+        ram_addr = qemu_ram_addr_from_host_nofail(p);
+        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+        if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+            tb_invalidate_phys_page_fast(ram_addr, len);
+            dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+        }
+        dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+        cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+        if (dirty_flags == 0xff) {
+            tlb_set_dirty(env, addr);
+        }
+        tcg_unlock_iothread(locked);
+    }
+    return p;
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() ((uintptr_t)0)
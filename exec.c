@@ -1747,25 +1747,45 @@ static void core_begin(MemoryListener *listener)
     assert(n == PHYS_SECTION_WATCH);
 }
 
+static void phys_sections_free_work(void *data)
+{
+    phys_sections_free(data);
+}
+
 /* This listener's commit run after the other AddressSpaceDispatch listeners'.
  * All AddressSpaceDispatch instances have switched to the next map.
  */
 static void core_commit(MemoryListener *listener)
 {
-    phys_sections_free(prev_map);
+    if (qemu_tcg_mttcg_enabled()) {
+        /* vCPUs may still be running with TLB entries from the previous
+           map; it goes away only after tcg_commit's flush has run on all
+           of them.  Safe work runs in the order it was queued.  */
+        async_safe_run_on_cpu(first_cpu, phys_sections_free_work, prev_map);
+    } else {
+        phys_sections_free(prev_map);
+    }
 }
 
-static void tcg_commit(MemoryListener *listener)
+static void tcg_flush_all_tlbs(void *data)
 {
     CPUState *cpu;
 
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        tlb_flush(cpu->env_ptr, 1);
+    }
+}
+
+static void tcg_commit(MemoryListener *listener)
+{
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
-    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
-        CPUArchState *env = cpu->env_ptr;
-
-        tlb_flush(env, 1);
+    if (qemu_tcg_mttcg_enabled()) {
+        /* a TLB may only be flushed while its vCPU is out of cpu_exec() */
+        async_safe_run_on_cpu(first_cpu, tcg_flush_all_tlbs, NULL);
+    } else {
+        tcg_flush_all_tlbs(NULL);
     }
 }
 
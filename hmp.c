@@ -213,6 +213,47 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache conflict: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_conflict);
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed raw size: %" PRIu64 " kbytes\n",
+                       info->compression->raw_bytes >> 10);
+        monitor_printf(mon, "compressed transferred: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_bytes >> 10);
+    }
+
+    if (info->has_stream) {
+        monitor_printf(mon, "stream syscalls: %" PRIu64 "\n",
+                       info->stream->syscalls);
+        monitor_printf(mon, "stream bytes per syscall: %" PRIu64 "\n",
+                       info->stream->bytes_per_syscall);
+        if (info->stream->spliced_bytes) {
+            monitor_printf(mon, "stream spliced: %" PRIu64 " kbytes\n",
+                           info->stream->spliced_bytes >> 10);
+        }
+    }
+
+    if (info->has_throttle_percentage && info->throttle_percentage) {
+        monitor_printf(mon, "throttle percentage: %" PRId64 " %%\n",
+                       info->throttle_percentage);
+    }
+
+    if (info->has_dirty_rates) {
+        RAMBlockDirtyRateList *rate;
+
+        for (rate = info->dirty_rates; rate; rate = rate->next) {
+            if (rate->value->dirty_pages_rate) {
+                monitor_printf(mon, "dirty pages rate %s: %" PRId64
+                               " pages\n", rate->value->id,
+                               rate->value->dirty_pages_rate);
+            }
+        }
     }
 
     qapi_free_MigrationInfo(info);
@@ -238,6 +279,33 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "parameters: %s: %" PRId64 " %s: %" PRId64
+                   " %s: %" PRId64 " %s: %" PRId64 " %s: %" PRId64
+                   " %s: %" PRId64 " %s: %" PRId64 "\n",
+        MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+        params->compress_level,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+        params->compress_threads,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+        params->decompress_threads,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_CHANNELS],
+        params->channels,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_CONVERGENCE_TIME],
+        params->convergence_time,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_BLOCK_INFLIGHT],
+        params->block_inflight,
+        MigrationParameter_lookup[MIGRATION_PARAMETER_BUFFER_SIZE],
+        params->buffer_size);
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -372,6 +440,31 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void print_block_cache_stats(Monitor *mon, BlockStats *stats)
+{
+    BlockCacheStatsList *cache;
+
+    if (stats->has_parent) {
+        print_block_cache_stats(mon, stats->parent);
+    }
+    if (!stats->has_caches) {
+        return;
+    }
+
+    for (cache = stats->caches; cache; cache = cache->next) {
+        monitor_printf(mon, "    %s cache: size=%" PRId64
+                       " hits=%" PRId64
+                       " misses=%" PRId64
+                       " evictions=%" PRId64
+                       "\n",
+                       cache->value->name,
+                       cache->value->size,
+                       cache->value->hits,
+                       cache->value->misses,
+                       cache->value->evictions);
+    }
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
@@ -401,6 +494,7 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        print_block_cache_stats(mon, stats->value);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -967,6 +1061,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1024,6 +1126,68 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_channels = false;
+    bool has_convergence_time = false;
+    bool has_block_inflight = false;
+    bool has_buffer_size = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_CHANNELS:
+                has_channels = true;
+                break;
+            case MIGRATION_PARAMETER_CONVERGENCE_TIME:
+                has_convergence_time = true;
+                break;
+            case MIGRATION_PARAMETER_BLOCK_INFLIGHT:
+                has_block_inflight = true;
+                break;
+            case MIGRATION_PARAMETER_BUFFER_SIZE:
+                has_buffer_size = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_channels, value,
+                                       has_convergence_time, value,
+                                       has_block_inflight, value,
+                                       has_buffer_size, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
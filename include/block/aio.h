@@ -197,6 +197,12 @@ bool aio_pending(AioContext *ctx);
  */
 bool aio_poll(AioContext *ctx, bool blocking);
 
+/* Return the AioContext whose aio_poll() is running in the calling thread,
+ * or NULL outside aio_poll().  The main loop dispatches qemu_aio_context
+ * through aio_poll(), so its bottom halves and fd handlers see it too.
+ */
+AioContext *aio_get_current_context(void);
+
 #ifdef CONFIG_POSIX
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushHandler)(void *opaque);
@@ -208,6 +208,10 @@ BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
 int coroutine_fn bdrv_truncate(BlockDriverState *bs, int64_t offset);
 int bdrv_sync_truncate(BlockDriverState *bs, int64_t offset);
+int coroutine_fn bdrv_resize_cache(BlockDriverState *bs, const char *name,
+                                   int64_t size);
+int bdrv_sync_resize_cache(BlockDriverState *bs, const char *name,
+                           int64_t size);
 int64_t bdrv_getlength(BlockDriverState *bs);
 int64_t bdrv_get_allocated_file_size(BlockDriverState *bs);
 void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr);
@@ -172,6 +172,9 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    BlockCacheStatsList *(*bdrv_get_cache_stats)(const BlockDriverState *bs);
+    int coroutine_fn (*bdrv_resize_cache)(BlockDriverState *bs,
+                                          const char *name, int64_t size);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
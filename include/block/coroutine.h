@@ -107,6 +107,71 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
 bool qemu_in_coroutine(void) __attribute__((cpc_need_cont));
 #endif
 
+typedef struct CoroutinePoolStats {
+    uint64_t hits;          /* taken from the thread's own cache */
+    uint64_t release_hits;  /* taken from the global release pool */
+    uint64_t misses;        /* allocated by the backend */
+    uint64_t spills;        /* freed to the global release pool */
+    uint64_t frees;         /* freed to the backend */
+    uint64_t pooled;        /* currently cached */
+} CoroutinePoolStats;
+
+/**
+ * Get the statistics of the coroutine free pool, summed over all threads
+ */
+void qemu_coroutine_pool_get_stats(CoroutinePoolStats *stats);
+
+/**
+ * Print coroutine allocator statistics
+ *
+ * With the CPC backend built with --enable-cpc-profile, this also prints
+ * histograms of frame sizes and continuation lengths.
+ */
+void qemu_coroutine_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+/**
+ * Create a pool of worker threads that coroutines can detach to
+ *
+ * If @max_threads is zero or negative, one thread per host CPU is started.
+ *
+ * Only available with the CPC coroutine backend.
+ */
+cpc_sched *cpc_sched_new(int max_threads);
+
+/**
+ * Stop the worker threads of a pool created with cpc_sched_new()
+ *
+ * No coroutine may be detached to the pool when this is called.
+ */
+void cpc_sched_free(cpc_sched *sched);
+
+/**
+ * Move the current coroutine to another scheduler
+ *
+ * Passing a pool created with cpc_sched_new(), or cpc_default_threadpool,
+ * detaches the coroutine: control returns to its caller as with
+ * qemu_coroutine_yield(), and the rest of the coroutine runs on one of the
+ * pool's worker threads.  Passing cpc_default_sched re-attaches it to the
+ * AioContext whose aio_poll() detached it (the main loop's if it was entered
+ * outside aio_poll()), where it is re-entered from a bottom half.  Calls that
+ * do not change the scheduler are no-ops.
+ *
+ * While detached, a coroutine may block but must not yield nor use CoQueue,
+ * CoMutex or any other AioContext state.  cpc_default_threadpool is started
+ * on first use.
+ *
+ * For example, to run a blocking system call without stalling the event loop:
+ *
+ *   cpc_attach(cpc_default_threadpool);
+ *   ret = fallocate(fd, mode, offset, len);
+ *   cpc_attach(cpc_default_sched);
+ *
+ * Only available with the CPC coroutine backend.
+ */
+#ifndef QEMU_COROUTINE_CPC
+void coroutine_fn cpc_attach(cpc_sched *sched);
+#endif
+
 
 
 /**
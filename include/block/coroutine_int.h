@@ -33,11 +33,14 @@ typedef enum {
     COROUTINE_TERMINATE = 2,
 } CoroutineAction;
 
+typedef struct CoroutinePool CoroutinePool;
+
 struct Coroutine {
     CoroutineEntry *entry;
     void *entry_arg;
     Coroutine *caller;
     QSLIST_ENTRY(Coroutine) pool_next;
+    CoroutinePool *pool;    /* the pool it was created from */
 
     /* Coroutines that should be woken up when we yield or terminate */
     QTAILQ_HEAD(, Coroutine) co_queue_wakeup;
@@ -52,5 +55,6 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
 Coroutine *qemu_coroutine_self_int(void) __attribute__((cpc_need_cont));
 #endif
 void qemu_co_queue_run_restart(Coroutine *co);
+void qemu_coroutine_backend_dump_info(FILE *f, fprintf_function cpu_fprintf);
 
 #endif
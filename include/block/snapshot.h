@@ -38,6 +38,22 @@ typedef struct QEMUSnapshotInfo {
     uint64_t vm_clock_nsec; /* VM clock relative to boot */
 } QEMUSnapshotInfo;
 
+/*
+ * The VM state of an incremental snapshot starts with this header, followed
+ * by a migration stream that only has the RAM pages dirtied since the parent
+ * snapshot.  Fields are big endian.
+ */
+#define SNAPSHOT_DELTA_MAGIC   0x51455644 /* "QEVD" */
+#define SNAPSHOT_DELTA_VERSION 1
+
+typedef struct QEMU_PACKED SnapshotDeltaHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t parent_date_sec;
+    uint32_t parent_date_nsec;
+    char parent_id[128];
+} SnapshotDeltaHeader;
+
 int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
                        const char *name);
 int bdrv_can_snapshot(BlockDriverState *bs);
@@ -50,4 +66,10 @@ int bdrv_snapshot_list(BlockDriverState *bs,
                        QEMUSnapshotInfo **psn_info);
 int bdrv_snapshot_load_tmp(BlockDriverState *bs,
                            const char *snapshot_name);
+
+void bdrv_snapshot_delta_header(SnapshotDeltaHeader *hdr,
+                                const QEMUSnapshotInfo *parent);
+int bdrv_snapshot_vmstate_chain(BlockDriverState *bs, const char *snapshot_id,
+                                QEMUSnapshotInfo **pchain);
+int bdrv_snapshot_flatten(BlockDriverState *bs, const char *snapshot_id);
 #endif
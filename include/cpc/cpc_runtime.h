@@ -33,6 +33,9 @@ THE SOFTWARE.
 #include <stddef.h> // size_t
 #include <time.h>
 
+/* The continuation layout depends on CONFIG_CPC_PROFILE */
+#include "config-host.h"
+
 /* If you want to build with the --packed option, do not forget to set:
 #define CPC_COMPACT_CONTINUATIONS 1
 This is broken on some architectures.
@@ -65,34 +68,94 @@ extern cpc_sched *cpc_default_threadpool;
 
 typedef struct Coroutine Coroutine;
 
+/* A continuation is a stack of frames stored in a chain of chunks.  When a
+ * frame does not fit in the topmost chunk, the next one is used; frames never
+ * straddle two chunks, so growing a continuation never copies it and there is
+ * no limit on its depth.  Chunks above the top are kept as spares and reused
+ * when the continuation grows again.
+ */
+typedef struct cpc_chunk {
+    struct cpc_chunk *prev;     /* older frames */
+    struct cpc_chunk *next;     /* spare chunk, reused on the next overflow */
+    size_t length;              /* bytes in use */
+    size_t size;                /* capacity of c */
+    char c[1];
+} cpc_chunk;
+
 typedef struct cpc_continuation {
-    unsigned short length;
-    unsigned short size;
+    cpc_chunk *top;             /* chunk holding the most recent frame */
     Coroutine *coroutine;
 #ifdef CPC_INDIRECT_PATCH
     void *cpc_retval; // where to write the next return value
 #endif
-    char c[1];
+#ifdef CONFIG_CPC_PROFILE
+    size_t prof_length;         /* bytes in use across all chunks */
+    size_t prof_peak;           /* highest prof_length so far */
+    size_t prof_frame;          /* bytes allocated since the last push */
+    unsigned int prof_expands;  /* number of chunk switches */
+#endif
 } cpc_continuation;
 
 extern void cpc_print_continuation(struct cpc_continuation *c, char *s);
 
+/* Chunks are recycled through per-thread free lists, one per power-of-two
+ * size class from 256 bytes to 64 KiB.  Larger chunks are only allocated for
+ * frames that do not fit in 64 KiB and are not pooled.  CoroutineCPC objects
+ * have a per-thread free list of their own. */
+#define CPC_POOL_NR_CLASSES 9
+
+struct cpc_pool_stats {
+    unsigned long chunk_hits[CPC_POOL_NR_CLASSES];
+    unsigned long chunk_misses[CPC_POOL_NR_CLASSES];
+    unsigned long coroutine_hits;
+    unsigned long coroutine_misses;
+};
+
+extern void cpc_pool_get_stats(struct cpc_pool_stats *stats);
+
 typedef cpc_continuation *cpc_function(void*);
 
+#ifdef CONFIG_CPC_PROFILE
+/* Account the frame allocated since the previous push to f */
+extern void cpc_profile_push(struct cpc_continuation *c, cpc_function *f);
+
+static inline void
+cpc_profile_grow(struct cpc_continuation *c, int s)
+{
+    c->prof_length += s;
+    if(c->prof_length > c->prof_peak)
+        c->prof_peak = c->prof_length;
+}
+#endif
+
+/* Make room for n contiguous bytes on top of c, allocating a new continuation
+ * if c is NULL.  Never moves existing frames. */
 struct cpc_continuation *cpc_continuation_expand(struct cpc_continuation *c,
                                                  int n);
 
+static inline int
+cpc_continuation_empty(const struct cpc_continuation *c)
+{
+    return c->top->length == 0;
+}
+
 static inline void* 
 cpc_alloc(struct cpc_continuation **cp, int s)
 {
     struct cpc_continuation *c;
+    cpc_chunk *k;
     void *p;
 
     c = *cp;
-    if(c == (void*)0 || s > c->size - c->length)
+    if(c == (void*)0 || s > c->top->size - c->top->length)
         c = cpc_continuation_expand(c, s);
-    p = c->c + c->length;
-    c->length += s;
+    k = c->top;
+    p = k->c + k->length;
+    k->length += s;
+#ifdef CONFIG_CPC_PROFILE
+    cpc_profile_grow(c, s);
+    c->prof_frame += s;
+#endif
     *cp = c;
     return p;
 }
@@ -100,8 +163,17 @@ cpc_alloc(struct cpc_continuation **cp, int s)
 static inline void*
 cpc_dealloc(struct cpc_continuation *c, int s)
 {
-    c->length -= s;
-    return c->c + c->length;
+    cpc_chunk *k = c->top;
+
+    k->length -= s;
+#ifdef CONFIG_CPC_PROFILE
+    c->prof_length -= s;
+#endif
+    /* Step down once the chunk is empty; k stays linked as the spare of the
+     * chunk below, so the returned frame remains valid. */
+    if(k->length == 0 && k->prev != (void*)0)
+        c->top = k->prev;
+    return k->c + k->length;
 }
 
 #define CPC_IO_IN 1
@@ -112,12 +184,18 @@ cpc_dealloc(struct cpc_continuation *c, int s)
 static inline struct cpc_continuation *
 cpc_continuation_push(cpc_continuation *c, cpc_function *f)
 {
+    cpc_chunk *k;
 
-    if(c == (void*)0 || PTR_SIZE > c->size - c->length)
+    if(c == (void*)0 || PTR_SIZE > c->top->size - c->top->length)
         c = cpc_continuation_expand(c, PTR_SIZE);
 
-    *(cpc_function**)(c->c + c->length) = f;
-    c->length += PTR_SIZE;
+    k = c->top;
+    *(cpc_function**)(k->c + k->length) = f;
+    k->length += PTR_SIZE;
+#ifdef CONFIG_CPC_PROFILE
+    cpc_profile_grow(c, PTR_SIZE);
+    cpc_profile_push(c, f);
+#endif
     return c;
 }
 
@@ -125,12 +203,20 @@ static inline void
 cpc_continuation_patch(cpc_continuation *cont, size_t size, const void *value)
 {
   void *cpc_arg;
-  cpc_arg =
 #ifdef CPC_INDIRECT_PATCH
-    ((cont)->cpc_retval);
+  cpc_arg = ((cont)->cpc_retval);
   if(cpc_arg == NULL) return; /* this should not happen if the caller is smart enough */
 #else
-    ((cont)->c + (cont)->length - PTR_SIZE - ((size - 1) / MAX_ALIGN + 1) * MAX_ALIGN);
+  cpc_chunk *k = cont->top;
+  size_t slot = ((size - 1) / MAX_ALIGN + 1) * MAX_ALIGN;
+
+  /* The return slot ends the frame just below the topmost function pointer.
+   * If that pointer opened a new chunk, the frame is at the end of the
+   * previous one. */
+  if(k->length == PTR_SIZE && k->prev != (void*)0)
+    cpc_arg = k->prev->c + k->prev->length - slot;
+  else
+    cpc_arg = k->c + k->length - PTR_SIZE - slot;
 #endif
   __builtin_memcpy(cpc_arg, value, size);
   return;
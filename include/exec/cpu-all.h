@@ -449,6 +449,11 @@ typedef struct RAMBlock {
     ram_addr_t length;
     uint32_t flags;
     char idstr[256];
+    /* Pages found dirty by the migration in the current period, and the
+     * smoothed rate in pages per second.  Protected by the iothread lock.
+     */
+    uint64_t dirty_pages_period;
+    uint64_t dirty_pages_rate;
     /* Reads can take either the iothread or the ramlist lock.
      * Writes must take both locks.
      */
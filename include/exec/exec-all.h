@@ -21,6 +21,10 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "qemu/main-loop.h"
+#include "sysemu/cpus.h"
+#endif
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 #define DEBUG_DISAS
@@ -87,6 +91,8 @@ void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb);
+int tb_trace_hot_exit(TranslationBlock *trace, target_ulong pc);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -101,7 +107,29 @@ void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+void *tlb_vaddr_to_host_write(CPUArchState *env, target_ulong addr, int len,
+                              int mmu_idx, uintptr_t retaddr);
 void tb_invalidate_phys_addr(hwaddr addr);
+
+/* With multi-threaded TCG the vCPU threads execute translated code without
+   the iothread mutex.  Slow paths touching device, memory map or TB state
+   take it for the duration of the access; a cpu_loop_exit() in between is
+   handled by cpu_exec().  Returns whether the mutex was acquired.  */
+static inline bool tcg_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+static inline void tcg_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
@@ -110,6 +138,15 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline bool tcg_lock_iothread(void)
+{
+    return false;
+}
+
+static inline void tcg_unlock_iothread(bool locked)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -117,6 +154,18 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
+/* the code buffer is split into at most this many regions, filled in turn;
+   when the last one is full the oldest is evicted instead of flushing
+   everything */
+#define CODE_GEN_MAX_REGIONS        8
+
+/* Targets defining TARGET_HAS_TRACES re-translate a TB as a trace once it
+   has been entered from the dispatcher this many times.  Until then jumps
+   to it are not chained, so that its entries and exits can be counted.  */
+#define TB_TRACE_THRESHOLD          64
+/* maximum number of guest basic blocks in a trace */
+#define TB_TRACE_MAX_BLOCKS         8
+
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
    according to the host CPU */
@@ -139,9 +188,10 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TRACE       0x10000 /* Follow hot branches, see tb_gen_trace.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -166,10 +216,37 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* profile gathered before the TB is chained: entries from the
+       dispatcher and which of the two exits was taken; updated with
+       atomic operations by all vCPU threads */
+    uint32_t exec_count;
+    uint32_t exit_count[2];
+    /* for CF_TRACE blocks, the number of conditional branches followed and
+       a bitmap of those followed to their target rather than falling
+       through, so that gen_intermediate_code_pc() takes the same path */
+    uint8_t trace_nb_cond;
+    uint8_t trace_taken;
+    /* set by tb_phys_invalidate; another vCPU thread may still hold a
+       pointer to this TB and must not chain to it */
+    bool invalid;
 };
 
 #include "exec/spinlock.h"
 
+typedef struct TBRegion TBRegion;
+
+struct TBRegion {
+    uint8_t *code_start;
+    /* no translation may start at or past this point */
+    uint8_t *code_end;
+    /* end of the generated code, except for the region being filled
+       whose allocation pointer is tcg_ctx.code_gen_ptr */
+    uint8_t *code_ptr;
+    /* TB descriptors of the region, sorted by tc_ptr */
+    TranslationBlock *tbs;
+    int nb_tbs;
+};
+
 typedef struct TBContext TBContext;
 
 struct TBContext {
@@ -177,12 +254,22 @@ struct TBContext {
     TranslationBlock *tbs;
     TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
     int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
+
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    size_t region_size;
+    int region_max_tbs;
+    /* any access to the tbs or the page table must use this lock; with
+       multi-threaded TCG the iothread mutex serves this purpose */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int region_evict_count;
+    int region_evict_tbs;
+    int tb_trace_count;
 
     int tb_invalidated_flag;
 };
@@ -285,7 +372,7 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
     /* NOTE: this test is only needed for thread safety */
-    if (!tb->jmp_next[n]) {
+    if (!tb->jmp_next[n] && !tb->invalid && !tb_next->invalid) {
         /* patch the native jump address */
         tb_set_jmp_target(tb, n, (uintptr_t)tb_next->tc_ptr);
 
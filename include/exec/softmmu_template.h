@@ -64,8 +64,10 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
                                               uintptr_t retaddr)
 {
     uint64_t val;
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr;
+    bool locked = tcg_lock_iothread();
 
+    mr = iotlb_to_region(physaddr);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !can_do_io(env)) {
@@ -74,6 +76,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
 
     env->mem_io_vaddr = addr;
     io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+    tcg_unlock_iothread(locked);
     return val;
 }
 
@@ -130,7 +133,12 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        {
+            bool locked = tcg_lock_iothread();
+
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+            tcg_unlock_iothread(locked);
+        }
         goto redo;
     }
     return res;
@@ -182,7 +190,12 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        {
+            bool locked = tcg_lock_iothread();
+
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+            tcg_unlock_iothread(locked);
+        }
         goto redo;
     }
     return res;
@@ -202,8 +215,10 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
                                           target_ulong addr,
                                           uintptr_t retaddr)
 {
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr;
+    bool locked = tcg_lock_iothread();
 
+    mr = iotlb_to_region(physaddr);
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !can_do_io(env)) {
         cpu_io_recompile(env, retaddr);
@@ -212,6 +227,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
     env->mem_io_vaddr = addr;
     env->mem_io_pc = retaddr;
     io_mem_write(mr, physaddr, val, 1 << SHIFT);
+    tcg_unlock_iothread(locked);
 }
 
 void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
@@ -262,7 +278,12 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        {
+            bool locked = tcg_lock_iothread();
+
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+            tcg_unlock_iothread(locked);
+        }
         goto redo;
     }
 }
@@ -312,7 +333,12 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        {
+            bool locked = tcg_lock_iothread();
+
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+            tcg_unlock_iothread(locked);
+        }
         goto redo;
     }
 }
@@ -48,12 +48,22 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
+    char *uri;
+    bool start_postcopy;
+    QEMUFileStats stream_stats;
+    /* Set for the lifetime of the migration thread, whose streams may
+     * connect more channels to uri; never set for savevm */
+    bool extra_channels;
 };
 
 void process_incoming_migration(QEMUFile *f);
 
+void migrate_incoming_set_listener(int fd);
+int migrate_incoming_accept_channel(void);
+
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
@@ -98,6 +108,12 @@ MigrationState *migrate_get_current(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+int ram_throttle_percentage(void);
+RAMBlockDirtyRateList *ram_dirty_rates(void);
+
+void ram_snapshot_begin(bool track, bool delta);
+bool ram_snapshot_tracking(void);
+void ram_snapshot_stop(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -112,7 +128,12 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_conflict(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_raw_bytes_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -137,11 +158,33 @@ bool migrate_auto_converge(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+/* Same output as xbzrle_encode_buffer(), without vector instructions */
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                 uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+void migrate_decompress_threads_create(void);
+void migrate_decompress_threads_join(void);
+
+int migrate_ram_channels(void);
+int migrate_convergence_time(void);
+int migrate_block_inflight(void);
+size_t migrate_buffer_size(void);
+int migrate_open_channel(MigrationState *s, Error **errp);
+void migrate_ram_channels_join(void);
+
+bool migrate_postcopy(void);
+bool migrate_use_splice(void);
+int ram_postcopy_wait(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
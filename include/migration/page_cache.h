@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -21,6 +21,7 @@ typedef struct PageCache PageCache;
 /**
  * cache_init: Initialize the page cache
  *
+ * The memory for all pages is allocated upfront.
  *
  * Returns new allocated cache or NULL on error
  *
@@ -49,22 +50,27 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr);
 /**
  * get_cached_data: Get the data cached for an addr
  *
+ * Marks the page as the most recently used one.
+ *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will copy the data on insert. the previous value will be overwritten.
+ * If the set of the page is full, its least recently used page is evicted.
+ *
+ * Returns %true if another page was evicted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+bool cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
@@ -0,0 +1,81 @@
+/*
+ * QEMU post-copy live migration, destination side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_POSTCOPY_H
+#define QEMU_MIGRATION_POSTCOPY_H
+
+#include "qemu-common.h"
+
+/**
+ * PostcopyRequestFunc: Asks the source for a missing page
+ *
+ * Called from the fault thread with the host address of the page.  Each
+ * missing page is requested at most once.
+ */
+typedef void PostcopyRequestFunc(void *host, void *opaque);
+
+/**
+ * postcopy_incoming_init: Starts catching accesses to missing pages
+ *
+ * Needs userfaultfd, which also catches the accesses the kernel makes to
+ * guest memory on behalf of QEMU (KVM, block and network I/O).
+ *
+ * Returns 0 on success, a negative errno value on failure
+ *
+ * @request: called for each page that is accessed before it was placed
+ * @opaque: passed to @request
+ */
+int postcopy_incoming_init(PostcopyRequestFunc *request, void *opaque);
+
+/**
+ * postcopy_incoming_add_range: Registers a range of guest memory
+ *
+ * Must be called for every RAM block before discarding pages in it.
+ *
+ * Returns 0 on success, a negative errno value on failure
+ *
+ * @host: start of the range, aligned to the host page size
+ * @length: length of the range in bytes
+ */
+int postcopy_incoming_add_range(void *host, size_t length);
+
+/**
+ * postcopy_incoming_discard: Marks pages as missing
+ *
+ * Their contents are dropped and the first access to each of them waits
+ * until it is placed with postcopy_incoming_place().
+ *
+ * Returns 0 on success, a negative errno value on failure
+ *
+ * @host: start of the pages, inside a registered range
+ * @length: length of the pages in bytes
+ */
+int postcopy_incoming_discard(void *host, size_t length);
+
+/**
+ * postcopy_incoming_place: Atomically fills a missing page
+ *
+ * Wakes up the threads waiting for the page.  Pages that are not missing
+ * are left alone.
+ *
+ * Returns 0 on success, a negative errno value on failure
+ *
+ * @host: address of the page
+ * @data: contents of the page, one host page long
+ */
+int postcopy_incoming_place(void *host, const void *data);
+
+/**
+ * postcopy_incoming_cleanup: Stops the fault thread and forgets all ranges
+ *
+ * Must only be called once no page is missing anymore, or when the guest
+ * is not going to run.
+ */
+void postcopy_incoming_cleanup(void);
+
+#endif
@@ -24,6 +24,7 @@
 #ifndef QEMU_FILE_H
 #define QEMU_FILE_H 1
 #include "exec/cpu-common.h"
+#include "qemu/thread.h"
 
 /* This function writes a chunk of data to a file at the given position.
  * The pos argument can be ignored if the file is only being used for
@@ -92,8 +93,23 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
+
+    /* Size of the buffer and maximum number of iovecs per write, for
+     * transports that move a lot of data.  0 for the defaults.  The buffer
+     * size can be changed per file with qemu_file_set_buffer_size().
+     */
+    int buf_size;
+    int iov_max;
 } QEMUFileOps;
 
+/* Writes to one or more files, see qemu_file_set_stats() */
+typedef struct QEMUFileStats {
+    QemuMutex lock;
+    uint64_t syscalls;          /* system calls that wrote data */
+    uint64_t bytes;             /* bytes they wrote */
+    uint64_t spliced_bytes;     /* bytes passed by reference */
+} QEMUFileStats;
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
@@ -107,9 +123,19 @@ void qemu_put_byte(QEMUFile *f, int v);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
+ * With splicing, the kernel may read the buffer even later, so only
+ * use this for memory whose later changes are harmless, such as guest
+ * RAM during migration: changed pages are sent again.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 bool qemu_file_mode_is_not_valid(const char *mode);
+bool qemu_file_enable_splice(QEMUFile *f);
+int qemu_file_splice_wait(QEMUFile *f);
+void qemu_file_set_buffer_size(QEMUFile *f, size_t size);
+void qemu_file_set_stats(QEMUFile *f, QEMUFileStats *stats);
+void qemu_file_stats_init(QEMUFileStats *stats);
+void qemu_file_stats_get(QEMUFileStats *stats, uint64_t *syscalls,
+                         uint64_t *bytes, uint64_t *spliced_bytes);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
 {
@@ -137,6 +163,7 @@ unsigned int qemu_get_be32(QEMUFile *f);
 uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
@@ -40,6 +40,10 @@ typedef struct SaveVMHandlers {
 
     void (*cancel)(void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
+    /* Replaces save_live_complete when switching to post-copy migration;
+     * whatever it leaves to send is sent after the guest resumed on the
+     * destination.  */
+    int (*save_live_postcopy)(QEMUFile *f, void *opaque);
 
     /* This runs both outside and inside the iothread lock.  */
     bool (*is_active)(void *opaque);
@@ -277,6 +277,7 @@ typedef struct PCIHostDeviceAddress {
 
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
+bool tcg_mttcg_supported(void);
 
 void cpu_exec_init_all(void);
 
@@ -195,6 +195,22 @@ struct {                                                                \
         (head)->slh_first = (elm);                                      \
 } while (/*CONSTCOND*/0)
 
+/*
+ * Lock-free variants.  Only pushing single elements and detaching the whole
+ * list are provided, which keeps them safe from the ABA problem.
+ */
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                 \
+        typeof(elm) save_sle_next;                                      \
+        do {                                                            \
+            save_sle_next = (elm)->field.sle_next = (head)->slh_first;  \
+        } while (atomic_cmpxchg(&(head)->slh_first, save_sle_next,      \
+                                (elm)) != save_sle_next);               \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                               \
+        (dest)->slh_first = atomic_xchg(&(src)->slh_first, NULL);       \
+} while (/*CONSTCOND*/0)
+
 #define QSLIST_REMOVE_HEAD(head, field) do {                             \
         (head)->slh_first = (head)->slh_first->field.sle_next;          \
 } while (/*CONSTCOND*/0)
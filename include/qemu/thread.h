@@ -53,4 +53,10 @@ void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 
+struct Notifier;
+/* Run @notifier when the current thread exits.  Not called for the main
+ * thread, whose resources are released by the exit of the process. */
+void qemu_thread_atexit_add(struct Notifier *notifier);
+void qemu_thread_atexit_remove(struct Notifier *notifier);
+
 #endif
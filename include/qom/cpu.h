@@ -393,6 +393,20 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU on whose behalf the work is queued.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution once no vCPU thread is
+ * executing translated code, and kicks every vCPU out of its execution
+ * loop.  Runs @func immediately if no vCPU is running.  Must be called
+ * with the iothread mutex held.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
 /**
  * qemu_for_each_cpu:
  * @func: The function to be executed.
@@ -13,6 +13,17 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* Multi-threaded TCG: one host thread per vCPU (cpus.c) */
+extern bool mttcg_enabled;
+
+static inline bool qemu_tcg_mttcg_enabled(void)
+{
+    return mttcg_enabled;
+}
+
+void qemu_tcg_configure(const char *threads);
+void qemu_tcg_release_locks(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
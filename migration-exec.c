@@ -40,6 +40,9 @@ void exec_start_outgoing_migration(MigrationState *s, const char *command, Error
         error_setg_errno(errp, errno, "failed to popen the migration target");
         return;
     }
+    if (migrate_use_splice()) {
+        qemu_file_enable_splice(s->file);
+    }
 
     migrate_fd_connect(s);
 }
@@ -37,6 +37,9 @@ void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **
         return;
     }
     s->file = qemu_fdopen(fd, "wb");
+    if (migrate_use_splice()) {
+        qemu_file_enable_splice(s->file);
+    }
 
     migrate_fd_connect(s);
 }
@@ -0,0 +1,345 @@
+/*
+ * QEMU post-copy live migration, destination side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "migration/postcopy.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#endif
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef CONFIG_USERFAULTFD
+
+/* Missing pages are discarded and the kernel reports the first access to
+ * each of them on the userfaultfd, whatever the thread and whether the
+ * access comes from user space or from the kernel (KVM, O_DIRECT reads,
+ * vhost, ...).  Pages are filled atomically with UFFDIO_COPY.
+ *
+ * Protecting missing pages and catching SIGSEGV is not an alternative: the
+ * kernel's own accesses to guest memory, such as a device reading a disk
+ * into a guest buffer, would fail with EFAULT instead of waiting.
+ *
+ * The fault thread requests each missing page once; pages that were never
+ * sent are present from the start.
+ */
+enum {
+    POSTCOPY_PAGE_PRESENT,
+    POSTCOPY_PAGE_MISSING,
+    POSTCOPY_PAGE_REQUESTED,
+};
+
+typedef struct PostcopyRange {
+    uint8_t *host;
+    size_t length;
+    uint8_t *state;             /* POSTCOPY_PAGE_*, one per host page */
+} PostcopyRange;
+
+static struct {
+    PostcopyRange *ranges;
+    int nr_ranges;
+    size_t page_size;
+    int uffd;
+    int pipe[2];                /* written to when the fault thread must quit */
+    QemuThread thread;
+    PostcopyRequestFunc *request;
+    void *opaque;
+    bool active;
+} postcopy;
+
+static PostcopyRange *postcopy_find_range(const uint8_t *addr)
+{
+    int i;
+
+    for (i = 0; i < postcopy.nr_ranges; i++) {
+        PostcopyRange *r = &postcopy.ranges[i];
+
+        if (addr >= r->host && addr < r->host + r->length) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_fault(uint8_t *addr)
+{
+    PostcopyRange *r = postcopy_find_range(addr);
+    uint8_t *host;
+    size_t idx;
+
+    if (!r) {
+        return;
+    }
+
+    idx = (addr - r->host) / postcopy.page_size;
+    host = r->host + idx * postcopy.page_size;
+
+    switch (atomic_cmpxchg(&r->state[idx], POSTCOPY_PAGE_MISSING,
+                           POSTCOPY_PAGE_REQUESTED)) {
+    case POSTCOPY_PAGE_MISSING:
+        DPRINTF("requesting %p\n", host);
+        postcopy.request(host, postcopy.opaque);
+        break;
+    case POSTCOPY_PAGE_PRESENT: {
+        /* Never populated on this side, and not sent because it was zero */
+        struct uffdio_zeropage zero = {
+            .range = {
+                .start = (uintptr_t)host,
+                .len = postcopy.page_size,
+            },
+        };
+
+        if (ioctl(postcopy.uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+            errno != EEXIST) {
+            fprintf(stderr, "postcopy: cannot zero %p: %s\n",
+                    host, strerror(errno));
+        }
+        break;
+    }
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = postcopy.pipe[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = postcopy.uffd;
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            struct uffd_msg msg;
+
+            if (read(postcopy.uffd, &msg, sizeof(msg)) == sizeof(msg) &&
+                msg.event == UFFD_EVENT_PAGEFAULT) {
+                postcopy_fault((uint8_t *)(uintptr_t)
+                               msg.arg.pagefault.address);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int postcopy_open_userfaultfd(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (ioctl(fd, UFFDIO_API, &api) < 0) {
+        int ret = -errno;
+
+        DPRINTF("userfaultfd API mismatch: %s\n", strerror(errno));
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+int postcopy_incoming_init(PostcopyRequestFunc *request, void *opaque)
+{
+    int ret;
+
+    if (postcopy.active) {
+        return -EBUSY;
+    }
+
+    memset(&postcopy, 0, sizeof(postcopy));
+    postcopy.page_size = getpagesize();
+    postcopy.request = request;
+    postcopy.opaque = opaque;
+    postcopy.uffd = postcopy_open_userfaultfd();
+    if (postcopy.uffd < 0) {
+        ret = postcopy.uffd;
+        fprintf(stderr, "postcopy: userfaultfd is not available: %s\n",
+                strerror(-ret));
+        return ret;
+    }
+
+    if (qemu_pipe(postcopy.pipe) < 0) {
+        ret = -errno;
+        close(postcopy.uffd);
+        return ret;
+    }
+
+    qemu_thread_create(&postcopy.thread, postcopy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    postcopy.active = true;
+    return 0;
+}
+
+int postcopy_incoming_add_range(void *host, size_t length)
+{
+    struct uffdio_register reg = {
+        .range = {
+            .start = (uintptr_t)host,
+            .len = length,
+        },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    PostcopyRange *r;
+
+    postcopy.ranges = g_renew(PostcopyRange, postcopy.ranges,
+                              postcopy.nr_ranges + 1);
+    r = &postcopy.ranges[postcopy.nr_ranges];
+    r->host = host;
+    r->length = length;
+    r->state = g_malloc0(length / postcopy.page_size);
+    postcopy.nr_ranges++;
+
+#ifdef MADV_NOHUGEPAGE
+    /* Pages are placed one host page at a time */
+    madvise(host, length, MADV_NOHUGEPAGE);
+#endif
+
+    if (ioctl(postcopy.uffd, UFFDIO_REGISTER, &reg) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_incoming_discard(void *host, size_t length)
+{
+    PostcopyRange *r = postcopy_find_range(host);
+    size_t first, i;
+    int ret;
+
+    if (!r || (uint8_t *)host + length > r->host + r->length) {
+        return -EINVAL;
+    }
+
+    first = ((uint8_t *)host - r->host) / postcopy.page_size;
+    for (i = 0; i < length / postcopy.page_size; i++) {
+        r->state[first + i] = POSTCOPY_PAGE_MISSING;
+    }
+    smp_wmb();
+
+    ret = qemu_madvise(host, length, QEMU_MADV_DONTNEED);
+    return ret < 0 ? -errno : 0;
+}
+
+int postcopy_incoming_place(void *host, const void *data)
+{
+    PostcopyRange *r = postcopy_find_range(host);
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)data,
+        .len = postcopy.page_size,
+    };
+    uint8_t *state;
+
+    if (!r) {
+        return -EINVAL;
+    }
+
+    state = &r->state[((uint8_t *)host - r->host) / postcopy.page_size];
+    if (atomic_mb_read(state) == POSTCOPY_PAGE_PRESENT) {
+        return 0;
+    }
+
+    if (ioctl(postcopy.uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    atomic_mb_set(state, POSTCOPY_PAGE_PRESENT);
+    return 0;
+}
+
+void postcopy_incoming_cleanup(void)
+{
+    char quit = 0;
+    int i;
+
+    if (!postcopy.active) {
+        return;
+    }
+
+    if (write(postcopy.pipe[1], &quit, sizeof(quit)) == sizeof(quit)) {
+        qemu_thread_join(&postcopy.thread);
+    }
+
+    for (i = 0; i < postcopy.nr_ranges; i++) {
+        PostcopyRange *r = &postcopy.ranges[i];
+        struct uffdio_range range = {
+            .start = (uintptr_t)r->host,
+            .len = r->length,
+        };
+
+        ioctl(postcopy.uffd, UFFDIO_UNREGISTER, &range);
+        /* As set up by qemu_ram_alloc_from_ptr() */
+        qemu_madvise(r->host, r->length, QEMU_MADV_HUGEPAGE);
+        g_free(r->state);
+    }
+    g_free(postcopy.ranges);
+
+    close(postcopy.uffd);
+    close(postcopy.pipe[0]);
+    close(postcopy.pipe[1]);
+    memset(&postcopy, 0, sizeof(postcopy));
+}
+
+#else /* !CONFIG_USERFAULTFD */
+
+int postcopy_incoming_init(PostcopyRequestFunc *request, void *opaque)
+{
+    fprintf(stderr, "postcopy: userfaultfd is not supported on this host\n");
+    return -ENOSYS;
+}
+
+int postcopy_incoming_add_range(void *host, size_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_incoming_discard(void *host, size_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_incoming_place(void *host, const void *data)
+{
+    return -ENOSYS;
+}
+
+void postcopy_incoming_cleanup(void)
+{
+}
+
+#endif
@@ -74,6 +74,24 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * Pipelined writes (x-rdma-pipeline capability, source only).
+ *
+ * At most RDMA_WRITE_WINDOW writes are outstanding and only one in
+ * RDMA_WRITE_SIGNAL_INTERVAL asks for a completion.  Work requests complete
+ * in order on the queue pair, so a completion retires every write posted
+ * before it, including the unsignaled ones.  The window must leave room in
+ * the send queue for a control message.
+ */
+#define RDMA_WRITE_WINDOW 256
+#define RDMA_WRITE_SIGNAL_INTERVAL 16
+
+/*
+ * Number of chunks the source asks the destination to register in a
+ * single message when pipelining, starting with the one being written.
+ */
+#define RDMA_REG_PREFETCH 32
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -93,12 +111,15 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* The dest answers every registration request of a message, not just one */
+#define RDMA_CAPABILITY_BATCH_REGISTER 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_BATCH_REGISTER;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -312,6 +333,14 @@ typedef struct RDMALocalBlocks {
     RDMALocalBlock *block;
 } RDMALocalBlocks;
 
+/*
+ * A write in the window of pipelined writes.
+ */
+typedef struct RDMAWriteSlot {
+    int      index;            /* ram block */
+    uint64_t chunk;            /* chunk within the block */
+} RDMAWriteSlot;
+
 /*
  * Main data structure for RDMA state.
  * While there is only one copy of this structure being allocated right now,
@@ -347,6 +376,18 @@ typedef struct RDMAContext {
 
     bool pin_all;
 
+    /*
+     * Pipelined writes: the window of outstanding writes is a ring from
+     * window_tail to window_head, nb_sent long.  The last nb_unsignaled
+     * writes did not ask for a completion.
+     */
+    bool pipeline;
+    bool batch_register;
+    RDMAWriteSlot window[RDMA_WRITE_WINDOW];
+    int window_head;
+    int window_tail;
+    int nb_unsignaled;
+
     /*
      * infiniband-specific variables for opening the device
      * and maintaining connection state and so forth.
@@ -1209,6 +1250,48 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
     }
 }
 
+/*
+ * Is a write of this chunk still in the window of pipelined writes?
+ */
+static bool qemu_rdma_window_has_chunk(RDMAContext *rdma, int index,
+                                       uint64_t chunk)
+{
+    int i, slot = rdma->window_tail;
+
+    for (i = 0; i < rdma->nb_sent; i++) {
+        if (rdma->window[slot].index == index &&
+            rdma->window[slot].chunk == chunk) {
+            return true;
+        }
+        slot = (slot + 1) % RDMA_WRITE_WINDOW;
+    }
+
+    return false;
+}
+
+/*
+ * Retire the pipelined writes up to and including the one in @slot.
+ */
+static void qemu_rdma_window_retire(RDMAContext *rdma, int slot)
+{
+    int retired;
+
+    do {
+        RDMAWriteSlot *w = &rdma->window[rdma->window_tail];
+        RDMALocalBlock *block = &(rdma->local_ram_blocks.block[w->index]);
+
+        retired = rdma->window_tail;
+        rdma->window_tail = (rdma->window_tail + 1) % RDMA_WRITE_WINDOW;
+        rdma->nb_sent--;
+
+        if (!qemu_rdma_window_has_chunk(rdma, w->index, w->chunk)) {
+            clear_bit(w->chunk, block->transit_bitmap);
+        }
+    } while (retired != slot);
+
+    rdma->nb_unsignaled = MIN(rdma->nb_unsignaled, rdma->nb_sent);
+}
+
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1250,7 +1333,16 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out)
         rdma->control_ready_expected = 0;
     }
 
-    if (wr_id == RDMA_WRID_RDMA_WRITE) {
+    if (wr_id == RDMA_WRID_RDMA_WRITE && rdma->pipeline) {
+        /* The chunk bits hold the slot in the window */
+        uint64_t slot =
+            (wc.wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+
+        DDDPRINTF("completions %s (%" PRId64 ") left %d, slot %" PRIu64 "\n",
+                  print_wrid(wr_id), wr_id, rdma->nb_sent, slot);
+
+        qemu_rdma_window_retire(rdma, slot);
+    } else if (wr_id == RDMA_WRID_RDMA_WRITE) {
         uint64_t chunk =
             (wc.wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
         uint64_t index =
@@ -1282,6 +1374,17 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out)
     } else {
         DDDPRINTF("other completion %s (%" PRId64 ") received left %d\n",
             print_wrid(wr_id), wr_id, rdma->nb_sent);
+
+        /*
+         * Nothing is posted while a control message is in flight, so the
+         * writes posted before it, signaled or not, are done as well.
+         */
+        if (wr_id == RDMA_WRID_SEND_CONTROL && rdma->pipeline &&
+            rdma->nb_sent) {
+            qemu_rdma_window_retire(rdma, (rdma->window_head +
+                                           RDMA_WRITE_WINDOW - 1) %
+                                          RDMA_WRITE_WINDOW);
+        }
     }
 
     *wr_id_out = wc.wr_id;
@@ -1668,11 +1771,42 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Pick the chunks after @chunk that the destination can register together
+ * with it: those that are not registered yet and not entirely zero, since
+ * zero chunks are sent with RDMA_CONTROL_COMPRESS instead.
+ */
+static int qemu_rdma_prefetch_chunks(RDMALocalBlock *block, uint64_t chunk,
+                                     uint64_t *chunks, int max)
+{
+    uint64_t end = MIN(block->nb_chunks, chunk + 1 + max);
+    int nb = 0;
+
+    for (chunk++; chunk < end; chunk++) {
+        uint8_t *start = ram_chunk_start(block, chunk);
+        size_t len = ram_chunk_end(block, chunk) - start;
+
+        if (!len || block->remote_keys[chunk]) {
+            continue;
+        }
+        if (can_use_buffer_find_nonzero_offset(start, len) &&
+            buffer_find_nonzero_offset(start, len) == len) {
+            continue;
+        }
+        chunks[nb++] = chunk;
+    }
+
+    return nb;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
  * If we're using dynamic registration on the dest-side, we have to
  * send a registration command first.
+ *
+ * When pipelining, the write is only posted: up to RDMA_WRITE_WINDOW
+ * writes can be in flight, even several of the same chunk.
  */
 static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
                                int current_index, uint64_t current_addr,
@@ -1682,10 +1816,12 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
     int reg_result_idx, ret, count = 0;
+    int i, nb_reg;
     uint64_t chunk, chunks;
+    uint64_t prefetch[RDMA_REG_PREFETCH - 1];
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMARegister reg[RDMA_REG_PREFETCH];
     RDMARegisterResult *reg_result;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
@@ -1726,7 +1862,7 @@ retry:
 #endif
     }
 
-    while (test_bit(chunk, block->transit_bitmap)) {
+    while (!rdma->pipeline && test_bit(chunk, block->transit_bitmap)) {
         (void)count;
         DDPRINTF("(%d) Not clobbering: block: %d chunk %" PRIu64
                 " current %" PRIu64 " len %" PRIu64 " %d %d\n",
@@ -1784,22 +1920,42 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register.  If it can answer
+             * several requests at once, also ask for the next chunks of
+             * the block: they are likely to be written soon.
              */
-            reg.current_index = current_index;
+            reg[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                reg[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                reg[0].key.chunk = chunk;
+            }
+            reg[0].chunks = chunks;
+            nb_reg = 1;
+
+            if (rdma->batch_register && block->is_ram_block) {
+                nb_reg += qemu_rdma_prefetch_chunks(block, chunk + chunks,
+                                                    prefetch,
+                                                    RDMA_REG_PREFETCH - 1);
+                for (i = 1; i < nb_reg; i++) {
+                    reg[i].current_index = current_index;
+                    reg[i].key.current_addr = block->offset +
+                        (prefetch[i - 1] << RDMA_REG_CHUNK_SHIFT);
+                    reg[i].chunks = 0;
+                }
             }
-            reg.chunks = chunks;
 
             DDPRINTF("Sending registration request chunk %" PRIu64 " for %d "
-                    "bytes, index: %d, offset: %" PRId64 "...\n",
-                    chunk, sge.length, current_index, current_addr);
+                    "bytes, index: %d, offset: %" PRId64 ", %d more...\n",
+                    chunk, sge.length, current_index, current_addr,
+                    nb_reg - 1);
 
-            register_to_network(&reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            for (i = 0; i < nb_reg; i++) {
+                register_to_network(&reg[i]);
+            }
+            head.len = nb_reg * sizeof(RDMARegister);
+            head.repeat = nb_reg;
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) reg,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
@@ -1817,7 +1973,9 @@ retry:
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            for (i = 0; i < nb_reg; i++) {
+                network_to_result(&reg_result[i]);
+            }
 
             DDPRINTF("Received registration result:"
                     " my key: %x their key %x, chunk %" PRIu64 "\n",
@@ -1825,6 +1983,9 @@ retry:
 
             block->remote_keys[chunk] = reg_result->rkey;
             block->remote_host_addr = reg_result->host_addr;
+            for (i = 1; i < nb_reg; i++) {
+                block->remote_keys[prefetch[i - 1]] = reg_result[i].rkey;
+            }
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block,
@@ -1848,17 +2009,43 @@ retry:
         }
     }
 
-    /*
-     * Encode the ram block index and chunk within this wrid.
-     * We will use this information at the time of completion
-     * to figure out which bitmap to check against and then which
-     * chunk in the bitmap to look for.
-     */
-    send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
-                                        current_index, chunk);
+    if (rdma->pipeline) {
+        /*
+         * Make room in the window.  The write that filled it asked for a
+         * completion, so there is always one to wait for.
+         */
+        while (rdma->nb_sent >= RDMA_WRITE_WINDOW) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE);
+            if (ret < 0) {
+                fprintf(stderr, "rdma migration: failed to make "
+                                "room in the write window! %d\n", ret);
+                return ret;
+            }
+        }
+
+        /*
+         * The slot in the window stands in for the chunk in the wrid;
+         * the window remembers which chunk it is.
+         */
+        send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE, 0,
+                                            rdma->window_head);
+        if (rdma->nb_sent + 1 >= RDMA_WRITE_WINDOW ||
+            rdma->nb_unsignaled + 1 >= RDMA_WRITE_SIGNAL_INTERVAL) {
+            send_wr.send_flags = IBV_SEND_SIGNALED;
+        }
+    } else {
+        /*
+         * Encode the ram block index and chunk within this wrid.
+         * We will use this information at the time of completion
+         * to figure out which bitmap to check against and then which
+         * chunk in the bitmap to look for.
+         */
+        send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                            current_index, chunk);
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+    }
 
     send_wr.opcode = IBV_WR_RDMA_WRITE;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
     send_wr.sg_list = &sge;
     send_wr.num_sge = 1;
     send_wr.wr.rdma.remote_addr = block->remote_host_addr +
@@ -1891,6 +2078,17 @@ retry:
         return -ret;
     }
 
+    if (rdma->pipeline) {
+        rdma->window[rdma->window_head].index = current_index;
+        rdma->window[rdma->window_head].chunk = chunk;
+        rdma->window_head = (rdma->window_head + 1) % RDMA_WRITE_WINDOW;
+        if (send_wr.send_flags & IBV_SEND_SIGNALED) {
+            rdma->nb_unsignaled = 0;
+        } else {
+            rdma->nb_unsignaled++;
+        }
+    }
+
     set_bit(chunk, block->transit_bitmap);
     acct_update_position(f, sge.length, false);
     rdma->total_writes++;
@@ -2102,7 +2300,8 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
 }
 
 
-static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
+static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all,
+                                 bool pipeline)
 {
     int ret, idx;
     Error *local_err = NULL, **temp = &local_err;
@@ -2112,6 +2311,8 @@ static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
      * after the connect() completes.
      */
     rdma->pin_all = pin_all;
+    rdma->pipeline = pipeline;
+    rdma->batch_register = pipeline;
 
     ret = qemu_rdma_resolve_host(rdma, temp);
     if (ret) {
@@ -2177,6 +2378,10 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         DPRINTF("Server pin-all memory requested.\n");
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    if (rdma->batch_register) {
+        DPRINTF("Server batched registration requested.\n");
+        cap.flags |= RDMA_CAPABILITY_BATCH_REGISTER;
+    }
 
     caps_to_network(&cap);
 
@@ -2221,6 +2426,12 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         rdma->pin_all = false;
     }
 
+    /* Older destinations only answer the first of several requests */
+    if (rdma->batch_register && !(cap.flags & RDMA_CAPABILITY_BATCH_REGISTER)) {
+        DPRINTF("Server cannot batch registrations.\n");
+        rdma->batch_register = false;
+    }
+
     DPRINTF("Pin all memory: %s\n", rdma->pin_all ? "enabled" : "disabled");
 
     rdma_ack_cm_event(cm_event);
@@ -2233,6 +2444,8 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
+    rdma->nb_unsignaled = 0;
+    rdma->window_head = rdma->window_tail = 0;
     return 0;
 
 err_rdma_source_connect:
@@ -2456,6 +2669,10 @@ static int qemu_rdma_get_buffer(void *opaque, uint8_t *buf,
 
 /*
  * Block until all the outstanding chunks have been delivered by the hardware.
+ *
+ * When pipelining, the last writes may not ask for a completion.  They are
+ * retired by the completion of the next control message, which the caller
+ * always sends and which the destination only sees after them.
  */
 static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
 {
@@ -2465,7 +2682,7 @@ static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
         return -EIO;
     }
 
-    while (rdma->nb_sent) {
+    while (rdma->nb_sent > rdma->nb_unsignaled) {
         ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE);
         if (ret < 0) {
             fprintf(stderr, "rdma migration: complete polling error!\n");
@@ -2877,6 +3094,7 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque,
             DDPRINTF("There are %d registration requests\n", head.repeat);
 
             reg_resp.repeat = head.repeat;
+            reg_resp.len = head.repeat * sizeof(RDMARegisterResult);
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
@@ -3238,7 +3456,8 @@ void rdma_start_outgoing_migration(void *opaque,
     }
 
     ret = qemu_rdma_source_init(rdma, &local_err,
-        s->enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_PIN_ALL]);
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_PIN_ALL],
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_PIPELINE]);
 
     if (ret) {
         goto err;
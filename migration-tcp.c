@@ -61,7 +61,6 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
@@ -76,11 +75,14 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    /* The source connects again if it sends RAM over several channels */
+    migrate_incoming_set_listener(s);
     process_incoming_migration(f);
     return;
 
 out:
     closesocket(c);
+    closesocket(s);
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
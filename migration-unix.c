@@ -40,6 +40,9 @@ static void unix_wait_for_connect(int fd, void *opaque)
     } else {
         DPRINTF("migrate connect success\n");
         s->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_splice()) {
+            qemu_file_enable_splice(s->file);
+        }
         migrate_fd_connect(s);
     }
 }
@@ -61,7 +64,6 @@ static void unix_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && errno == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
 
     DPRINTF("accepted migration\n");
 
@@ -76,11 +78,14 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    /* The source connects again if it sends RAM over several channels */
+    migrate_incoming_set_listener(s);
     process_incoming_migration(f);
     return;
 
 out:
     close(c);
+    close(s);
 }
 
 void unix_start_incoming_migration(const char *path, Error **errp)
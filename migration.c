@@ -41,6 +41,7 @@ enum {
     MIG_STATE_SETUP,
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
+    MIG_STATE_POSTCOPY_ACTIVE,
     MIG_STATE_COMPLETED,
 };
 
@@ -54,6 +55,30 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default page compression parameters */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Connections carrying RAM pages */
+#define DEFAULT_MIGRATE_CHANNELS 1
+#define MAX_MIGRATE_CHANNELS 16
+
+/* Time within which auto-converge tries to send the remaining RAM */
+#define DEFAULT_MIGRATE_CONVERGENCE_TIME 10 /* s */
+
+/* Reads in flight per device during the bulk phase of block migration */
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT 16
+#define MAX_MIGRATE_BLOCK_INFLIGHT 256
+
+/* Send buffer of the outgoing streams, 0 for the default of the transport */
+#define MIN_MIGRATE_BUFFER_SIZE 32    /* KiB */
+#define MAX_MIGRATE_BUFFER_SIZE 16384 /* KiB */
+
+/* How long the destination waits for the source to connect a RAM channel */
+#define CHANNEL_ACCEPT_TIMEOUT 10000 /* ms */
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -68,6 +93,17 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .parameters[MIGRATION_PARAMETER_CHANNELS] = DEFAULT_MIGRATE_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_CONVERGENCE_TIME] =
+                DEFAULT_MIGRATE_CONVERGENCE_TIME,
+        .parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT] =
+                DEFAULT_MIGRATE_BLOCK_INFLIGHT,
     };
 
     return &current_migration;
@@ -96,12 +132,86 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     }
 }
 
+/* Listening socket of an incoming tcp or unix migration.  It is kept open
+ * until the migration is loaded, so that the source can connect extra RAM
+ * channels. */
+static int incoming_listen_fd = -1;
+
+void migrate_incoming_set_listener(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+typedef struct ChannelAccept {
+    int fd;
+    bool done;
+} ChannelAccept;
+
+static void migrate_incoming_channel_ready(void *opaque)
+{
+    ChannelAccept *acc = opaque;
+
+    do {
+        acc->fd = qemu_accept(incoming_listen_fd, NULL, NULL);
+    } while (acc->fd == -1 && socket_error() == EINTR);
+    acc->done = true;
+}
+
+static void migrate_incoming_channel_timeout(void *opaque)
+{
+    ChannelAccept *acc = opaque;
+
+    acc->done = true;
+}
+
+/* The connection is accepted from an fd handler, so the main loop keeps
+ * running while the source connects */
+int migrate_incoming_accept_channel(void)
+{
+    ChannelAccept acc = { .fd = -1 };
+    QEMUTimer *timer;
+
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    timer = qemu_new_timer_ms(rt_clock, migrate_incoming_channel_timeout,
+                              &acc);
+    qemu_mod_timer(timer, qemu_get_clock_ms(rt_clock) +
+                   CHANNEL_ACCEPT_TIMEOUT);
+    qemu_set_fd_handler(incoming_listen_fd, migrate_incoming_channel_ready,
+                        NULL, &acc);
+    while (!acc.done) {
+        main_loop_wait(false);
+    }
+    qemu_set_fd_handler(incoming_listen_fd, NULL, NULL, NULL);
+    qemu_del_timer(timer);
+    qemu_free_timer(timer);
+
+    if (acc.fd != -1) {
+        qemu_set_block(acc.fd);
+    }
+    return acc.fd;
+}
+
+static void migrate_incoming_close_listener(void)
+{
+    if (incoming_listen_fd != -1) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+}
+
 static void coroutine_fn process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
     int ret;
 
+    migrate_decompress_threads_create();
     ret = qemu_loadvm_state(f);
+    migrate_ram_channels_join();
+    migrate_decompress_threads_join();
+    migrate_incoming_close_listener();
     qemu_fclose(f);
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
@@ -166,6 +276,26 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->channels = s->parameters[MIGRATION_PARAMETER_CHANNELS];
+    params->convergence_time =
+            s->parameters[MIGRATION_PARAMETER_CONVERGENCE_TIME];
+    params->block_inflight = s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT];
+    params->buffer_size = s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -174,11 +304,38 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_conflict = xbzrle_mig_pages_cache_conflict();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_stream_stats(MigrationInfo *info, MigrationState *s)
+{
+    uint64_t syscalls, bytes, spliced_bytes;
+
+    qemu_file_stats_get(&s->stream_stats, &syscalls, &bytes, &spliced_bytes);
+
+    info->has_stream = true;
+    info->stream = g_malloc0(sizeof(*info->stream));
+    info->stream->syscalls = syscalls;
+    info->stream->bytes = bytes;
+    info->stream->bytes_per_syscall = syscalls ? bytes / syscalls : 0;
+    info->stream->spliced_bytes = spliced_bytes;
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->raw_bytes = compress_mig_raw_bytes_transferred();
+        info->compression->compressed_bytes = compress_mig_bytes_transferred();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -194,8 +351,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIG_STATE_ACTIVE:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_ACTIVE ?
+                                "active" : "postcopy-active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -216,6 +375,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
 
+        info->has_throttle_percentage = true;
+        info->throttle_percentage = ram_throttle_percentage();
+        info->has_dirty_rates = true;
+        info->dirty_rates = ram_dirty_rates();
+
         if (blk_mig_active()) {
             info->has_disk = true;
             info->disk = g_malloc0(sizeof(*info->disk));
@@ -225,9 +389,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_stream_stats(info, s);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_stream_stats(info, s);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -268,7 +436,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -296,8 +465,10 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    s->extra_channels = false;
 
-    assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_ACTIVE &&
+           s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -360,18 +531,23 @@ static MigrationState *migrate_init(const MigrationParams *params)
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
+    g_free(s->uri);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
+    qemu_file_stats_init(&s->stream_stats);
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
@@ -403,7 +579,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -417,7 +594,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if ((s->parameters[MIGRATION_PARAMETER_CHANNELS] > 1 ||
+         migrate_postcopy()) &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a tcp or unix address when using several channels "
+                  "or post-copy");
+        return;
+    }
+
     s = migrate_init(&params);
+    s->uri = g_strdup(uri);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -450,6 +637,23 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy()) {
+        error_setg(errp, "Enable the postcopy migration capability before "
+                   "starting the migration");
+        return;
+    }
+    if (s->state != MIG_STATE_SETUP && s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "No migration in progress can switch to post-copy");
+        return;
+    }
+
+    s->start_postcopy = true;
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -469,6 +673,93 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_channels,
+                                int64_t channels,
+                                bool has_convergence_time,
+                                int64_t convergence_time,
+                                bool has_block_inflight,
+                                int64_t block_inflight,
+                                bool has_buffer_size,
+                                int64_t buffer_size, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a value between 0 and 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+    if (has_channels &&
+        (channels < 1 || channels > MAX_MIGRATE_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "a value between 1 and 16");
+        return;
+    }
+    if (has_convergence_time && (convergence_time < 1 ||
+                                 convergence_time > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "convergence-time",
+                  "a positive number of seconds");
+        return;
+    }
+    if (has_block_inflight &&
+        (block_inflight < 1 || block_inflight > MAX_MIGRATE_BLOCK_INFLIGHT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "block-inflight",
+                  "a value between 1 and 256");
+        return;
+    }
+    if (has_buffer_size && buffer_size != 0 &&
+        (buffer_size < MIN_MIGRATE_BUFFER_SIZE ||
+         buffer_size > MAX_MIGRATE_BUFFER_SIZE)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "buffer-size",
+                  "0 or a value between 32 and 16384");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                decompress_threads;
+    }
+    if (has_channels) {
+        s->parameters[MIGRATION_PARAMETER_CHANNELS] = channels;
+    }
+    if (has_convergence_time) {
+        s->parameters[MIGRATION_PARAMETER_CONVERGENCE_TIME] =
+                convergence_time;
+    }
+    if (has_block_inflight) {
+        s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT] = block_inflight;
+    }
+    if (has_buffer_size) {
+        s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE] = buffer_size;
+    }
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -521,6 +812,24 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+bool migrate_use_splice(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_SPLICE];
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -539,6 +848,104 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+/* savevm and other streams that are not a migration use a single channel */
+int migrate_ram_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    if (!s->extra_channels) {
+        return 1;
+    }
+    return s->parameters[MIGRATION_PARAMETER_CHANNELS];
+}
+
+int migrate_convergence_time(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CONVERGENCE_TIME];
+}
+
+int migrate_block_inflight(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_BLOCK_INFLIGHT];
+}
+
+/* In bytes, 0 for the default of the transport */
+size_t migrate_buffer_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return (size_t)s->parameters[MIGRATION_PARAMETER_BUFFER_SIZE] << 10;
+}
+
+/* Opens one more connection to the destination of an outgoing migration */
+int migrate_open_channel(MigrationState *s, Error **errp)
+{
+    const char *p;
+
+    if (!s->extra_channels) {
+        error_setg(errp, "no outgoing migration to open a channel for");
+        return -1;
+    }
+    if (strstart(s->uri, "tcp:", &p)) {
+        return inet_connect(p, errp);
+    }
+#if !defined(WIN32)
+    if (strstart(s->uri, "unix:", &p)) {
+        return unix_connect(p, errp);
+    }
+#endif
+    error_setg(errp, "migration protocol of %s has no extra channels", s->uri);
+    return -1;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -550,6 +957,7 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool postcopy = false;
 
     DPRINTF("beginning savevm\n");
     qemu_savevm_state_begin(s->file, &s->params);
@@ -563,6 +971,43 @@ static void *migration_thread(void *opaque)
         int64_t current_time;
         uint64_t pending_size;
 
+        if (s->start_postcopy) {
+            int ret;
+
+            DPRINTF("switching to post-copy\n");
+            qemu_mutex_lock_iothread();
+            start_time = qemu_get_clock_ms(rt_clock);
+            qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+            old_vm_running = runstate_is_running();
+
+            ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            if (ret >= 0) {
+                qemu_file_set_rate_limit(s->file, INT_MAX);
+                ret = qemu_savevm_state_postcopy(s->file);
+            }
+            qemu_mutex_unlock_iothread();
+
+            if (ret < 0 || qemu_file_get_error(s->file)) {
+                migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+                ram_postcopy_wait();
+                break;
+            }
+
+            /* The guest runs on the destination from now on */
+            postcopy = true;
+            s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+
+            if (ram_postcopy_wait() < 0) {
+                migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                  MIG_STATE_ERROR);
+            } else {
+                migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                  MIG_STATE_COMPLETED);
+            }
+            break;
+        }
+
         if (!qemu_file_rate_limit(s->file)) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
@@ -590,6 +1035,9 @@ static void *migration_thread(void *opaque)
                     break;
                 }
 
+                /* The guest may run again once the migration completed,
+                 * so spliced pages must have left the pipe by then */
+                qemu_file_splice_wait(s->file);
                 if (!qemu_file_get_error(s->file)) {
                     migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_COMPLETED);
                     break;
@@ -634,7 +1082,12 @@ static void *migration_thread(void *opaque)
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_get_clock_ms(rt_clock);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!postcopy) {
+            s->downtime = end_time - start_time;
+        }
+        runstate_set(RUN_STATE_POSTMIGRATE);
+    } else if (postcopy) {
+        /* The destination may have run the guest already */
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
         if (old_vm_running) {
@@ -651,6 +1104,7 @@ void migrate_fd_connect(MigrationState *s)
 {
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
+    s->extra_channels = true;
 
     /* This is a best 1st approximation. ns to ms */
     s->expected_downtime = max_downtime/1000000;
@@ -658,6 +1112,8 @@ void migrate_fd_connect(MigrationState *s)
 
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
+    qemu_file_set_stats(s->file, &s->stream_stats);
+    qemu_file_set_buffer_size(s->file, migrate_buffer_size());
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
@@ -40,6 +40,7 @@
 #include "monitor/readline.h"
 #include "ui/console.h"
 #include "sysemu/blockdev.h"
+#include "block/coroutine.h"
 #include "audio/audio.h"
 #include "disas/disas.h"
 #include "sysemu/balloon.h"
@@ -941,6 +942,11 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_coroutines(Monitor *mon, const QDict *qdict)
+{
+    qemu_coroutine_dump_info((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2585,6 +2591,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "coroutines",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show coroutine allocator statistics",
+        .mhandler.cmd = do_info_coroutines,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2715,6 +2728,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration capabilities",
         .mhandler.cmd = hmp_info_migrate_capabilities,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
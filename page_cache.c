@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,17 +33,23 @@
     do { } while (0)
 #endif
 
+/* Pages are cached in sets of up to CACHE_WAYS entries.  A page can only be
+ * cached in the set its address maps to; when the set is full, the entry
+ * that was used least recently is replaced. */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
-    uint8_t *it_data;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *page_data;         /* page_size bytes for each item */
     unsigned int page_size;
+    unsigned int num_ways;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
@@ -60,25 +66,33 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
-
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
+
+    cache = g_malloc(sizeof(*cache));
     cache->page_size = page_size;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
+    /* Allocated once, so that caching a page never calls malloc */
+    cache->page_data = g_try_malloc(cache->max_num_items * page_size);
+    if (!cache->page_data) {
+        DPRINTF("Failed to allocate cache\n");
+        g_free(cache);
+        return NULL;
+    }
+
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
@@ -88,87 +102,122 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
     g_free(cache->page_cache);
+    g_free(cache->page_data);
     cache->page_cache = NULL;
+    cache->page_data = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    size_t num_sets = cache->max_num_items / cache->num_ways;
+    size_t set;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    set = (addr / cache->page_size) & (num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static uint8_t *cache_item_data(const PageCache *cache, const CacheItem *it)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
-
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    return cache->page_data + (it - cache->page_cache) * cache->page_size;
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    it = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (it[i].it_addr == addr) {
+            return &it[i];
+        }
+    }
+    return NULL;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+    it->it_age = ++cache->max_item_age;
+    return cache_item_data(cache, it);
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+/* Finds the item to store addr in: the one already holding it, else a
+ * free one, else the least recently used one in its set */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr)
 {
+    CacheItem *it, *victim;
+    unsigned int i;
+
+    it = cache_get_set(cache, addr);
+    victim = &it[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (it[i].it_addr == addr) {
+            return &it[i];
+        }
+        if (victim->it_addr != -1 &&
+            (it[i].it_addr == -1 || it[i].it_age < victim->it_age)) {
+            victim = &it[i];
+        }
+    }
+    return victim;
+}
 
-    CacheItem *it = NULL;
+bool cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+{
+    CacheItem *it;
+    bool evicted;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    /* free old cached data if any */
-    g_free(it->it_data);
+    it = cache_get_victim(cache, addr);
 
-    if (!it->it_data) {
+    evicted = it->it_addr != -1 && it->it_addr != addr;
+    if (it->it_addr == -1) {
         cache->num_items++;
     }
 
-    it->it_data = g_memdup(pdata, cache->page_size);
+    memcpy(cache_item_data(cache, it), pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
+
+    return evicted;
+}
+
+static int cache_item_age_cmp(const void *a, const void *b)
+{
+    const CacheItem *it_a = *(CacheItem * const *)a;
+    const CacheItem *it_b = *(CacheItem * const *)b;
+
+    return it_a->it_age < it_b->it_age ? -1 : it_a->it_age > it_b->it_age;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
+    CacheItem **items;
+    CacheItem *new_it;
+    int64_t i, n;
 
     g_assert(cache);
 
@@ -188,29 +237,32 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+    /* Move the pages from the oldest to the most recently used one, so
+     * that the most recently used pages are kept if a set overflows */
+    items = g_new(CacheItem *, cache->num_items);
+    for (i = 0, n = 0; i < cache->max_num_items; i++) {
+        if (cache->page_cache[i].it_addr != -1) {
+            items[n++] = &cache->page_cache[i];
         }
     }
+    qsort(items, n, sizeof(*items), cache_item_age_cmp);
 
-    g_free(cache->page_cache);
+    for (i = 0; i < n; i++) {
+        new_it = cache_get_victim(new_cache, items[i]->it_addr);
+        if (new_it->it_addr == -1) {
+            new_cache->num_items++;
+        }
+        memcpy(cache_item_data(new_cache, new_it),
+               cache_item_data(cache, items[i]), cache->page_size);
+        new_it->it_addr = items[i]->it_addr;
+        new_it->it_age = items[i]->it_age;
+    }
+    g_free(items);
+
+    cache_fini(cache);
     cache->page_cache = new_cache->page_cache;
+    cache->page_data = new_cache->page_data;
+    cache->num_ways = new_cache->num_ways;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
 
@@ -15,31 +15,235 @@
 #include "trace.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/tls.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Bounds of the adaptive per-thread pool size; each pooled coroutine
+     * keeps its stack, so the upper bound also bounds the memory held.
+     */
+    POOL_MIN_SIZE = 64,
+    POOL_MAX_SIZE = 16384,
+
+    /* Number of allocations between two updates of the pool size */
+    POOL_ADAPT_INTERVAL = 1024,
 };
 
-/** Free list to speed up creation */
-static QemuMutex pool_lock;
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+/* Free coroutines are cached per thread, so that creating and destroying
+ * coroutines normally touches no shared state.  When a thread's cache is
+ * full, coroutines spill to the global release pool, a lock-free stack; a
+ * thread whose cache is empty takes the whole release pool at once.
+ *
+ * The cache size follows the peak number of coroutines created from it and
+ * alive at once during the last POOL_ADAPT_INTERVAL allocations, so it grows
+ * with I/O bursts and shrinks back once they are over.
+ *
+ * qemu/tls.h only provides real thread-local storage on Linux.  Elsewhere,
+ * iothreads create coroutines without the global mutex, so all threads
+ * share a single cache protected by shared_pool_lock.
+ */
+#ifdef __linux__
+#define COROUTINE_POOL_PER_THREAD 1
+#else
+#define COROUTINE_POOL_PER_THREAD 0
+#endif
+
+struct CoroutinePool {
+    QSLIST_HEAD(, Coroutine) free;
+    unsigned int size;
+    unsigned int max_size;
+
+    /* Coroutines created from this pool and not freed yet, by any thread */
+    int in_use;
+    int peak;
+    unsigned int allocs;
+
+    CoroutinePoolStats stats;
+    Notifier exit_notifier;
+    /* The thread owning the pool exited.  Coroutines created from it may
+     * still be alive and point to it, so pools are never freed; the next
+     * new thread reuses it.
+     */
+    bool retired;
+    QLIST_ENTRY(CoroutinePool) next;
+};
+
+static DEFINE_TLS(CoroutinePool *, thread_pool);
+static CoroutinePool *shared_pool;
+static QemuMutex shared_pool_lock;
+
+static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+static int release_pool_size;
+
+/* All pools, for statistics and reuse */
+static QemuMutex pools_lock;
+static QLIST_HEAD(, CoroutinePool) pools = QLIST_HEAD_INITIALIZER(pools);
+
+static void coroutine_pool_stats_add(CoroutinePoolStats *dst,
+                                     const CoroutinePoolStats *src)
+{
+    dst->hits += src->hits;
+    dst->release_hits += src->release_hits;
+    dst->misses += src->misses;
+    dst->spills += src->spills;
+    dst->frees += src->frees;
+}
+
+static void coroutine_release(CoroutinePool *p, Coroutine *co)
+{
+    if (atomic_read(&release_pool_size) < (int)p->max_size) {
+        QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+        atomic_inc(&release_pool_size);
+        p->stats.spills++;
+    } else {
+        qemu_coroutine_delete(co);
+        p->stats.frees++;
+    }
+}
+
+static void coroutine_pool_thread_exit(Notifier *n, void *unused)
+{
+    CoroutinePool *p = container_of(n, CoroutinePool, exit_notifier);
+    Coroutine *co;
+
+    while ((co = QSLIST_FIRST(&p->free)) != NULL) {
+        QSLIST_REMOVE_HEAD(&p->free, pool_next);
+        coroutine_release(p, co);
+    }
+    p->size = 0;
+
+    qemu_mutex_lock(&pools_lock);
+    p->retired = true;
+    qemu_mutex_unlock(&pools_lock);
+
+    tls_var(thread_pool) = NULL;
+}
+
+static CoroutinePool *coroutine_pool_new(void)
+{
+    CoroutinePool *p;
+
+    qemu_mutex_lock(&pools_lock);
+    QLIST_FOREACH(p, &pools, next) {
+        if (p->retired) {
+            p->retired = false;
+            break;
+        }
+    }
+    if (!p) {
+        p = g_new0(CoroutinePool, 1);
+        p->max_size = POOL_MIN_SIZE;
+        p->exit_notifier.notify = coroutine_pool_thread_exit;
+        QLIST_INSERT_HEAD(&pools, p, next);
+    }
+    qemu_mutex_unlock(&pools_lock);
+    return p;
+}
+
+/* Return the calling thread's pool, locked if it is shared.  */
+static CoroutinePool *coroutine_pool_lock(void)
+{
+    CoroutinePool *p;
+
+    if (!COROUTINE_POOL_PER_THREAD) {
+        qemu_mutex_lock(&shared_pool_lock);
+        return shared_pool;
+    }
+
+    p = tls_var(thread_pool);
+    if (!p) {
+        p = coroutine_pool_new();
+        qemu_thread_atexit_add(&p->exit_notifier);
+        tls_var(thread_pool) = p;
+    }
+    return p;
+}
+
+static void coroutine_pool_unlock(void)
+{
+    if (!COROUTINE_POOL_PER_THREAD) {
+        qemu_mutex_unlock(&shared_pool_lock);
+    }
+}
+
+static void coroutine_pool_adapt(CoroutinePool *p)
+{
+    Coroutine *co;
+
+    p->max_size = MIN(MAX(p->peak, POOL_MIN_SIZE), POOL_MAX_SIZE);
+    p->peak = atomic_read(&p->in_use);
+
+    while (p->size > p->max_size && !QSLIST_EMPTY(&p->free)) {
+        co = QSLIST_FIRST(&p->free);
+        QSLIST_REMOVE_HEAD(&p->free, pool_next);
+        p->size--;
+        coroutine_release(p, co);
+    }
+}
+
+void qemu_coroutine_pool_get_stats(CoroutinePoolStats *stats)
+{
+    CoroutinePool *p;
+
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_lock(&pools_lock);
+    QLIST_FOREACH(p, &pools, next) {
+        coroutine_pool_stats_add(stats, &p->stats);
+        stats->pooled += p->size;
+    }
+    qemu_mutex_unlock(&pools_lock);
+    stats->pooled += MAX(atomic_read(&release_pool_size), 0);
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        co = QSLIST_FIRST(&pool);
+        CoroutinePool *p = coroutine_pool_lock();
+        int in_use = atomic_fetch_inc(&p->in_use) + 1;
+
+        if (in_use > p->peak) {
+            p->peak = in_use;
+        }
+        if (++p->allocs % POOL_ADAPT_INTERVAL == 0) {
+            coroutine_pool_adapt(p);
+        }
+
+        co = QSLIST_FIRST(&p->free);
+        if (co) {
+            p->stats.hits++;
+        } else if (atomic_read(&release_pool_size) > 0) {
+            /* Take the whole release pool.  Pushes update the count after
+             * the list, so count what was actually taken instead of trusting
+             * it; the global count may briefly drop below the true size.
+             */
+            QSLIST_MOVE_ATOMIC(&p->free, &release_pool);
+            p->size = 0;
+            QSLIST_FOREACH(co, &p->free, pool_next) {
+                p->size++;
+            }
+            atomic_sub(&release_pool_size, p->size);
+            co = QSLIST_FIRST(&p->free);
+            if (co) {
+                p->stats.release_hits++;
+            }
+        }
         if (co) {
-            QSLIST_REMOVE_HEAD(&pool, pool_next);
-            pool_size--;
+            QSLIST_REMOVE_HEAD(&p->free, pool_next);
+            p->size--;
+        } else {
+            p->stats.misses++;
         }
-        qemu_mutex_unlock(&pool_lock);
+        coroutine_pool_unlock();
+
+        if (!co) {
+            co = qemu_coroutine_new();
+        }
+        co->pool = p;
     }
 
     if (!co) {
@@ -54,15 +258,21 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 static void coroutine_delete(Coroutine *co)
 {
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        if (pool_size < POOL_MAX_SIZE) {
-            QSLIST_INSERT_HEAD(&pool, co, pool_next);
-            co->caller = NULL;
-            pool_size++;
-            qemu_mutex_unlock(&pool_lock);
-            return;
+        CoroutinePool *p;
+
+        /* the coroutine may have been created by another thread */
+        atomic_dec(&co->pool->in_use);
+
+        p = coroutine_pool_lock();
+        co->caller = NULL;
+        if (p->size < p->max_size) {
+            QSLIST_INSERT_HEAD(&p->free, co, pool_next);
+            p->size++;
+        } else {
+            coroutine_release(p, co);
         }
-        qemu_mutex_unlock(&pool_lock);
+        coroutine_pool_unlock();
+        return;
     }
 
     qemu_coroutine_delete(co);
@@ -70,20 +280,30 @@ static void coroutine_delete(Coroutine *co)
 
 static void __attribute__((constructor)) coroutine_pool_init(void)
 {
-    qemu_mutex_init(&pool_lock);
+    qemu_mutex_init(&pools_lock);
+    if (!COROUTINE_POOL_PER_THREAD) {
+        qemu_mutex_init(&shared_pool_lock);
+        shared_pool = coroutine_pool_new();
+    }
 }
 
-static void __attribute__((destructor)) coroutine_pool_cleanup(void)
+void qemu_coroutine_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    Coroutine *co;
-    Coroutine *tmp;
+    CoroutinePoolStats stats;
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        qemu_coroutine_delete(co);
+    if (CONFIG_COROUTINE_POOL) {
+        qemu_coroutine_pool_get_stats(&stats);
+        cpu_fprintf(f, "Coroutine pool: %" PRIu64 " pooled\n", stats.pooled);
+        cpu_fprintf(f, "  hits          %" PRIu64 "\n", stats.hits);
+        cpu_fprintf(f, "  release hits  %" PRIu64 "\n", stats.release_hits);
+        cpu_fprintf(f, "  misses        %" PRIu64 "\n", stats.misses);
+        cpu_fprintf(f, "  spills        %" PRIu64 "\n", stats.spills);
+        cpu_fprintf(f, "  frees         %" PRIu64 "\n", stats.frees);
+    } else {
+        cpu_fprintf(f, "Coroutine pool disabled\n");
     }
 
-    qemu_mutex_destroy(&pool_lock);
+    qemu_coroutine_backend_dump_info(f, cpu_fprintf);
 }
 
 static void coroutine_swap(Coroutine *from, Coroutine *to)
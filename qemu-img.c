@@ -102,6 +102,8 @@ static void help(void)
            "  '-q' use Quiet mode - do not print any output (except errors)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the conversion (default 8)\n"
+           "  '-W' allow out of order writes to the target during conversion\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -111,11 +113,12 @@ static void help(void)
            "       hiding corruption that has already occurred.\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
-           "  'snapshot' is the name of the snapshot to create, apply or delete\n"
+           "  'snapshot' is the name of the snapshot to create, apply, delete or flatten\n"
            "  '-a' applies a snapshot (revert disk to saved state)\n"
            "  '-c' creates a snapshot\n"
            "  '-d' deletes a snapshot\n"
            "  '-l' lists all snapshots in the given image\n"
+           "  '-m' flattens an incremental VM snapshot into a full one\n"
            "\n"
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
@@ -1114,25 +1117,401 @@ out3:
     return ret;
 }
 
+enum {
+    /* Maximum number of copy coroutines of img_convert */
+    MAX_COROUTINES = 16,
+
+    /* Number of block status extents that can be queried ahead */
+    CONVERT_STATUS_AHEAD = 64,
+};
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+    bool wr_in_order;
+    bool compressed;
+    int cluster_sectors;
+    int num_coroutines;
+    int ret;
+
+    /* Extents whose block status is known, in order, filled by
+     * convert_co_status() ahead of the copy coroutines */
+    ImgConvertExtent status[CONVERT_STATUS_AHEAD];
+    int status_head;
+    int status_len;
+    bool status_done;
+    CoQueue status_produced;
+    CoQueue status_consumed;
+
+    int running_coroutines;
+    Coroutine *wait_co;
+    int64_t wr_offs;
+    CoQueue wr_queue;
+} ImgConvertState;
+
+/* Returns the index of the source image containing sector_num */
+static int convert_find_src(ImgConvertState *s, int64_t sector_num,
+                            int64_t *src_sector)
+{
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (sector_num < s->src_sectors[i]) {
+            break;
+        }
+        sector_num -= s->src_sectors[i];
+    }
+    assert(i < s->src_num);
+    *src_sector = sector_num;
+    return i;
+}
+
+static int coroutine_fn convert_block_status(ImgConvertState *s,
+                                             int64_t sector_num,
+                                             ImgConvertExtent *extent)
+{
+    int64_t src_sector;
+    int src_cur, n, ret;
+
+    src_cur = convert_find_src(s, sector_num, &src_sector);
+    n = MIN(s->src_sectors[src_cur] - src_sector, INT_MAX);
+
+    extent->sector_num = sector_num;
+    extent->status = BLK_DATA;
+
+    if (s->has_zero_init && s->target_has_backing) {
+        /* Sectors unallocated in the input image are assumed to be present
+         * in both the output's and the input's base images */
+        ret = bdrv_co_is_allocated(s->src[src_cur], src_sector, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!ret) {
+            extent->status = BLK_BACKING_FILE;
+        }
+    } else if (s->has_zero_init) {
+        /* Unallocated in the whole chain reads as zeros */
+        ret = bdrv_co_is_allocated_above(s->src[src_cur], NULL, src_sector, n,
+                                         &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!ret) {
+            extent->status = BLK_ZERO;
+        }
+    }
+
+    if (s->compressed) {
+        /* Compressed writes cover whole clusters, so keep extents cluster
+         * aligned.  Partial clusters are copied as data; reads may then
+         * span two source images. */
+        int64_t end = sector_num + n;
+
+        if (extent->status == BLK_DATA) {
+            end = QEMU_ALIGN_UP(end, s->cluster_sectors);
+        } else if (n >= s->cluster_sectors) {
+            end = QEMU_ALIGN_DOWN(end, s->cluster_sectors);
+        } else {
+            extent->status = BLK_DATA;
+            end = sector_num + s->cluster_sectors;
+        }
+        n = MIN(end, s->total_sectors) - sector_num;
+    }
+
+    extent->nb_sectors = n;
+    return 0;
+}
+
+static void convert_co_finish(ImgConvertState *s)
+{
+    s->running_coroutines--;
+    if (s->running_coroutines == 0 && s->wait_co) {
+        qemu_coroutine_enter(s->wait_co, NULL);
+    }
+}
+
+/* Stop all coroutines after an error */
+static void coroutine_fn convert_set_error(ImgConvertState *s, int ret)
+{
+    if (s->ret != -EINPROGRESS) {
+        return;
+    }
+    s->ret = ret;
+
+    qemu_co_queue_restart_all(&s->status_produced);
+    qemu_co_queue_restart_all(&s->status_consumed);
+    qemu_co_queue_restart_all(&s->wr_queue);
+}
+
+static void coroutine_fn convert_co_status(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertExtent *extent;
+    int64_t sector_num = 0;
+    int ret;
+
+    while (sector_num < s->total_sectors && s->ret == -EINPROGRESS) {
+        if (s->status_len == CONVERT_STATUS_AHEAD) {
+            qemu_co_queue_wait(&s->status_consumed);
+            continue;
+        }
+
+        extent = &s->status[(s->status_head + s->status_len) %
+                            CONVERT_STATUS_AHEAD];
+        ret = convert_block_status(s, sector_num, extent);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            convert_set_error(s, ret);
+            break;
+        }
+
+        sector_num += extent->nb_sectors;
+        s->status_len++;
+        qemu_co_queue_next(&s->status_produced);
+    }
+
+    s->status_done = true;
+    qemu_co_queue_restart_all(&s->status_produced);
+    convert_co_finish(s);
+}
+
+/* Takes the next chunk to copy, or returns false when there is none */
+static bool coroutine_fn convert_next_chunk(ImgConvertState *s,
+                                            int64_t *sector_num, int *n,
+                                            ImgConvertBlockStatus *status)
+{
+    ImgConvertExtent *extent;
+
+    while (s->status_len == 0) {
+        if (s->status_done || s->ret != -EINPROGRESS) {
+            return false;
+        }
+        qemu_co_queue_wait(&s->status_produced);
+    }
+    if (s->ret != -EINPROGRESS) {
+        return false;
+    }
+
+    extent = &s->status[s->status_head];
+    *sector_num = extent->sector_num;
+    *n = MIN(extent->nb_sectors, s->buf_sectors);
+    *status = extent->status;
+
+    extent->sector_num += *n;
+    extent->nb_sectors -= *n;
+    if (extent->nb_sectors == 0) {
+        s->status_head = (s->status_head + 1) % CONVERT_STATUS_AHEAD;
+        s->status_len--;
+        qemu_co_queue_next(&s->status_consumed);
+    }
+    if (s->status_len > 0) {
+        qemu_co_queue_next(&s->status_produced);
+    }
+    return true;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int n, uint8_t *buf)
+{
+    int64_t src_sector;
+    int src_cur, n1, ret;
+
+    while (n > 0) {
+        src_cur = convert_find_src(s, sector_num, &src_sector);
+        n1 = MIN(n, s->src_sectors[src_cur] - src_sector);
+        ret = bdrv_read(s->src[src_cur], src_sector, buf, n1);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int n, uint8_t *buf,
+                                         ImgConvertBlockStatus status)
+{
+    int ret, n1;
+
+    if (status != BLK_DATA) {
+        /* The target already reads these sectors correctly */
+        return 0;
+    }
+
+    if (s->compressed) {
+        if (!s->target_has_backing &&
+            buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf, n);
+    }
+
+    while (n > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n1 = n;
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, n, &n1, s->min_sparse)) {
+            ret = bdrv_write(s->target, sector_num, buf, n1);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Lets the coroutine that copies the chunk at sector_num write it */
+static void coroutine_fn convert_wr_advance(ImgConvertState *s,
+                                            int64_t sector_num)
+{
+    s->wr_offs = sector_num;
+    qemu_co_queue_restart_all(&s->wr_queue);
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertBlockStatus status;
+    int64_t sector_num;
+    uint8_t *buf;
+    int n, ret;
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (convert_next_chunk(s, &sector_num, &n, &status)) {
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                convert_set_error(s, ret);
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Chunks are handed out in order; wait for the previous one */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                qemu_co_queue_wait(&s->wr_queue);
+            }
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+            if (s->compressed) {
+                /* Compressed clusters are laid out in the order the writes
+                 * are issued, so the next chunk need not wait for this one
+                 * to complete.  The coroutines woken here only run once
+                 * bdrv_write_compressed() yields, i.e. after it has issued
+                 * this chunk. */
+                convert_wr_advance(s, sector_num + n);
+            }
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            convert_set_error(s, ret);
+            break;
+        }
+
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+
+        if (s->wr_in_order && !s->compressed) {
+            convert_wr_advance(s, sector_num + n);
+        }
+    }
+
+    qemu_vfree(buf);
+    convert_co_finish(s);
+}
+
+static int coroutine_fn convert_do_copy(ImgConvertState *s)
+{
+    Coroutine *co;
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->wr_offs = 0;
+    s->status_head = s->status_len = 0;
+    s->status_done = false;
+    qemu_co_queue_init(&s->status_produced);
+    qemu_co_queue_init(&s->status_consumed);
+    qemu_co_queue_init(&s->wr_queue);
+    s->wait_co = NULL;
+
+    if (s->total_sectors == 0) {
+        return 0;
+    }
+
+    s->running_coroutines = s->num_coroutines + 1;
+    co = qemu_coroutine_create(convert_co_status);
+    qemu_coroutine_enter(co, s);
+    for (i = 0; i < s->num_coroutines; i++) {
+        co = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(co, s);
+    }
+
+    while (s->running_coroutines > 0) {
+        s->wait_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    s->wait_co = NULL;
+
+    return s->ret == -EINPROGRESS ? 0 : s->ret;
+}
+
 static int coroutine_fn img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
+    ImgConvertState state;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
     bool quiet = false;
+    bool wr_in_order = true;
+    int num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1140,7 +1519,7 @@ static int coroutine_fn img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1197,6 +1576,23 @@ static int coroutine_fn img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1358,11 +1754,7 @@ static int coroutine_fn img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
+    cluster_sectors = 0;
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -1376,167 +1768,44 @@ static int coroutine_fn img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
+    }
 
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
+    state = (ImgConvertState) {
+        .src = bs,
+        .src_num = bs_n,
+        .total_sectors = total_sectors,
+        .target = out_bs,
+        .has_zero_init = bdrv_has_zero_init(out_bs),
+        .target_has_backing = (bool) out_baseimg,
+        .min_sparse = min_sparse,
+        .buf_sectors = compress ? cluster_sectors
+                                : IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .wr_in_order = wr_in_order,
+        .compressed = compress,
+        .cluster_sectors = cluster_sectors,
+        .num_coroutines = num_coroutines,
+    };
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
+    state.src_sectors = g_new(int64_t, bs_n);
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        state.src_sectors[bs_i] = bs_sectors;
+    }
 
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+    ret = convert_do_copy(&state);
+    g_free(state.src_sectors);
+    if (ret < 0) {
+        goto out;
+    }
 
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
+    if (compress) {
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
     }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1784,6 +2053,7 @@ static int coroutine_fn img_info(int argc, char **argv)
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
 #define SNAPSHOT_DELETE 4
+#define SNAPSHOT_FLATTEN 5
 
 static int coroutine_fn img_snapshot(int argc, char **argv)
 {
@@ -1798,7 +2068,7 @@ static int coroutine_fn img_snapshot(int argc, char **argv)
     bdrv_oflags = BDRV_O_FLAGS | BDRV_O_RDWR;
     /* Parse commandline parameters */
     for(;;) {
-        c = getopt(argc, argv, "la:c:d:hq");
+        c = getopt(argc, argv, "la:c:d:m:hq");
         if (c == -1) {
             break;
         }
@@ -1839,6 +2109,14 @@ static int coroutine_fn img_snapshot(int argc, char **argv)
             action = SNAPSHOT_DELETE;
             snapshot_name = optarg;
             break;
+        case 'm':
+            if (action) {
+                help();
+                return 0;
+            }
+            action = SNAPSHOT_FLATTEN;
+            snapshot_name = optarg;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -1892,6 +2170,17 @@ static int coroutine_fn img_snapshot(int argc, char **argv)
                 snapshot_name, ret, strerror(-ret));
         }
         break;
+
+    case SNAPSHOT_FLATTEN:
+        ret = bdrv_snapshot_find(bs, &sn, snapshot_name);
+        if (ret == 0) {
+            ret = bdrv_snapshot_flatten(bs, sn.id_str);
+        }
+        if (ret) {
+            error_report("Could not flatten snapshot '%s': %d (%s)",
+                snapshot_name, ret, strerror(-ret));
+        }
+        break;
     }
 
     /* Cleanup */
@@ -35,7 +35,9 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                tcg_threads=single|multi selects one TCG thread for all vCPUs\n"
+    "                or one per vCPU (default: single)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +60,12 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item tcg_threads=single|multi
+With @code{multi}, TCG runs each vCPU in its own host thread instead of
+round-robin scheduling all vCPUs on a single thread.  This is only available
+for guests whose memory ordering the host can emulate (currently ARM guests
+on x86 hosts) and cannot be combined with @option{-icount}.  The default is
+@code{single}.
 @end table
 ETEXI
 
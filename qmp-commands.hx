@@ -661,6 +661,29 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy: the guest resumes on the
+destination, which fetches the pages it is missing from the source.
+Requires the "postcopy" capability.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -1385,6 +1408,33 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-set-cache-size",
+        .args_type  = "device:B,name:s,size:o",
+        .mhandler.cmd_new = qmp_marshal_input_block_set_cache_size,
+    },
+
+SQMP
+block-set-cache-size
+--------------------
+
+Change the size of a metadata cache of the image format driver.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": cache name, as listed by query-blockstats (json-string)
+- "size": new cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "block-set-cache-size", "arguments": { "device": "virtio0",
+                                                       "name": "l2",
+                                                       "size": 4194304 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1911,6 +1961,13 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "caches": Statistics of the metadata caches of the image format, if it
+            has any (json-array, optional). Each json-object contains:
+    - "name": cache name, "l2" or "refcount" for qcow2 (json-string)
+    - "size": number of tables the cache can hold (json-int)
+    - "hits": lookups that found the table in the cache (json-int)
+    - "misses": lookups that had to load the table (json-int)
+    - "evictions": tables dropped to make room for another one (json-int)
 
 Example:
 
@@ -2617,7 +2674,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "completed", "failed", "cancelled",
+                        "postcopy-active"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -2656,6 +2714,31 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-conflict": number of XBZRLE page cache misses that
+           evicted another page
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following page compression information:
+         - "pages": number of pages sent compressed (json-int)
+         - "raw-bytes": size of these pages before compression (json-int)
+         - "compressed-bytes": number of bytes transferred for these
+           pages, including headers (json-int)
+- "stream": only present if "status" is "active" or "completed".
+  It is a json-object with the following information about the writes to
+  the migration streams:
+         - "syscalls": number of system calls that wrote data (json-int)
+         - "bytes": number of bytes they wrote (json-int)
+         - "bytes-per-syscall": average number of bytes written per system
+           call (json-int)
+         - "spliced-bytes": number of bytes passed by reference with the
+           x-splice capability (json-int)
+- "throttle-percentage": only present while migration is active, percentage
+  of the time the vCPUs are kept out of the guest by auto-converge (json-int)
+- "dirty-rates": only present while migration is active, a json-array of
+  json-objects with the dirty rate of each RAM block:
+         - "id": name of the RAM block (json-string)
+         - "dirty-pages-rate": number of pages of the block dirtied per
+           second (json-int)
 
 Examples:
 
@@ -2752,11 +2835,38 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":1902211,
+            "cache-conflict":1024
          }
       }
    }
 
+7. Migration is being performed and auto-converge is throttling the guest:
+
+-> { "execute": "query-migrate" }
+<- {
+      "return":{
+         "status":"active",
+         "ram":{
+            "total":1057024,
+            "remaining":1053304,
+            "transferred":3720,
+            "total-time":12345,
+            "expected-downtime":12345,
+            "duplicate":10,
+            "normal":3333,
+            "normal-bytes":3412992,
+            "dirty-pages-rate":4096
+         },
+         "throttle-percentage":40,
+         "dirty-rates":[
+            { "id":"pc.ram", "dirty-pages-rate":4032 },
+            { "id":"vga.vram", "dirty-pages-rate":64 }
+         ]
+      }
+   }
+
 EQMP
 
     {
@@ -2772,6 +2882,10 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": XBZRLE support
+- "compress": multi-threaded page compression
+- "postcopy": allow switching to post-copy with migrate-start-postcopy
+- "x-rdma-pipeline": keep several RDMA writes in flight (source only)
+- "x-splice": vmsplice guest RAM into exec, fd and unix migration streams
 
 Arguments:
 
@@ -2812,6 +2926,81 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": zlib level used to compress pages, 0 to 9 (json-int)
+- "compress-threads": number of compression threads, 1 to 255 (json-int)
+- "decompress-threads": number of decompression threads, 1 to 255 (json-int)
+- "channels": number of connections carrying RAM pages, 1 to 16 (json-int)
+- "convergence-time": time in seconds within which auto-converge tries to
+  send the remaining RAM, at least 1 (json-int)
+- "block-inflight": number of reads in flight per block device during the
+  bulk phase of block migration, 1 to 256 (json-int)
+- "buffer-size": send buffer of each outgoing stream in KiB, 32 to 16384,
+  or 0 for the default of the transport (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+     { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "channels:i?,convergence-time:i?,block-inflight:i?,"
+            "buffer-size:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "channels" : RAM channel count value (json-int)
+         - "convergence-time" : auto-converge target in seconds (json-int)
+         - "block-inflight" : block migration reads per device (json-int)
+         - "buffer-size" : stream send buffer in KiB, 0 for default (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "buffer-size": 0,
+         "block-inflight": 16,
+         "convergence-time": 10,
+         "channels": 1,
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -23,6 +23,14 @@
  */
 
 #include "config-host.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef CONFIG_SPLICE
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
 #include "qemu-common.h"
 #include "hw/hw.h"
 #include "hw/qdev.h"
@@ -118,6 +126,15 @@ void qemu_announce_self(void)
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
+/* Buffering of migration streams */
+#define STREAM_BUF_SIZE (256 * 1024)
+#define STREAM_IOV_SIZE MIN(IOV_MAX, 1024)
+
+/* Capacity requested for the pipe between vmsplice and a socket */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+/* How often to check whether the reader consumed the spliced data */
+#define SPLICE_WAIT_POLL_MS 10
+
 struct QEMUFile {
     const QEMUFileOps *ops;
     void *opaque;
@@ -129,10 +146,21 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_capacity;
+    uint8_t *buf;
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec *iov;
     unsigned int iovcnt;
+    unsigned int iov_max;
+
+    /* Set when writes are spliced to splice_fd.  splice_pipe is the pipe
+     * data goes through when splice_fd is not a pipe itself.
+     */
+    bool splice;
+    int splice_fd;
+    int splice_pipe[2];
+
+    QEMUFileStats *stats;
 
     int last_error;
 };
@@ -214,6 +242,55 @@ static int stdio_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int s
     return fwrite(buf, 1, size, s->stdio_file);
 }
 
+static ssize_t fd_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t len, offset;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t total = 0;
+
+    assert(iovcnt > 0);
+    offset = 0;
+    while (size > 0) {
+        /* Find the next start position; skip all full-sized vector elements  */
+        while (offset >= iov[0].iov_len) {
+            offset -= iov[0].iov_len;
+            iov++, iovcnt--;
+        }
+
+        /* skip `offset' bytes from the (now) first element, undo it on exit */
+        assert(iovcnt > 0);
+        iov[0].iov_base += offset;
+        iov[0].iov_len -= offset;
+
+        do {
+            len = writev(fd, iov, iovcnt);
+        } while (len == -1 && errno == EINTR);
+        if (len == -1) {
+            return -errno;
+        }
+
+        /* Undo the changes above */
+        iov[0].iov_base -= offset;
+        iov[0].iov_len += offset;
+
+        /* Prepare for the next iteration */
+        offset += len;
+        total += len;
+        size -= len;
+    }
+
+    return total;
+}
+
+/* Bypasses the stdio buffer, which is never used for pipes we write to */
+static ssize_t stdio_writev_buffer(void *opaque, struct iovec *iov,
+                                   int iovcnt, int64_t pos)
+{
+    QEMUFileStdio *s = opaque;
+
+    return fd_writev(fileno(s->stdio_file), iov, iovcnt);
+}
+
 static int coroutine_fn stdio_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileStdio *s = opaque;
@@ -282,13 +359,16 @@ static int stdio_fclose(void *opaque)
 static const QEMUFileOps stdio_pipe_read_ops = {
     .get_fd =     stdio_get_fd,
     .get_buffer = stdio_get_buffer,
-    .close =      stdio_pclose
+    .close =      stdio_pclose,
+    .buf_size =   STREAM_BUF_SIZE
 };
 
 static const QEMUFileOps stdio_pipe_write_ops = {
     .get_fd =     stdio_get_fd,
-    .put_buffer = stdio_put_buffer,
-    .close =      stdio_pclose
+    .writev_buffer = stdio_writev_buffer,
+    .close =      stdio_pclose,
+    .buf_size =   STREAM_BUF_SIZE,
+    .iov_max =    STREAM_IOV_SIZE
 };
 
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode)
@@ -334,42 +414,8 @@ static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
     QEMUFileSocket *s = opaque;
-    ssize_t len, offset;
-    ssize_t size = iov_size(iov, iovcnt);
-    ssize_t total = 0;
-
-    assert(iovcnt > 0);
-    offset = 0;
-    while (size > 0) {
-        /* Find the next start position; skip all full-sized vector elements  */
-        while (offset >= iov[0].iov_len) {
-            offset -= iov[0].iov_len;
-            iov++, iovcnt--;
-        }
 
-        /* skip `offset' bytes from the (now) first element, undo it on exit */
-        assert(iovcnt > 0);
-        iov[0].iov_base += offset;
-        iov[0].iov_len -= offset;
-
-        do {
-            len = writev(s->fd, iov, iovcnt);
-        } while (len == -1 && errno == EINTR);
-        if (len == -1) {
-            return -errno;
-        }
-
-        /* Undo the changes above */
-        iov[0].iov_base -= offset;
-        iov[0].iov_len += offset;
-
-        /* Prepare for the next iteration */
-        offset += len;
-        total += len;
-        size -= len;
-    }
-
-    return total;
+    return fd_writev(s->fd, iov, iovcnt);
 }
 
 static int coroutine_fn unix_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
@@ -406,13 +452,16 @@ static int unix_close(void *opaque)
 static const QEMUFileOps unix_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = unix_get_buffer,
-    .close =      unix_close
+    .close =      unix_close,
+    .buf_size =   STREAM_BUF_SIZE
 };
 
 static const QEMUFileOps unix_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = unix_writev_buffer,
-    .close =      unix_close
+    .close =      unix_close,
+    .buf_size =   STREAM_BUF_SIZE,
+    .iov_max =    STREAM_IOV_SIZE
 };
 
 QEMUFile *qemu_fdopen(int fd, const char *mode)
@@ -440,13 +489,16 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .buf_size =   STREAM_BUF_SIZE
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .buf_size =   STREAM_BUF_SIZE,
+    .iov_max =    STREAM_IOV_SIZE
 };
 
 bool qemu_file_mode_is_not_valid(const char *mode)
@@ -563,9 +615,108 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+
+    /* page aligned, so that spliced pages can be dropped after a flush */
+    f->buf_capacity = ROUND_UP(ops->buf_size ? ops->buf_size : IO_BUF_SIZE,
+                               getpagesize());
+    f->buf = qemu_memalign(getpagesize(), f->buf_capacity);
+    f->iov_max = ops->iov_max ? ops->iov_max : MAX_IOV_SIZE;
+    f->iov = g_new(struct iovec, f->iov_max);
+    f->splice_fd = -1;
+    f->splice_pipe[0] = f->splice_pipe[1] = -1;
     return f;
 }
 
+/**
+ * Splices the data written to the file instead of copying it
+ *
+ * The buffers passed to qemu_put_buffer_async() are then handed over to
+ * the kernel by reference with vmsplice(), directly if the file is a pipe
+ * or through an intermediate pipe if it is a socket.  Returns false if
+ * the file cannot be spliced to; its data is then copied as usual.
+ */
+bool qemu_file_enable_splice(QEMUFile *f)
+{
+#ifdef CONFIG_SPLICE
+    struct stat st;
+    int fd = qemu_get_fd(f);
+
+    if (!f->ops->writev_buffer || fd < 0 || fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    if (S_ISSOCK(st.st_mode)) {
+        if (qemu_pipe(f->splice_pipe) < 0) {
+            f->splice_pipe[0] = f->splice_pipe[1] = -1;
+            return false;
+        }
+#ifdef F_SETPIPE_SZ
+        /* the default size is enough, a larger one saves system calls */
+        fcntl(f->splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+    } else if (!S_ISFIFO(st.st_mode)) {
+        return false;
+    }
+
+    f->splice_fd = fd;
+    f->splice = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Must be called before anything is written to the file; 0 keeps the
+ * default of its QEMUFileOps
+ */
+void qemu_file_set_buffer_size(QEMUFile *f, size_t size)
+{
+    assert(f->buf_index == 0 && f->iovcnt == 0);
+
+    if (size == 0) {
+        return;
+    }
+    qemu_vfree(f->buf);
+    f->buf_capacity = ROUND_UP(size, getpagesize());
+    f->buf = qemu_memalign(getpagesize(), f->buf_capacity);
+}
+
+/* Also counts the writes to the file in stats, which can be shared by
+ * the files of several threads.
+ */
+void qemu_file_set_stats(QEMUFile *f, QEMUFileStats *stats)
+{
+    f->stats = stats;
+}
+
+void qemu_file_stats_init(QEMUFileStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_init(&stats->lock);
+}
+
+void qemu_file_stats_get(QEMUFileStats *stats, uint64_t *syscalls,
+                         uint64_t *bytes, uint64_t *spliced_bytes)
+{
+    qemu_mutex_lock(&stats->lock);
+    *syscalls = stats->syscalls;
+    *bytes = stats->bytes;
+    *spliced_bytes = stats->spliced_bytes;
+    qemu_mutex_unlock(&stats->lock);
+}
+
+static void qemu_file_account(QEMUFile *f, uint64_t syscalls,
+                              uint64_t bytes, uint64_t spliced_bytes)
+{
+    if (f->stats) {
+        qemu_mutex_lock(&f->stats->lock);
+        f->stats->syscalls += syscalls;
+        f->stats->bytes += bytes;
+        f->stats->spliced_bytes += spliced_bytes;
+        qemu_mutex_unlock(&f->stats->lock);
+    }
+}
+
 int qemu_file_get_error(QEMUFile *f)
 {
     return f->last_error;
@@ -583,6 +734,105 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+#ifdef CONFIG_SPLICE
+/* Moves len bytes out of the intermediate pipe to the destination */
+static ssize_t qemu_splice_drain(QEMUFile *f, size_t len, int *syscalls)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = splice(f->splice_pipe[0], NULL, f->splice_fd, NULL, len,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+        (*syscalls)++;
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return ret < 0 ? -errno : -EIO;
+        }
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Writes the iovec with vmsplice.  Returns the number of bytes written or
+ * a negative errno value.
+ */
+static ssize_t qemu_splice_writev(QEMUFile *f, struct iovec *iov,
+                                  unsigned int iovcnt, int *syscalls)
+{
+    bool direct = f->splice_pipe[1] < 0;
+    ssize_t total = 0;
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        /* Without a reader on the intermediate pipe, vmsplice must not
+         * block once the pipe is full.  Drain the pipe and go on.
+         */
+        ret = vmsplice(direct ? f->splice_fd : f->splice_pipe[1], iov, iovcnt,
+                       direct ? 0 : SPLICE_F_NONBLOCK);
+        (*syscalls)++;
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return ret < 0 ? -errno : -EIO;
+        }
+        if (!direct) {
+            ret = qemu_splice_drain(f, ret, syscalls);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        total += iov_discard_front(&iov, &iovcnt, ret);
+    }
+    return total;
+}
+#endif
+
+/**
+ * Waits until the kernel no longer references spliced data
+ *
+ * vmsplice() passes pages by reference, so they must not change until the
+ * reader has consumed them: the pipe is empty, or for a socket, the send
+ * queue.  Call this before the source of spliced data may change without
+ * being sent again, e.g. before the guest runs after a migration.  Returns
+ * 0, or a negative errno value (also set as the file error) if the reader
+ * went away.
+ */
+int qemu_file_splice_wait(QEMUFile *f)
+{
+#ifdef CONFIG_SPLICE
+    struct pollfd pfd;
+    int pending;
+
+    if (!f->splice) {
+        return 0;
+    }
+
+    qemu_fflush(f);
+    pfd.fd = f->splice_fd;
+    pfd.events = 0;
+    while (!qemu_file_get_error(f)) {
+        if (ioctl(f->splice_fd,
+                  f->splice_pipe[0] >= 0 ? SIOCOUTQ : FIONREAD,
+                  &pending) < 0) {
+            qemu_file_set_error(f, -errno);
+            break;
+        }
+        if (pending == 0) {
+            break;
+        }
+        /* Only POLLERR and POLLHUP, i.e. the reader closed its end */
+        if (poll(&pfd, 1, SPLICE_WAIT_POLL_MS) > 0) {
+            qemu_file_set_error(f, -EPIPE);
+            break;
+        }
+    }
+#endif
+    return qemu_file_get_error(f);
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -592,18 +842,36 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
 void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
+    int syscalls = 1;
 
     if (!qemu_file_is_writable(f)) {
         return;
     }
 
-    if (f->ops->writev_buffer) {
+    if (f->splice) {
+#ifdef CONFIG_SPLICE
+        if (f->iovcnt > 0) {
+            syscalls = 0;
+            ret = qemu_splice_writev(f, f->iov, f->iovcnt, &syscalls);
+            qemu_file_account(f, syscalls, MAX(ret, 0), MAX(ret, 0));
+        }
+        /* The pipe may still reference the buffer; give it new pages
+         * rather than overwriting the ones that were spliced.
+         */
+        if (f->buf_index > 0) {
+            qemu_madvise(f->buf, ROUND_UP(f->buf_index, getpagesize()),
+                         QEMU_MADV_DONTNEED);
+        }
+#endif
+    } else if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+            qemu_file_account(f, syscalls, MAX(ret, 0), 0);
         }
     } else {
         if (f->buf_index > 0) {
             ret = f->ops->put_buffer(f->opaque, f->buf, f->pos, f->buf_index);
+            qemu_file_account(f, syscalls, MAX(ret, 0), 0);
         }
     }
     if (ret >= 0) {
@@ -695,7 +963,7 @@ static void coroutine_fn qemu_co_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+                        f->buf_capacity - pending);
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -741,6 +1009,12 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/* Accounts len bytes sent outside of f against its rate limit */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -753,6 +1027,7 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret;
     qemu_fflush(f);
+    qemu_file_splice_wait(f);
     ret = qemu_file_get_error(f);
 
     if (f->ops->close) {
@@ -767,6 +1042,12 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    if (f->splice_pipe[0] >= 0) {
+        close(f->splice_pipe[0]);
+        close(f->splice_pipe[1]);
+    }
+    qemu_vfree(f->buf);
+    g_free(f->iov);
     g_free(f);
     return ret;
 }
@@ -782,7 +1063,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
     }
 }
@@ -811,16 +1092,16 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_capacity - f->buf_index;
         if (l > size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
-        f->bytes_xfer += size;
+        f->bytes_xfer += l;
+        f->buf_index += l;
         if (f->ops->writev_buffer) {
-            add_to_iovec(f, f->buf + f->buf_index, l);
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
         }
-        f->buf_index += l;
-        if (f->buf_index == IO_BUF_SIZE) {
+        if (f->buf_index == f->buf_capacity) {
             qemu_fflush(f);
         }
         if (qemu_file_get_error(f)) {
@@ -839,11 +1120,11 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
+    f->buf_index++;
     if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, 1);
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
     }
-    f->buf_index++;
-    if (f->buf_index == IO_BUF_SIZE) {
+    if (f->buf_index == f->buf_capacity) {
         qemu_fflush(f);
     }
 }
@@ -1958,7 +2239,7 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int savevm_state_complete(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret;
@@ -1979,11 +2260,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
-        ret = se->ops->save_live_complete(f, se->opaque);
+        if (postcopy && se->ops->save_live_postcopy) {
+            ret = se->ops->save_live_postcopy(f, se->opaque);
+        } else {
+            ret = se->ops->save_live_complete(f, se->opaque);
+        }
         trace_savevm_section_end(se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
 
@@ -2012,6 +2297,20 @@ void qemu_savevm_state_complete(QEMUFile *f)
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
+
+    return 0;
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    savevm_state_complete(f, false);
+}
+
+/* Like qemu_savevm_state_complete(), but lets the handlers that support it
+ * send the rest of their state once the destination is running */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    return savevm_state_complete(f, true);
 }
 
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
@@ -2346,6 +2645,26 @@ static BlockDriverState *find_vmstate_bs(void)
     return NULL;
 }
 
+/* The snapshot that the next incremental one is taken from */
+static QEMUSnapshotInfo snapshot_parent;
+static BlockDriverState *snapshot_parent_bs;
+
+/* Whether RAM changes were tracked since the parent snapshot was saved */
+static bool snapshot_parent_valid(BlockDriverState *bs)
+{
+    QEMUSnapshotInfo sn;
+
+    if (!ram_snapshot_tracking() || bs != snapshot_parent_bs) {
+        return false;
+    }
+    if (bdrv_snapshot_find(bs, &sn, snapshot_parent.id_str) < 0) {
+        return false;
+    }
+    return !strcmp(sn.id_str, snapshot_parent.id_str) &&
+           sn.date_sec == snapshot_parent.date_sec &&
+           sn.date_nsec == snapshot_parent.date_nsec;
+}
+
 /*
  * Deletes snapshots of a given name in all opened images.
  */
@@ -2383,7 +2702,9 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     uint64_t vm_state_size;
     qemu_timeval tv;
     struct tm tm;
+    bool delta, created = false;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool incremental = qdict_get_try_bool(qdict, "incremental", 0);
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2442,11 +2763,21 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
+    delta = incremental && snapshot_parent_valid(bs);
+    if (delta) {
+        SnapshotDeltaHeader hdr;
+
+        bdrv_snapshot_delta_header(&hdr, &snapshot_parent);
+        qemu_put_buffer(f, (uint8_t *)&hdr, sizeof(hdr));
+    }
+    ram_snapshot_begin(incremental, delta);
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
+        ram_snapshot_stop();
+        snapshot_parent_bs = NULL;
         goto the_end;
     }
 
@@ -2461,10 +2792,21 @@ void do_savevm(Monitor *mon, const QDict *qdict)
             if (ret < 0) {
                 monitor_printf(mon, "Error while creating snapshot on '%s'\n",
                                bdrv_get_device_name(bs1));
+            } else if (bs == bs1) {
+                created = true;
             }
         }
     }
 
+    /* Take the next incremental snapshot from this one */
+    if (incremental && created) {
+        snapshot_parent = *sn;
+        snapshot_parent_bs = bs;
+    } else {
+        ram_snapshot_stop();
+        snapshot_parent_bs = NULL;
+    }
+
  the_end:
     if (saved_vm_running)
         vm_start();
@@ -2495,11 +2837,41 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
         vm_start();
 }
 
+/*
+ * Loads the VM state of the active layer of bs.  Flattened incremental
+ * snapshots have several migration streams one after the other.
+ */
+static int qemu_loadvm_snapshot(BlockDriverState *bs, bool delta)
+{
+    SnapshotDeltaHeader hdr;
+    uint8_t magic[4];
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen_bdrv(bs, 0);
+    if (!f) {
+        error_report("Could not open VM state file");
+        return -EINVAL;
+    }
+
+    if (delta) {
+        qemu_get_buffer(f, (uint8_t *)&hdr, sizeof(hdr));
+    }
+    do {
+        ret = qemu_loadvm_state(f);
+    } while (ret == 0 &&
+             qemu_peek_buffer(f, magic, sizeof(magic), 0) == sizeof(magic) &&
+             ldl_be_p(magic) == QEMU_VM_FILE_MAGIC);
+
+    qemu_fclose(f);
+    return ret;
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
-    QEMUSnapshotInfo sn;
-    QEMUFile *f;
+    QEMUSnapshotInfo sn, *chain;
+    int nb_chain, i;
     int ret;
 
     bs_vm_state = find_vmstate_bs();
@@ -2544,6 +2916,10 @@ int load_vmstate(const char *name)
     /* Flush all IO requests so they don't interfere with the new state.  */
     bdrv_drain_all();
 
+    /* RAM is about to be replaced, the next snapshot must be a full one */
+    ram_snapshot_stop();
+    snapshot_parent_bs = NULL;
+
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
         if (bdrv_can_snapshot(bs)) {
@@ -2556,23 +2932,45 @@ int load_vmstate(const char *name)
         }
     }
 
-    /* restore the VM state */
-    f = qemu_fopen_bdrv(bs_vm_state, 0);
-    if (!f) {
-        error_report("Could not open VM state file");
-        return -EINVAL;
+    /* Find the snapshots an incremental one was taken from */
+    ret = bdrv_snapshot_find(bs_vm_state, &sn, name);
+    if (ret < 0) {
+        return ret;
+    }
+    nb_chain = bdrv_snapshot_vmstate_chain(bs_vm_state, sn.id_str, &chain);
+    if (nb_chain < 0) {
+        error_report("Error %d while looking for the parents of snapshot '%s'",
+                     nb_chain, name);
+        bdrv_snapshot_goto(bs_vm_state, sn.id_str);
+        return nb_chain;
     }
 
+    /* restore the VM state, starting from the oldest snapshot of the chain */
     qemu_system_reset(VMRESET_SILENT);
-    ret = qemu_loadvm_state(f);
-
-    qemu_fclose(f);
-    if (ret < 0) {
-        error_report("Error %d while loading VM state", ret);
-        return ret;
+    for (i = 0; i < nb_chain; i++) {
+        if (nb_chain > 1) {
+            ret = bdrv_snapshot_goto(bs_vm_state, chain[i].id_str);
+            if (ret < 0) {
+                error_report("Error %d while activating snapshot '%s' on '%s'",
+                             ret, chain[i].name,
+                             bdrv_get_device_name(bs_vm_state));
+                goto out;
+            }
+        }
+        ret = qemu_loadvm_snapshot(bs_vm_state, i > 0);
+        if (ret < 0) {
+            error_report("Error %d while loading VM state", ret);
+            goto out;
+        }
     }
 
-    return 0;
+out:
+    if (ret < 0 && nb_chain > 1) {
+        /* Leave the disk consistent with the other ones */
+        bdrv_snapshot_goto(bs_vm_state, sn.id_str);
+    }
+    g_free(chain);
+    return ret;
 }
 
 void do_delvm(Monitor *mon, const QDict *qdict)
@@ -0,0 +1,6 @@
+#include "qemu-common.h"
+#include "block/coroutine_int.h"
+
+void qemu_coroutine_backend_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
@@ -32,6 +32,12 @@
 #include "fpu/softfloat.h"
 
 #define TARGET_HAS_ICE 1
+/* gen_intermediate_code() honours CF_TRACE */
+#define TARGET_HAS_TRACES 1
+
+/* ARM is weakly ordered: plain accesses need no ordering from the host,
+   barriers are emitted explicitly for dmb/dsb.  */
+#define TCG_GUEST_DEFAULT_MO 0
 
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
@@ -62,6 +62,11 @@ DEF_HELPER_2(get_cp_reg, i32, env, ptr)
 DEF_HELPER_3(set_cp_reg64, void, env, ptr, i64)
 DEF_HELPER_2(get_cp_reg64, i64, env, ptr)
 
+#if !defined(CONFIG_USER_ONLY)
+DEF_HELPER_5(strex, i32, env, i32, i32, i32, i32)
+DEF_HELPER_FLAGS_0(dmb, TCG_CALL_NO_RWG, void)
+#endif
+
 DEF_HELPER_2(get_r13_banked, i32, env, i32)
 DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
 
@@ -18,6 +18,7 @@
  */
 #include "cpu.h"
 #include "helper.h"
+#include "qemu/atomic.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -85,6 +86,106 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+/* Store-exclusive for multi-threaded TCG.  The store replaces the value
+   seen by the load-exclusive with a host compare-and-swap on guest RAM, so
+   two racing store-exclusives to the same location cannot both succeed.
+   Plain stores from other vCPUs are not monitored, as in the
+   single-threaded implementation.  */
+static uint32_t strex_cmpxchg(void *host, uint32_t size, uint32_t old,
+                              uint32_t old2, uint32_t val, uint32_t val2)
+{
+    uint32_t old64[2], new64[2];
+    uint64_t o, n;
+
+    switch (size) {
+    case 0:
+        return atomic_cmpxchg((uint8_t *)host, (uint8_t)old,
+                              (uint8_t)val) != (uint8_t)old;
+    case 1:
+        return atomic_cmpxchg((uint16_t *)host, tswap16(old),
+                              tswap16(val)) != tswap16(old);
+    case 2:
+        return atomic_cmpxchg((uint32_t *)host, tswap32(old),
+                              tswap32(val)) != tswap32(old);
+    default:
+        /* the two words, in guest memory order */
+        old64[0] = tswap32(old);
+        old64[1] = tswap32(old2);
+        new64[0] = tswap32(val);
+        new64[1] = tswap32(val2);
+        memcpy(&o, old64, 8);
+        memcpy(&n, new64, 8);
+        return atomic_cmpxchg((uint64_t *)host, o, n) != o;
+    }
+}
+
+/* Device memory, where every access is done under the iothread mutex, and
+   the rare store-exclusive crossing a page boundary.  */
+static uint32_t strex_io(CPUARMState *env, uint32_t addr, uint32_t val,
+                         uint32_t val2, uint32_t size)
+{
+    uint32_t cur;
+    uint32_t res = 1;
+    bool locked = tcg_lock_iothread();
+
+    switch (size) {
+    case 0:
+        cur = cpu_ldub_data(env, addr);
+        break;
+    case 1:
+        cur = cpu_lduw_data(env, addr);
+        break;
+    default:
+        cur = cpu_ldl_data(env, addr);
+        break;
+    }
+    if (cur == env->exclusive_val &&
+        (size != 3 ||
+         cpu_ldl_data(env, addr + 4) == env->exclusive_high)) {
+        switch (size) {
+        case 0:
+            cpu_stb_data(env, addr, val);
+            break;
+        case 1:
+            cpu_stw_data(env, addr, val);
+            break;
+        case 2:
+            cpu_stl_data(env, addr, val);
+            break;
+        default:
+            cpu_stl_data(env, addr, val);
+            cpu_stl_data(env, addr + 4, val2);
+            break;
+        }
+        res = 0;
+    }
+    tcg_unlock_iothread(locked);
+    return res;
+}
+
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint32_t val,
+                       uint32_t val2, uint32_t size)
+{
+    void *host;
+
+    if (env->exclusive_addr != addr) {
+        return 1;
+    }
+    /* the translator has synced the PC, so no retaddr is needed */
+    host = tlb_vaddr_to_host_write(env, addr, size == 3 ? 8 : 1 << size,
+                                   cpu_mmu_index(env), 0);
+    if (host == NULL) {
+        return strex_io(env, addr, val, val2, size);
+    }
+    return strex_cmpxchg(host, size, env->exclusive_val,
+                         env->exclusive_high, val, val2);
+}
+
+void HELPER(dmb)(void)
+{
+    smp_mb();
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
@@ -273,43 +374,54 @@ void HELPER(set_user_reg)(CPUARMState *env, uint32_t regno, uint32_t val)
     }
 }
 
+/* Coprocessor register accessors may reach timers, interrupt controllers
+   or the TB cache, so they run under the iothread mutex with multi-threaded
+   TCG.  raise_exception() leaves through cpu_exec(), which drops it.  */
 void HELPER(set_cp_reg)(CPUARMState *env, void *rip, uint32_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = tcg_lock_iothread();
     int excp = ri->writefn(env, ri, value);
     if (excp) {
         raise_exception(env, excp);
     }
+    tcg_unlock_iothread(locked);
 }
 
 uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
     uint64_t value;
+    bool locked = tcg_lock_iothread();
     int excp = ri->readfn(env, ri, &value);
     if (excp) {
         raise_exception(env, excp);
     }
+    tcg_unlock_iothread(locked);
     return value;
 }
 
 void HELPER(set_cp_reg64)(CPUARMState *env, void *rip, uint64_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = tcg_lock_iothread();
     int excp = ri->writefn(env, ri, value);
     if (excp) {
         raise_exception(env, excp);
     }
+    tcg_unlock_iothread(locked);
 }
 
 uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
     uint64_t value;
+    bool locked = tcg_lock_iothread();
     int excp = ri->readfn(env, ri, &value);
     if (excp) {
         raise_exception(env, excp);
     }
+    tcg_unlock_iothread(locked);
     return value;
 }
 
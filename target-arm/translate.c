@@ -67,6 +67,12 @@ typedef struct DisasContext {
     int vfp_enabled;
     int vec_len;
     int vec_stride;
+    /* Trace state, see gen_trace_jmp().  */
+    bool search_pc;
+    target_ulong block_pc;
+    target_ulong trace_end;
+    int trace_blocks;
+    int trace_nb_cond;
 } DisasContext;
 
 static uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
@@ -3363,8 +3369,74 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     }
 }
 
+/* When translating a trace (CF_TRACE), go on translating at the target of
+   a direct branch instead of ending the TB.  A conditional branch is
+   followed in the direction in which its block was mostly left, the other
+   one becoming a side exit.  Only targets after the start of the trace and
+   in its page are followed, so that tb->size covers all translated code.
+   Returns true if the branch was folded into the trace.  */
+static bool gen_trace_jmp(DisasContext *s, uint32_t dest)
+{
+    TranslationBlock *tb = s->tb;
+    int taken, label;
+
+    if (!(tb->cflags & CF_TRACE) || s->condexec_mask ||
+        s->trace_blocks >= TB_TRACE_MAX_BLOCKS ||
+        dest <= tb->pc ||
+        (dest & TARGET_PAGE_MASK) != (tb->pc & TARGET_PAGE_MASK)) {
+        return false;
+    }
+    if (s->condjmp) {
+        if (s->search_pc) {
+            /* take the same path as when the trace was generated */
+            if (s->trace_nb_cond >= tb->trace_nb_cond) {
+                return false;
+            }
+            taken = (tb->trace_taken >> s->trace_nb_cond) & 1;
+        } else {
+            /* exit 0 is the branch, see gen_jmp() below */
+            switch (tb_trace_hot_exit(tb, s->block_pc)) {
+            case 0:
+                taken = 1;
+                break;
+            case 1:
+                taken = 0;
+                break;
+            default:
+                return false;
+            }
+            tb->trace_taken |= taken << tb->trace_nb_cond;
+            tb->trace_nb_cond++;
+        }
+        s->trace_nb_cond++;
+
+        if (taken) {
+            label = gen_new_label();
+            tcg_gen_br(label);
+            gen_set_label(s->condlabel);
+            gen_set_pc_im(s->pc);
+            tcg_gen_exit_tb(0);
+            gen_set_label(label);
+        } else {
+            gen_set_pc_im(dest);
+            tcg_gen_exit_tb(0);
+            gen_set_label(s->condlabel);
+            dest = s->pc;
+        }
+        s->condjmp = 0;
+    }
+    s->trace_end = MAX(s->trace_end, s->pc);
+    s->pc = dest;
+    s->block_pc = dest;
+    s->trace_blocks++;
+    return true;
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
+    if (gen_trace_jmp(s, dest)) {
+        return;
+    }
     if (unlikely(s->singlestep_enabled)) {
         /* An indirect jump so that we still trigger the debug exception.  */
         if (s->thumb)
@@ -6443,9 +6515,10 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   In system emulation mode with a single TCG thread only one CPU will be
+   running at once, so this sequence is effectively atomic; with one thread
+   per vCPU the store is done by a helper under a lock.  In user emulation
+   mode we throw an exception and handle the atomic operation elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -6484,6 +6557,16 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
 
+/* dmb/dsb: ordering is only observable by other vCPU threads */
+static void gen_barrier(DisasContext *s)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_dmb();
+    }
+#endif
+}
+
 #ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
@@ -6507,6 +6590,23 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } else {
          {Rd} = 1;
        } */
+    if (qemu_tcg_mttcg_enabled()) {
+        TCGv_i32 tmp2, tsize;
+
+        /* the helper may fault */
+        gen_set_condexec(s);
+        gen_set_pc_im(s->pc - 4);
+        tmp = load_reg(s, rt);
+        tmp2 = size == 3 ? load_reg(s, rt2) : tcg_const_i32(0);
+        tsize = tcg_const_i32(size);
+        gen_helper_strex(cpu_R[rd], cpu_env, addr, tmp, tmp2, tsize);
+        tcg_temp_free_i32(tsize);
+        tcg_temp_free_i32(tmp2);
+        tcg_temp_free_i32(tmp);
+        tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+        return;
+    }
+
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
@@ -6716,9 +6816,12 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 return;
             case 4: /* dsb */
             case 5: /* dmb */
+                ARCH(7);
+                gen_barrier(s);
+                return;
             case 6: /* isb */
                 ARCH(7);
-                /* We don't emulate caches so these are a no-op.  */
+                /* We don't emulate caches so this is a no-op.  */
                 return;
             default:
                 goto illegal_op;
@@ -8790,8 +8893,10 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                             break;
                         case 4: /* dsb */
                         case 5: /* dmb */
+                            gen_barrier(s);
+                            break;
                         case 6: /* isb */
-                            /* These execute as NOPs.  */
+                            /* This executes as a NOP.  */
                             break;
                         default:
                             goto illegal_op;
@@ -9943,6 +10048,11 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     dc->vfp_enabled = ARM_TBFLAG_VFPEN(tb->flags);
     dc->vec_len = ARM_TBFLAG_VECLEN(tb->flags);
     dc->vec_stride = ARM_TBFLAG_VECSTRIDE(tb->flags);
+    dc->search_pc = search_pc;
+    dc->block_pc = pc_start;
+    dc->trace_end = pc_start;
+    dc->trace_blocks = 1;
+    dc->trace_nb_cond = 0;
     cpu_F0s = tcg_temp_new_i32();
     cpu_F1s = tcg_temp_new_i32();
     cpu_F0d = tcg_temp_new_i64();
@@ -10167,7 +10277,7 @@ done_generating:
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
         qemu_log("----------------\n");
         qemu_log("IN: %s\n", lookup_symbol(pc_start));
-        log_target_disas(env, pc_start, dc->pc - pc_start,
+        log_target_disas(env, pc_start, MAX(dc->trace_end, dc->pc) - pc_start,
                          dc->thumb | (dc->bswap_code << 1));
         qemu_log("\n");
     }
@@ -10178,7 +10288,7 @@ done_generating:
         while (lj <= j)
             tcg_ctx.gen_opc_instr_start[lj++] = 0;
     } else {
-        tb->size = dc->pc - pc_start;
+        tb->size = MAX(dc->trace_end, dc->pc) - pc_start;
         tb->icount = num_insns;
     }
 }
@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-cc.h"
 #include "qemu/log.h"
 
 #include "helpers.h"
@@ -683,13 +684,31 @@ static TCGv gen_ea(CPUM68KState *env, DisasContext *s, uint16_t insn,
     return NULL_QREG;
 }
 
+static const TCGCCProducer cc_producers[] = {
+    [CC_OP_LOGIC] = { TCG_CC_OP_LOGIC, 32 },
+    [CC_OP_ADD] = { TCG_CC_OP_ADD, 32 },
+    [CC_OP_SUB] = { TCG_CC_OP_SUB, 32 },
+    [CC_OP_CMPB] = { TCG_CC_OP_SUB, 8 },
+    [CC_OP_CMPW] = { TCG_CC_OP_SUB, 16 },
+    [CC_OP_SHIFT] = { TCG_CC_OP_NONE },
+};
+
 /* This generates a conditional branch, clobbering all temporaries.  */
 static void gen_jmpcc(DisasContext *s, int cond, int l1)
 {
+    TCGCCCompare cmp;
+    TCGv src1;
     TCGv tmp;
 
-    /* TODO: Optimize compare/branch pairs rather than always flushing
-       flag state to CC_OP_FLAGS.  */
+    /* Branch on the saved operands of compare/branch pairs when
+       possible, rather than flushing flag state to CC_OP_FLAGS.  */
+    TCGV_UNUSED(src1);
+    if (tcg_cc_compare(&cmp, &cc_producers[s->cc_op], cond, QREG_CC_DEST,
+                       src1, QREG_CC_SRC)) {
+        tcg_gen_brcond_i32(cmp.cond, cmp.c1, cmp.c2, l1);
+        tcg_cc_compare_free(&cmp);
+        return;
+    }
     gen_flush_flags(s);
     switch (cond) {
     case 0: /* T */
@@ -28,6 +28,7 @@
 #include "disas/disas.h"
 #include "helper.h"
 #include "tcg-op.h"
+#include "tcg-cc.h"
 
 #define GEN_HELPER 1
 #include "helper.h"
@@ -1070,47 +1071,38 @@ static void free_compare(DisasCompare *cmp)
     }
 }
 
+static const TCGCCProducer cc_producers[CC_OP_NB] = {
+    [CC_OP_ADD] = { TCG_CC_OP_ADD },
+    [CC_OP_TADD] = { TCG_CC_OP_ADD },
+    [CC_OP_TADDTV] = { TCG_CC_OP_ADD },
+    [CC_OP_SUB] = { TCG_CC_OP_SUB },
+    [CC_OP_LOGIC] = { TCG_CC_OP_LOGIC },
+};
+
 static void gen_compare(DisasCompare *cmp, bool xcc, unsigned int cond,
                         DisasContext *dc)
 {
-    static int subcc_cond[16] = {
-        TCG_COND_NEVER,
-        TCG_COND_EQ,
-        TCG_COND_LE,
-        TCG_COND_LT,
-        TCG_COND_LEU,
-        TCG_COND_LTU,
-        -1, /* neg */
-        -1, /* overflow */
-        TCG_COND_ALWAYS,
-        TCG_COND_NE,
-        TCG_COND_GT,
-        TCG_COND_GE,
-        TCG_COND_GTU,
-        TCG_COND_GEU,
-        -1, /* pos */
-        -1, /* no overflow */
-    };
-
-    static int logic_cond[16] = {
-        TCG_COND_NEVER,
-        TCG_COND_EQ,     /* eq:  Z */
-        TCG_COND_LE,     /* le:  Z | (N ^ V) -> Z | N */
-        TCG_COND_LT,     /* lt:  N ^ V -> N */
-        TCG_COND_EQ,     /* leu: C | Z -> Z */
-        TCG_COND_NEVER,  /* ltu: C -> 0 */
-        TCG_COND_LT,     /* neg: N */
-        TCG_COND_NEVER,  /* vs:  V -> 0 */
-        TCG_COND_ALWAYS,
-        TCG_COND_NE,     /* ne:  !Z */
-        TCG_COND_GT,     /* gt:  !(Z | (N ^ V)) -> !(Z | N) */
-        TCG_COND_GE,     /* ge:  !(N ^ V) -> !N */
-        TCG_COND_NE,     /* gtu: !(C | Z) -> !Z */
-        TCG_COND_ALWAYS, /* geu: !C -> 1 */
-        TCG_COND_GE,     /* pos: !N */
-        TCG_COND_ALWAYS, /* vc:  !V -> 1 */
+    static const TCGCCCond cc_cond[16] = {
+        TCG_CC_F,   /* n */
+        TCG_CC_EQ,  /* e */
+        TCG_CC_LE,  /* le */
+        TCG_CC_LT,  /* l */
+        TCG_CC_LS,  /* leu */
+        TCG_CC_CS,  /* cs */
+        TCG_CC_MI,  /* neg */
+        TCG_CC_VS,  /* vs */
+        TCG_CC_T,   /* a */
+        TCG_CC_NE,  /* ne */
+        TCG_CC_GT,  /* g */
+        TCG_CC_GE,  /* ge */
+        TCG_CC_HI,  /* gu */
+        TCG_CC_CC,  /* cc */
+        TCG_CC_PL,  /* pos */
+        TCG_CC_VC,  /* vc */
     };
 
+    TCGCCProducer p;
+    TCGCCCompare lazy;
     TCGv_i32 r_src;
     TCGv r_dst;
 
@@ -1124,60 +1116,23 @@ static void gen_compare(DisasCompare *cmp, bool xcc, unsigned int cond,
     r_src = cpu_psr;
 #endif
 
-    switch (dc->cc_op) {
-    case CC_OP_LOGIC:
-        cmp->cond = logic_cond[cond];
-    do_compare_dst_0:
+    p = cc_producers[dc->cc_op];
+    if (!xcc) {
+        p.bits = 32;
+    }
+    if (tcg_cc_compare(&lazy, &p, cc_cond[cond], cpu_cc_dst,
+                       cpu_cc_src, cpu_cc_src2)) {
+        cmp->cond = lazy.cond;
         cmp->is_bool = false;
-        cmp->g2 = false;
-        cmp->c2 = tcg_const_tl(0);
-#ifdef TARGET_SPARC64
-        if (!xcc) {
-            cmp->g1 = false;
-            cmp->c1 = tcg_temp_new();
-            tcg_gen_ext32s_tl(cmp->c1, cpu_cc_dst);
-            break;
-        }
-#endif
-        cmp->g1 = true;
-        cmp->c1 = cpu_cc_dst;
-        break;
-
-    case CC_OP_SUB:
-        switch (cond) {
-        case 6:  /* neg */
-        case 14: /* pos */
-            cmp->cond = (cond == 6 ? TCG_COND_LT : TCG_COND_GE);
-            goto do_compare_dst_0;
-
-        case 7: /* overflow */
-        case 15: /* !overflow */
-            goto do_dynamic;
-
-        default:
-            cmp->cond = subcc_cond[cond];
-            cmp->is_bool = false;
-#ifdef TARGET_SPARC64
-            if (!xcc) {
-                /* Note that sign-extension works for unsigned compares as
-                   long as both operands are sign-extended.  */
-                cmp->g1 = cmp->g2 = false;
-                cmp->c1 = tcg_temp_new();
-                cmp->c2 = tcg_temp_new();
-                tcg_gen_ext32s_tl(cmp->c1, cpu_cc_src);
-                tcg_gen_ext32s_tl(cmp->c2, cpu_cc_src2);
-                break;
-            }
-#endif
-            cmp->g1 = cmp->g2 = true;
-            cmp->c1 = cpu_cc_src;
-            cmp->c2 = cpu_cc_src2;
-            break;
-        }
-        break;
+        cmp->g1 = lazy.g1;
+        cmp->g2 = lazy.g2;
+        cmp->c1 = lazy.c1;
+        cmp->c2 = lazy.c2;
+        return;
+    }
 
+    switch (dc->cc_op) {
     default:
-    do_dynamic:
         gen_helper_compute_psr(cpu_env);
         dc->cc_op = CC_OP_FLAGS;
         /* FALLTHRU */
@@ -1685,6 +1685,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* Keep the 32-bit displacement naturally aligned so that
+               tb_set_jmp_target1 patches it with a single atomic store
+               while other vCPU threads may be executing this TB.  */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
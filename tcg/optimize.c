@@ -97,6 +97,17 @@ static TCGOpcode op_to_movi(TCGOpcode op)
     }
 }
 
+static bool op_is_cond_branch(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(brcond):
+    case INDEX_op_brcond2_i32:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static TCGArg find_better_copy(TCGContext *s, TCGArg temp)
 {
     TCGArg i;
@@ -1095,8 +1106,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                to compute the operation result) so no propagation is done.
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+               the non-zero bits mask for the first output arg.
+               The fall-through of a conditional branch is only reached
+               from the branch, so everything still holds there; this
+               keeps propagating along the side exits of a trace.  */
+            if ((def->flags & TCG_OPF_BB_END) && !op_is_cond_branch(op)) {
                 reset_all_temps(nb_temps);
             } else {
                 for (i = 0; i < def->nb_oargs; i++) {
@@ -1115,10 +1129,499 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Redundancy elimination.  This second pass numbers the values computed
+   in each basic block: an op computing a value that a temp already holds
+   becomes a move, loads from env are forwarded from an earlier load or
+   store of the same field, and stores to env are dropped when the field
+   already holds the value or when it is overwritten before anything can
+   observe it.  */
+
+#define VN_HASH_BITS    10
+#define VN_HASH_SIZE    (1 << VN_HASH_BITS)
+#define VN_HASH_PROBES  8
+#define VN_MAX_KEY      6
+#define MEM_MAX_ENTRIES 32
+
+struct vn_entry {
+    uint32_t gen;
+    TCGOpcode op;
+    TCGArg key[VN_MAX_KEY];
+    uint32_t vn;
+    TCGArg temp;
+};
+
+struct mem_entry {
+    bool valid;
+    tcg_target_long offset;
+    int size;
+    /* load returning the field, INDEX_op_end for a narrowing store */
+    TCGOpcode ld_op;
+    uint32_t vn;
+    TCGArg temp;
+    /* index of a store to the field that nothing has observed yet, or -1 */
+    int pending_store;
+};
+
+static uint32_t temp_vn[TCG_MAX_TEMPS];
+static uint32_t next_vn;
+static struct vn_entry vn_table[VN_HASH_SIZE];
+static uint32_t vn_gen;
+static struct mem_entry mem_table[MEM_MAX_ENTRIES];
+static int mem_victim;
+
+static void vn_reset(int nb_temps)
+{
+    int i;
+
+    if (++vn_gen == 0) {
+        memset(vn_table, 0, sizeof(vn_table));
+        vn_gen = 1;
+    }
+    for (i = 0; i < nb_temps; i++) {
+        temp_vn[i] = next_vn++;
+    }
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        mem_table[i].valid = false;
+    }
+}
+
+/* Normal temps do not survive the end of a basic block, not even into the
+   fall-through of a conditional branch.  */
+static void vn_kill_normal_temps(TCGContext *s)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (!s->temps[i].temp_local) {
+            temp_vn[i] = next_vn++;
+        }
+    }
+}
+
+static bool op_is_commutative(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(add):
+    CASE_OP_32_64(mul):
+    CASE_OP_32_64(and):
+    CASE_OP_32_64(or):
+    CASE_OP_32_64(xor):
+    CASE_OP_32_64(eqv):
+    CASE_OP_32_64(nand):
+    CASE_OP_32_64(nor):
+        return true;
+    default:
+        return false;
+    }
+}
+
+static struct vn_entry *vn_lookup(TCGOpcode op, const TCGArg *key)
+{
+    unsigned int h = op;
+    struct vn_entry *e, *victim = NULL;
+    int i;
+
+    for (i = 0; i < VN_MAX_KEY; i++) {
+        h = h * 31 + key[i];
+    }
+    for (i = 0; i < VN_HASH_PROBES; i++) {
+        e = &vn_table[(h + i) & (VN_HASH_SIZE - 1)];
+        if (e->gen != vn_gen) {
+            if (!victim) {
+                victim = e;
+            }
+            continue;
+        }
+        if (e->op == op && !memcmp(e->key, key, sizeof(e->key))) {
+            return e;
+        }
+    }
+    if (!victim) {
+        victim = &vn_table[h & (VN_HASH_SIZE - 1)];
+    }
+    victim->gen = vn_gen;
+    victim->op = op;
+    memcpy(victim->key, key, sizeof(victim->key));
+    victim->vn = next_vn++;
+    victim->temp = -1;
+    return victim;
+}
+
+static int mem_op_size(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool op_is_store(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(st8):
+    CASE_OP_32_64(st16):
+    CASE_OP_32_64(st):
+    case INDEX_op_st32_i64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* A load that reads back exactly what the store wrote.  */
+static TCGOpcode st_to_ld(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_st_i32:
+        return INDEX_op_ld_i32;
+    case INDEX_op_st_i64:
+        return INDEX_op_ld_i64;
+    default:
+        return INDEX_op_end;
+    }
+}
+
+static bool temp_is_env(TCGContext *s, TCGArg temp)
+{
+    return s->temps[temp].fixed_reg && s->temps[temp].reg == TCG_AREG0;
+}
+
+static struct mem_entry *mem_find(tcg_target_long offset, TCGOpcode ld_op)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        if (mem_table[i].valid && mem_table[i].offset == offset &&
+            mem_table[i].ld_op == ld_op) {
+            return &mem_table[i];
+        }
+    }
+    return NULL;
+}
+
+static struct mem_entry *mem_insert(tcg_target_long offset, int size,
+                                    TCGOpcode ld_op, uint32_t vn, TCGArg temp)
+{
+    struct mem_entry *e = NULL;
+    int i;
+
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        if (!mem_table[i].valid) {
+            e = &mem_table[i];
+            break;
+        }
+    }
+    if (!e) {
+        e = &mem_table[mem_victim];
+        mem_victim = (mem_victim + 1) % MEM_MAX_ENTRIES;
+    }
+    e->valid = true;
+    e->offset = offset;
+    e->size = size;
+    e->ld_op = ld_op;
+    e->vn = vn;
+    e->temp = temp;
+    e->pending_store = -1;
+    return e;
+}
+
+/* Something may read env or leave the TB: pending stores must stay.  */
+static void mem_observe_all(void)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        mem_table[i].pending_store = -1;
+    }
+}
+
+static void mem_observe(tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        struct mem_entry *e = &mem_table[i];
+        if (e->valid && e->offset < offset + size &&
+            offset < e->offset + e->size) {
+            e->pending_store = -1;
+        }
+    }
+}
+
+static void mem_invalidate_all(void)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+        mem_table[i].valid = false;
+    }
+}
+
+static TCGArg *tcg_redundancy_elim(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                   TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int nb_ops, op_index, nb_temps, nb_globals, i;
+    int nb_oargs, nb_iargs, nb_call_args;
+    TCGOpcode op, ld_op;
+    const TCGOpDef *def;
+    TCGArg *gen_args, key[VN_MAX_KEY];
+    struct vn_entry *ve;
+    struct mem_entry *me;
+    tcg_target_long offset;
+    int size;
+
+    nb_temps = s->nb_temps;
+    nb_globals = s->nb_globals;
+    next_vn = 0;
+    vn_reset(nb_temps);
+
+    nb_ops = tcg_opc_ptr - s->gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = s->gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+
+        switch (op) {
+        CASE_OP_32_64(mov):
+            if (temp_vn[args[0]] == temp_vn[args[1]]) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                s->opt_cse_count++;
+#endif
+                args += 2;
+                continue;
+            }
+            if (s->temps[args[0]].type == s->temps[args[1]].type) {
+                temp_vn[args[0]] = temp_vn[args[1]];
+            } else {
+                /* truncation */
+                temp_vn[args[0]] = next_vn++;
+            }
+            break;
+
+        CASE_OP_32_64(movi):
+            memset(key, 0, sizeof(key));
+            key[0] = args[1];
+            ve = vn_lookup(op, key);
+            if (temp_vn[args[0]] == ve->vn) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                s->opt_cse_count++;
+#endif
+                args += 2;
+                continue;
+            }
+            temp_vn[args[0]] = ve->vn;
+            ve->temp = args[0];
+            break;
+
+        CASE_OP_32_64(ld8u):
+        CASE_OP_32_64(ld8s):
+        CASE_OP_32_64(ld16u):
+        CASE_OP_32_64(ld16s):
+        CASE_OP_32_64(ld):
+        case INDEX_op_ld32u_i64:
+        case INDEX_op_ld32s_i64:
+            if (!temp_is_env(s, args[1])) {
+                mem_observe_all();
+                temp_vn[args[0]] = next_vn++;
+                break;
+            }
+            offset = args[2];
+            size = mem_op_size(op);
+            me = mem_find(offset, op);
+            if (me && temp_vn[me->temp] == me->vn) {
+#ifdef CONFIG_PROFILER
+                s->opt_ld_count++;
+#endif
+                if (temp_vn[args[0]] == me->vn) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                    args += 3;
+                    continue;
+                }
+                s->gen_opc_buf[op_index] = op_to_mov(op);
+                gen_args[0] = args[0];
+                gen_args[1] = me->temp;
+                temp_vn[args[0]] = me->vn;
+                gen_args += 2;
+                args += 3;
+                continue;
+            }
+            mem_observe(offset, size);
+            if (me) {
+                /* the field still holds the value, but no temp does */
+                temp_vn[args[0]] = me->vn;
+                me->temp = args[0];
+            } else {
+                temp_vn[args[0]] = next_vn++;
+                mem_insert(offset, size, op, temp_vn[args[0]], args[0]);
+            }
+            break;
+
+        case INDEX_op_call:
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            nb_call_args = nb_oargs + nb_iargs;
+            if (!(args[nb_call_args + 1] & TCG_CALL_NO_WRITE_GLOBALS)) {
+                for (i = 0; i < nb_globals; i++) {
+                    temp_vn[i] = next_vn++;
+                }
+            }
+            for (i = 0; i < nb_oargs; i++) {
+                temp_vn[args[i + 1]] = next_vn++;
+            }
+            /* helpers may access any field of env */
+            mem_invalidate_all();
+            for (i = 0; i < nb_call_args + 3; i++) {
+                gen_args[i] = args[i];
+            }
+            args += nb_call_args + 3;
+            gen_args += nb_call_args + 3;
+            continue;
+
+        default:
+            if (op_is_store(op)) {
+                if (!temp_is_env(s, args[1])) {
+                    mem_invalidate_all();
+                    break;
+                }
+                offset = args[2];
+                size = mem_op_size(op);
+                ld_op = st_to_ld(op);
+                me = mem_find(offset, ld_op);
+                if (ld_op != INDEX_op_end && me &&
+                    me->vn == temp_vn[args[0]]) {
+                    /* the field already holds the value */
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+#ifdef CONFIG_PROFILER
+                    s->opt_st_count++;
+#endif
+                    args += 3;
+                    continue;
+                }
+                for (i = 0; i < MEM_MAX_ENTRIES; i++) {
+                    me = &mem_table[i];
+                    if (!me->valid || me->offset >= offset + size ||
+                        offset >= me->offset + me->size) {
+                        continue;
+                    }
+                    if (me->pending_store >= 0 && me->offset == offset &&
+                        me->size == size) {
+                        /* overwritten before being observed */
+                        s->gen_opc_buf[me->pending_store] = INDEX_op_nop3;
+#ifdef CONFIG_PROFILER
+                        s->opt_st_count++;
+#endif
+                    }
+                    me->valid = false;
+                }
+                me = mem_insert(offset, size, ld_op, temp_vn[args[0]],
+                                args[0]);
+                me->pending_store = op_index;
+                break;
+            }
+            if (def->flags & TCG_OPF_BB_END) {
+                if (op_is_cond_branch(op)) {
+                    /* the fall-through only loses the normal temps */
+                    vn_kill_normal_temps(s);
+                    mem_observe_all();
+                } else {
+                    vn_reset(nb_temps);
+                }
+                break;
+            }
+            if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                /* the slow path of qemu_ld/st calls helpers, which may
+                   access any field of env, and may fault and leave the TB */
+                mem_invalidate_all();
+            } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+                mem_observe_all();
+            }
+            if (def->nb_oargs == 1 && def->nb_args <= VN_MAX_KEY + 1 &&
+                !(def->flags & (TCG_OPF_SIDE_EFFECTS | TCG_OPF_CALL_CLOBBER |
+                                TCG_OPF_NOT_PRESENT))) {
+                memset(key, 0, sizeof(key));
+                for (i = 0; i < def->nb_iargs; i++) {
+                    key[i] = temp_vn[args[1 + i]];
+                }
+                for (i = 0; i < def->nb_cargs; i++) {
+                    key[def->nb_iargs + i] = args[1 + def->nb_iargs + i];
+                }
+                if (op_is_commutative(op) && key[0] > key[1]) {
+                    TCGArg t = key[0];
+                    key[0] = key[1];
+                    key[1] = t;
+                }
+                ve = vn_lookup(op, key);
+                if (ve->temp != (TCGArg)-1 && temp_vn[ve->temp] == ve->vn) {
+#ifdef CONFIG_PROFILER
+                    s->opt_cse_count++;
+#endif
+                    if (temp_vn[args[0]] == ve->vn) {
+                        s->gen_opc_buf[op_index] = INDEX_op_nop;
+                    } else {
+                        s->gen_opc_buf[op_index] = op_to_mov(op);
+                        gen_args[0] = args[0];
+                        gen_args[1] = ve->temp;
+                        temp_vn[args[0]] = ve->vn;
+                        gen_args += 2;
+                    }
+                    args += def->nb_args;
+                    continue;
+                }
+                temp_vn[args[0]] = ve->vn;
+                ve->temp = args[0];
+                break;
+            }
+            for (i = 0; i < def->nb_oargs; i++) {
+                temp_vn[args[i]] = next_vn++;
+            }
+            break;
+        }
+
+        for (i = 0; i < def->nb_args; i++) {
+            gen_args[i] = args[i];
+        }
+        args += def->nb_args;
+        gen_args += def->nb_args;
+    }
+
+    return gen_args;
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+#ifdef CONFIG_PROFILER
+    if (s->measure_unopt) {
+        return res;
+    }
+#endif
+    res = tcg_redundancy_elim(s, tcg_opc_ptr, args, tcg_op_defs);
     return res;
 }
@@ -0,0 +1,251 @@
+/*
+ * Lazy condition code evaluation for Tiny Code Generator front ends
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef TCG_CC_H
+#define TCG_CC_H
+
+/* Must be included after tcg-op.h.  */
+
+/* Front ends with N, Z, C and V flags usually keep the result and the
+ * operands of the last flag-setting instruction (the producer) instead of
+ * the flags, and compute the flags with a helper when an instruction needs
+ * them (the consumer).  Most consumers are conditional branches and set
+ * instructions whose condition can be answered with a single comparison
+ * of the saved values.
+ *
+ * A front end declares, for each of its CC_OP values, which kind of
+ * producer it is with a TCGCCProducer table, and at a consumer calls
+ * tcg_cc_compare().  When that returns false the condition needs flags
+ * that cannot be derived cheaply, and the front end computes them as
+ * before.
+ */
+
+typedef enum TCGCCOp {
+    TCG_CC_OP_NONE = 0,  /* flags must be computed */
+    TCG_CC_OP_LOGIC,     /* N and Z from res, C = V = 0 */
+    TCG_CC_OP_ADD,       /* res = src1 + src2 */
+    TCG_CC_OP_SUB,       /* res = src1 - src2, C is the borrow */
+} TCGCCOp;
+
+typedef struct TCGCCProducer {
+    TCGCCOp op;
+    /* width of the operation, at most TARGET_LONG_BITS; 0 means the
+       whole register */
+    int bits;
+} TCGCCProducer;
+
+/* The conditions, in the m68k encoding.  */
+typedef enum TCGCCCond {
+    TCG_CC_T,
+    TCG_CC_F,
+    TCG_CC_HI,  /* !C && !Z */
+    TCG_CC_LS,  /* C || Z */
+    TCG_CC_CC,  /* !C */
+    TCG_CC_CS,  /* C */
+    TCG_CC_NE,  /* !Z */
+    TCG_CC_EQ,  /* Z */
+    TCG_CC_VC,  /* !V */
+    TCG_CC_VS,  /* V */
+    TCG_CC_PL,  /* !N */
+    TCG_CC_MI,  /* N */
+    TCG_CC_GE,  /* !(N ^ V) */
+    TCG_CC_LT,  /* N ^ V */
+    TCG_CC_GT,  /* !Z && !(N ^ V) */
+    TCG_CC_LE,  /* Z || (N ^ V) */
+} TCGCCCond;
+
+/* The condition holds iff "c1 cond c2".  c1 and c2 must be freed with
+   tcg_cc_compare_free().  */
+typedef struct TCGCCCompare {
+    TCGCond cond;
+    TCGv c1, c2;
+    bool g1, g2;  /* c1, c2 belong to the caller */
+} TCGCCCompare;
+
+/* Extend VAL from BITS to the full register; *G tells whether the
+   result is VAL itself.  */
+static inline TCGv tcg_cc_ext(TCGv val, int bits, bool sign, bool *g)
+{
+    TCGv t;
+
+    if (bits == 0 || bits == TARGET_LONG_BITS) {
+        *g = true;
+        return val;
+    }
+    t = tcg_temp_new();
+    switch (bits) {
+    case 8:
+        if (sign) {
+            tcg_gen_ext8s_tl(t, val);
+        } else {
+            tcg_gen_ext8u_tl(t, val);
+        }
+        break;
+    case 16:
+        if (sign) {
+            tcg_gen_ext16s_tl(t, val);
+        } else {
+            tcg_gen_ext16u_tl(t, val);
+        }
+        break;
+    default:
+        if (sign) {
+            tcg_gen_ext32s_tl(t, val);
+        } else {
+            tcg_gen_ext32u_tl(t, val);
+        }
+        break;
+    }
+    *g = false;
+    return t;
+}
+
+static inline void tcg_cc_compare_res(TCGCCCompare *cmp, TCGCond cond,
+                                      int bits, TCGv res)
+{
+    if (cond == TCG_COND_ALWAYS || cond == TCG_COND_NEVER) {
+        bits = 0;
+    }
+    cmp->cond = cond;
+    cmp->c1 = tcg_cc_ext(res, bits, !(cond == TCG_COND_EQ ||
+                                      cond == TCG_COND_NE), &cmp->g1);
+    cmp->c2 = tcg_const_tl(0);
+    cmp->g2 = false;
+}
+
+/* Turn condition COND on the flags set by producer P into a comparison.
+   RES, SRC1 and SRC2 are the values the producer saved; SRC1 may be unused
+   (TCGV_UNUSED) and is then recomputed from RES and SRC2.  */
+static inline bool tcg_cc_compare(TCGCCCompare *cmp, const TCGCCProducer *p,
+                                  TCGCCCond cond, TCGv res, TCGv src1,
+                                  TCGv src2)
+{
+    static const TCGCond logic_cond[16] = {
+        [TCG_CC_T] = TCG_COND_ALWAYS,
+        [TCG_CC_F] = TCG_COND_NEVER,
+        [TCG_CC_HI] = TCG_COND_NE,
+        [TCG_CC_LS] = TCG_COND_EQ,
+        [TCG_CC_CC] = TCG_COND_ALWAYS,
+        [TCG_CC_CS] = TCG_COND_NEVER,
+        [TCG_CC_NE] = TCG_COND_NE,
+        [TCG_CC_EQ] = TCG_COND_EQ,
+        [TCG_CC_VC] = TCG_COND_ALWAYS,
+        [TCG_CC_VS] = TCG_COND_NEVER,
+        [TCG_CC_PL] = TCG_COND_GE,
+        [TCG_CC_MI] = TCG_COND_LT,
+        [TCG_CC_GE] = TCG_COND_GE,
+        [TCG_CC_LT] = TCG_COND_LT,
+        [TCG_CC_GT] = TCG_COND_GT,
+        [TCG_CC_LE] = TCG_COND_LE,
+    };
+    static const TCGCond sub_cond[16] = {
+        [TCG_CC_HI] = TCG_COND_GTU,
+        [TCG_CC_LS] = TCG_COND_LEU,
+        [TCG_CC_CC] = TCG_COND_GEU,
+        [TCG_CC_CS] = TCG_COND_LTU,
+        [TCG_CC_GE] = TCG_COND_GE,
+        [TCG_CC_LT] = TCG_COND_LT,
+        [TCG_CC_GT] = TCG_COND_GT,
+        [TCG_CC_LE] = TCG_COND_LE,
+    };
+    TCGCond c;
+    TCGv a;
+    bool sign;
+
+    switch (p->op) {
+    case TCG_CC_OP_LOGIC:
+        tcg_cc_compare_res(cmp, logic_cond[cond], p->bits, res);
+        goto done;
+    case TCG_CC_OP_ADD:
+    case TCG_CC_OP_SUB:
+        switch (cond) {
+        case TCG_CC_T:
+        case TCG_CC_F:
+        case TCG_CC_NE:
+        case TCG_CC_EQ:
+        case TCG_CC_PL:
+        case TCG_CC_MI:
+            tcg_cc_compare_res(cmp, logic_cond[cond], p->bits, res);
+            goto done;
+        default:
+            break;
+        }
+        break;
+    default:
+        goto fail;
+    }
+
+    if (p->op == TCG_CC_OP_ADD) {
+        /* carry out iff the result wrapped below either operand */
+        if (cond != TCG_CC_CC && cond != TCG_CC_CS) {
+            goto fail;
+        }
+        cmp->cond = cond == TCG_CC_CS ? TCG_COND_LTU : TCG_COND_GEU;
+        cmp->c1 = tcg_cc_ext(res, p->bits, false, &cmp->g1);
+        cmp->c2 = tcg_cc_ext(src2, p->bits, false, &cmp->g2);
+        goto done;
+    }
+
+    /* the flags of a subtraction compare its operands */
+    c = sub_cond[cond];
+    if (c == 0) {
+        goto fail;
+    }
+    sign = !is_unsigned_cond(c);
+    if (TCGV_IS_UNUSED(src1)) {
+        a = tcg_temp_new();
+        tcg_gen_add_tl(a, res, src2);
+        cmp->c1 = tcg_cc_ext(a, p->bits, sign, &cmp->g1);
+        if (cmp->g1) {
+            cmp->g1 = false;
+        } else {
+            tcg_temp_free(a);
+        }
+    } else {
+        cmp->c1 = tcg_cc_ext(src1, p->bits, sign, &cmp->g1);
+    }
+    cmp->c2 = tcg_cc_ext(src2, p->bits, sign, &cmp->g2);
+    cmp->cond = c;
+
+done:
+#ifdef CONFIG_PROFILER
+    tcg_ctx.cc_lazy_count++;
+#endif
+    return true;
+
+fail:
+#ifdef CONFIG_PROFILER
+    tcg_ctx.cc_flush_count++;
+#endif
+    return false;
+}
+
+static inline void tcg_cc_compare_free(TCGCCCompare *cmp)
+{
+    if (!cmp->g1) {
+        tcg_temp_free(cmp->c1);
+    }
+    if (!cmp->g2) {
+        tcg_temp_free(cmp->c2);
+    }
+}
+
+#endif /* TCG_CC_H */
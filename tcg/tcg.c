@@ -2234,6 +2234,15 @@ static void dump_op_count(void)
 #endif
 
 
+static inline bool tcg_measuring(TCGContext *s)
+{
+#ifdef CONFIG_PROFILER
+    return s->measure_unopt;
+#else
+    return false;
+#endif
+}
+
 static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
                                       long search_pc)
 {
@@ -2243,7 +2252,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     const TCGArg *args;
 
 #ifdef DEBUG_DISAS
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP)) && !tcg_measuring(s)) {
         qemu_log("OP:\n");
         tcg_dump_ops(s);
         qemu_log("\n");
@@ -2271,7 +2280,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
 
 #ifdef DEBUG_DISAS
-    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT)) && !tcg_measuring(s)) {
         qemu_log("OP after optimization and liveness analysis:\n");
         tcg_dump_ops(s);
         qemu_log("\n");
@@ -2289,7 +2298,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     for(;;) {
         opc = s->gen_opc_buf[op_index];
 #ifdef CONFIG_PROFILER
-        tcg_table_op_count[opc]++;
+        if (!s->measure_unopt) {
+            tcg_table_op_count[opc]++;
+        }
 #endif
         def = &tcg_op_defs[opc];
 #if 0
@@ -2363,6 +2374,42 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     return -1;
 }
 
+#ifdef CONFIG_PROFILER
+/* Generate the code once without redundancy elimination, to measure how
+   much it saves, then put back the ops and labels as they were.  */
+static void tcg_measure_unopt(TCGContext *s, uint8_t *gen_code_buf)
+{
+    int nb_ops = s->gen_opc_ptr - s->gen_opc_buf + 1; /* with op_end */
+    int nb_params = s->gen_opparam_ptr - s->gen_opparam_buf;
+    uint16_t *opc = tcg_malloc(nb_ops * sizeof(uint16_t));
+    TCGArg *params = tcg_malloc(nb_params * sizeof(TCGArg));
+    int64_t del_op_count = s->del_op_count;
+    int i;
+
+    memcpy(opc, s->gen_opc_buf, nb_ops * sizeof(uint16_t));
+    memcpy(params, s->gen_opparam_buf, nb_params * sizeof(TCGArg));
+
+    s->measure_unopt = true;
+    tcg_gen_code_common(s, gen_code_buf, -1);
+    s->measure_unopt = false;
+    s->code_out_len_unopt += s->code_ptr - gen_code_buf;
+    /* the ops deleted by liveness analysis are counted by the real pass */
+    s->del_op_count = del_op_count;
+
+    memcpy(s->gen_opc_buf, opc, nb_ops * sizeof(uint16_t));
+    memcpy(s->gen_opparam_buf, params, nb_params * sizeof(TCGArg));
+    s->gen_opc_ptr = s->gen_opc_buf + nb_ops - 1;
+    s->gen_opparam_ptr = s->gen_opparam_buf + nb_params;
+    for (i = 0; i < s->nb_labels; i++) {
+        s->labels[i].has_value = 0;
+        s->labels[i].u.first_reloc = NULL;
+    }
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+    s->nb_qemu_ldst_labels = 0;
+#endif
+}
+#endif
+
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
 {
 #ifdef CONFIG_PROFILER
@@ -2377,6 +2424,7 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
         if (s->nb_temps > s->temp_count_max)
             s->temp_count_max = s->nb_temps;
     }
+    tcg_measure_unopt(s, gen_code_buf);
 #endif
 
     tcg_gen_code_common(s, gen_code_buf, -1);
@@ -2415,6 +2463,20 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "redundant ops/TB    ld %0.2f st %0.2f cse %0.2f\n",
+                s->tb_count ? (double)s->opt_ld_count / s->tb_count : 0,
+                s->tb_count ? (double)s->opt_st_count / s->tb_count : 0,
+                s->tb_count ? (double)s->opt_cse_count / s->tb_count : 0);
+    cpu_fprintf(f, "host bytes saved    %" PRId64 " (%0.1f%%)\n",
+                s->code_out_len_unopt - s->code_out_len,
+                s->code_out_len_unopt ?
+                (double)(s->code_out_len_unopt - s->code_out_len) /
+                s->code_out_len_unopt * 100.0 : 0);
+    cpu_fprintf(f, "lazy cc tests       %" PRId64 " (%0.1f%% flushed)\n",
+                s->cc_lazy_count + s->cc_flush_count,
+                s->cc_lazy_count + s->cc_flush_count ?
+                (double)s->cc_flush_count /
+                (s->cc_lazy_count + s->cc_flush_count) * 100.0 : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -46,6 +46,17 @@ typedef uint64_t tcg_target_ulong;
 #error unsupported
 #endif
 
+/* Memory orderings between plain guest accesses.  A host backend defines
+   TCG_TARGET_DEFAULT_MO as the set its ordinary loads and stores already
+   guarantee; a guest defines TCG_GUEST_DEFAULT_MO as the set its ordinary
+   loads and stores require.  Multi-threaded TCG is only allowed when the
+   host provides every ordering the guest needs.  */
+#define TCG_MO_LD_LD    0x01
+#define TCG_MO_ST_LD    0x02
+#define TCG_MO_LD_ST    0x04
+#define TCG_MO_ST_ST    0x08
+#define TCG_MO_ALL      0x0f
+
 #include "tcg-target.h"
 #include "tcg-runtime.h"
 
@@ -457,6 +468,15 @@ struct TCGContext {
     int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
+    /* ops removed by redundancy elimination, and host code size without it */
+    int64_t opt_ld_count;
+    int64_t opt_st_count;
+    int64_t opt_cse_count;
+    int64_t code_out_len_unopt;
+    bool measure_unopt;
+    /* flag consumers answered from the lazy state, and ones that were not */
+    int64_t cc_lazy_count;
+    int64_t cc_flush_count;
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -0,0 +1,491 @@
+/*
+ * Coroutine backend benchmarks
+ *
+ * The same workloads are linked against every coroutine backend that can be
+ * built on the host (see tests/Makefile), so that backends can be compared
+ * with realistic call depths rather than just micro-benchmarks.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "block/coroutine.h"
+#include "block/block.h"
+
+static const char *backend;
+
+static void report(const char *name, double value, const char *unit)
+{
+    printf("%-12s %-28s %12.1f %s\n", backend, name, value, unit);
+}
+
+/*
+ * Create, enter and terminate an empty coroutine
+ */
+
+static void coroutine_fn empty_coroutine(void *opaque)
+{
+    /* Do nothing */
+}
+
+static void bench_create(void)
+{
+    unsigned int i, max = 1000000;
+    int64_t start;
+
+    start = get_clock();
+    for (i = 0; i < max; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(empty_coroutine), NULL);
+    }
+    report("create", (double)(get_clock() - start) / max, "ns/op");
+}
+
+/*
+ * One yield and one re-enter
+ */
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while (*counter > 0) {
+        (*counter)--;
+        qemu_coroutine_yield();
+    }
+}
+
+static void bench_yield(void)
+{
+    unsigned int i, max = 10000000;
+    Coroutine *co;
+    int64_t start;
+
+    i = max;
+    co = qemu_coroutine_create(yield_loop);
+    start = get_clock();
+    while (i > 0) {
+        qemu_coroutine_enter(co, &i);
+    }
+    report("yield+enter", (double)(get_clock() - start) / max, "ns/op");
+}
+
+/*
+ * Nested coroutine_fn calls inside a single coroutine
+ */
+
+enum {
+    NESTED_DEPTH = 64,
+};
+
+static int coroutine_fn nested_call(int depth)
+{
+    if (depth == 0) {
+        return 0;
+    }
+    return nested_call(depth - 1) + 1;
+}
+
+static void coroutine_fn nested_loop(void *opaque)
+{
+    unsigned int *counter = opaque;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < *counter; i++) {
+        ret = nested_call(NESTED_DEPTH);
+        g_assert_cmpint(ret, ==, NESTED_DEPTH);
+    }
+}
+
+static void bench_nested_call(void)
+{
+    unsigned int max = 100000;
+    int64_t start;
+
+    start = get_clock();
+    qemu_coroutine_enter(qemu_coroutine_create(nested_loop), &max);
+    report("nested call",
+           (double)(get_clock() - start) / max / NESTED_DEPTH, "ns/call");
+}
+
+/*
+ * Contended CoMutex handoff
+ *
+ * Each round, A takes the lock and yields, B blocks on it, and A unlocks,
+ * which hands the lock over to B.
+ */
+
+typedef struct {
+    CoMutex mutex;
+    bool stop;
+} MutexData;
+
+static void coroutine_fn mutex_holder(void *opaque)
+{
+    MutexData *data = opaque;
+
+    while (!data->stop) {
+        qemu_co_mutex_lock(&data->mutex);
+        qemu_coroutine_yield();
+        qemu_co_mutex_unlock(&data->mutex);
+        qemu_coroutine_yield();
+    }
+}
+
+static void coroutine_fn mutex_waiter(void *opaque)
+{
+    MutexData *data = opaque;
+
+    while (!data->stop) {
+        qemu_co_mutex_lock(&data->mutex);
+        qemu_co_mutex_unlock(&data->mutex);
+        qemu_coroutine_yield();
+    }
+}
+
+static void bench_comutex(void)
+{
+    unsigned int i, max = 1000000;
+    MutexData data = { .stop = false };
+    Coroutine *a, *b;
+    int64_t start;
+
+    qemu_co_mutex_init(&data.mutex);
+    a = qemu_coroutine_create(mutex_holder);
+    b = qemu_coroutine_create(mutex_waiter);
+
+    start = get_clock();
+    for (i = 0; i < max; i++) {
+        qemu_coroutine_enter(a, &data);
+        qemu_coroutine_enter(b, &data);
+        qemu_coroutine_enter(a, &data);
+    }
+    report("CoMutex handoff", (double)(get_clock() - start) / max, "ns/op");
+
+    /* A is waiting to take the lock again and B is idle; let both exit */
+    data.stop = true;
+    qemu_coroutine_enter(a, &data);
+    qemu_coroutine_enter(b, &data);
+}
+
+/*
+ * CoQueue handoff from outside coroutine context
+ */
+
+enum {
+    QUEUE_WAITERS = 16,
+};
+
+typedef struct {
+    CoQueue queue;
+    unsigned int wakeups;
+    bool stop;
+} QueueData;
+
+static void coroutine_fn queue_waiter(void *opaque)
+{
+    QueueData *data = opaque;
+
+    while (!data->stop) {
+        qemu_co_queue_wait(&data->queue);
+        data->wakeups++;
+    }
+}
+
+static void bench_coqueue(void)
+{
+    unsigned int i, max = 1000000;
+    QueueData data = { .wakeups = 0, .stop = false };
+    int64_t start;
+
+    qemu_co_queue_init(&data.queue);
+    for (i = 0; i < QUEUE_WAITERS; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(queue_waiter), &data);
+    }
+
+    start = get_clock();
+    for (i = 0; i < max; i++) {
+        qemu_co_enter_next(&data.queue);
+    }
+    report("CoQueue handoff", (double)(get_clock() - start) / max, "ns/op");
+    g_assert_cmpint(data.wakeups, ==, max);
+
+    data.stop = true;
+    while (qemu_co_enter_next(&data.queue)) {
+        /* Let every waiter terminate */
+    }
+}
+
+/*
+ * Resident memory of live (yielded) coroutines
+ */
+
+enum {
+    LIVE_COROUTINES = 10000,
+};
+
+static long resident_bytes(void)
+{
+    long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f) {
+        return -1;
+    }
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(f);
+    return resident < 0 ? -1 : resident * getpagesize();
+}
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void bench_memory(void)
+{
+    Coroutine **co = g_new(Coroutine *, LIVE_COROUTINES);
+    long before, after;
+    int i;
+
+    before = resident_bytes();
+    for (i = 0; i < LIVE_COROUTINES; i++) {
+        co[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    after = resident_bytes();
+
+    if (before >= 0 && after >= 0) {
+        report("RSS per 10k live", (after - before) / 1024.0, "KiB");
+    }
+
+    for (i = 0; i < LIVE_COROUTINES; i++) {
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    g_free(co);
+}
+
+/*
+ * Request/response over a socketpair with qemu_co_sendv_recvv(), going
+ * through a couple of layers the way the NBD client does
+ */
+
+enum {
+    SOCKET_REQUEST_SIZE = 512,
+    SOCKET_REPLY_SIZE = 4096,
+};
+
+typedef struct {
+    int fd;
+    unsigned int requests;
+    bool done;
+    char buf[SOCKET_REPLY_SIZE];
+} SocketData;
+
+static ssize_t coroutine_fn socket_co_transfer(int fd, void *buf, size_t len,
+                                               bool do_send)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return qemu_co_sendv_recvv(fd, &iov, 1, 0, len, do_send);
+}
+
+static int coroutine_fn socket_co_request(SocketData *s)
+{
+    if (socket_co_transfer(s->fd, s->buf, SOCKET_REQUEST_SIZE, true) !=
+        SOCKET_REQUEST_SIZE) {
+        return -EIO;
+    }
+    if (socket_co_transfer(s->fd, s->buf, SOCKET_REPLY_SIZE, false) !=
+        SOCKET_REPLY_SIZE) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int coroutine_fn socket_co_serve(SocketData *s)
+{
+    if (socket_co_transfer(s->fd, s->buf, SOCKET_REQUEST_SIZE, false) !=
+        SOCKET_REQUEST_SIZE) {
+        return -EIO;
+    }
+    if (socket_co_transfer(s->fd, s->buf, SOCKET_REPLY_SIZE, true) !=
+        SOCKET_REPLY_SIZE) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void coroutine_fn socket_client(void *opaque)
+{
+    SocketData *s = opaque;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < s->requests; i++) {
+        ret = socket_co_request(s);
+        g_assert_cmpint(ret, ==, 0);
+    }
+    s->done = true;
+}
+
+static void coroutine_fn socket_server(void *opaque)
+{
+    SocketData *s = opaque;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < s->requests; i++) {
+        ret = socket_co_serve(s);
+        g_assert_cmpint(ret, ==, 0);
+    }
+    s->done = true;
+}
+
+static void bench_socket(void)
+{
+    unsigned int max = 100000;
+    SocketData client = { .requests = max }, server = { .requests = max };
+    Coroutine *client_co, *server_co;
+    int fds[2];
+    int64_t start;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return;
+    }
+    qemu_set_nonblock(fds[0]);
+    qemu_set_nonblock(fds[1]);
+    client.fd = fds[0];
+    server.fd = fds[1];
+
+    client_co = qemu_coroutine_create(socket_client);
+    server_co = qemu_coroutine_create(socket_server);
+
+    /* Both sides yield on EAGAIN, so just alternate between them */
+    start = get_clock();
+    while (!client.done || !server.done) {
+        if (!client.done) {
+            qemu_coroutine_enter(client_co, &client);
+        }
+        if (!server.done) {
+            qemu_coroutine_enter(server_co, &server);
+        }
+    }
+    report("sendv_recvv request", (double)(get_clock() - start) / max,
+           "ns/op");
+
+    closesocket(fds[0]);
+    closesocket(fds[1]);
+}
+
+/*
+ * Reads from a raw image through the whole block layer
+ */
+
+enum {
+    BDRV_IMAGE_SIZE = 64 * 1024 * 1024,
+    BDRV_REQUEST_SECTORS = 8,
+    BDRV_READERS = 16,
+};
+
+typedef struct {
+    BlockDriverState *bs;
+    unsigned int requests;
+    unsigned int running;
+    int64_t next_sector;
+} BdrvData;
+
+static void coroutine_fn bdrv_reader(void *opaque)
+{
+    BdrvData *data = opaque;
+    int64_t nb_sectors = BDRV_IMAGE_SIZE / BDRV_SECTOR_SIZE;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    int ret;
+
+    buf = qemu_blockalign(data->bs, BDRV_REQUEST_SECTORS * BDRV_SECTOR_SIZE);
+    iov.iov_base = buf;
+    iov.iov_len = BDRV_REQUEST_SECTORS * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    while (data->requests > 0) {
+        int64_t sector = data->next_sector;
+
+        data->requests--;
+        data->next_sector = (sector + BDRV_REQUEST_SECTORS) % nb_sectors;
+        ret = bdrv_co_readv(data->bs, sector, BDRV_REQUEST_SECTORS, &qiov);
+        g_assert_cmpint(ret, ==, 0);
+    }
+
+    qemu_vfree(buf);
+    data->running--;
+}
+
+static void bench_bdrv(void)
+{
+    char filename[] = "/tmp/bench-coroutine.XXXXXX";
+    unsigned int i, max = 200000;
+    BdrvData data = { .requests = max, .running = BDRV_READERS };
+    int64_t start;
+    int fd;
+
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        return;
+    }
+    if (ftruncate(fd, BDRV_IMAGE_SIZE) < 0) {
+        close(fd);
+        unlink(filename);
+        return;
+    }
+    close(fd);
+
+    data.bs = bdrv_new("bench");
+    if (bdrv_sync_open(data.bs, filename, NULL, BDRV_O_RDWR,
+                       bdrv_find_format("raw")) < 0) {
+        bdrv_sync_delete(data.bs);
+        unlink(filename);
+        return;
+    }
+
+    start = get_clock();
+    for (i = 0; i < BDRV_READERS; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(bdrv_reader), &data);
+    }
+    while (data.running > 0) {
+        qemu_aio_wait();
+    }
+    report("bdrv_co_readv 4k", (double)(get_clock() - start) / max,
+           "ns/op");
+
+    bdrv_sync_delete(data.bs);
+    unlink(filename);
+}
+
+int main(int argc, char **argv)
+{
+    backend = strrchr(argv[0], '-');
+    backend = backend ? backend + 1 : argv[0];
+
+    qemu_init_main_loop();
+    bdrv_init();
+
+    bench_create();
+    bench_yield();
+    bench_nested_call();
+    bench_comutex();
+    bench_coqueue();
+    bench_memory();
+    bench_socket();
+    bench_bdrv();
+    return 0;
+}
@@ -18,6 +18,7 @@
 
 import os
 import re
+import socket
 import subprocess
 import string
 import unittest
@@ -67,16 +68,46 @@ def create_image(name, size):
         i = i + 512
     file.close()
 
+class QtestSocket(object):
+    '''The qtest protocol over a UNIX socket that QEMU connects to'''
+
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.bind(path)
+        self._sock.listen(1)
+        self._sockfile = None
+
+    def accept(self):
+        sock, _ = self._sock.accept()
+        self._sock.close()
+        self._sock = sock
+        self._sockfile = self._sock.makefile('r')
+
+    def cmd(self, qtest_cmd):
+        '''Send a qtest command and return the response line'''
+        self._sock.sendall(qtest_cmd + '\n')
+        return self._sockfile.readline().strip()
+
+    def close(self):
+        if self._sockfile is not None:
+            self._sockfile.close()
+        self._sock.close()
+
 class VM(object):
     '''A QEMU VM'''
 
-    def __init__(self):
-        self._monitor_path = os.path.join(test_dir, 'qemu-mon.%d' % os.getpid())
-        self._qemu_log_path = os.path.join(test_dir, 'qemu-log.%d' % os.getpid())
+    def __init__(self, path_suffix=''):
+        self._monitor_path = os.path.join(test_dir, 'qemu-mon%s.%d' %
+                                          (path_suffix, os.getpid()))
+        self._qtest_path = os.path.join(test_dir, 'qemu-qtest%s.%d' %
+                                        (path_suffix, os.getpid()))
+        self._qemu_log_path = os.path.join(test_dir, 'qemu-log%s.%d' %
+                                           (path_suffix, os.getpid()))
         self._args = qemu_args + ['-chardev',
                      'socket,id=mon,path=' + self._monitor_path,
                      '-mon', 'chardev=mon,mode=control',
-                     '-qtest', 'stdio', '-machine', 'accel=qtest',
+                     '-qtest', 'unix:path=' + self._qtest_path,
+                     '-machine', 'accel=qtest',
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
 
@@ -95,6 +126,12 @@ class VM(object):
         self._num_drives += 1
         return self
 
+    def add_incoming(self, addr):
+        '''Wait for an incoming migration on addr'''
+        self._args.append('-incoming')
+        self._args.append(addr)
+        return self
+
     def hmp_qemu_io(self, drive, cmd):
         '''Write to a given drive using an HMP command'''
         return self.qmp('human-monitor-command',
@@ -118,11 +155,15 @@ class VM(object):
         qemulog = open(self._qemu_log_path, 'wb')
         try:
             self._qmp = qmp.QEMUMonitorProtocol(self._monitor_path, server=True)
+            self._qtest = QtestSocket(self._qtest_path)
             self._popen = subprocess.Popen(self._args, stdin=devnull, stdout=qemulog,
                                            stderr=subprocess.STDOUT)
             self._qmp.accept()
+            self._qtest.accept()
         except:
             os.remove(self._monitor_path)
+            if os.path.exists(self._qtest_path):
+                os.remove(self._qtest_path)
             raise
 
     def shutdown(self):
@@ -130,7 +171,9 @@ class VM(object):
         if not self._popen is None:
             self._qmp.cmd('quit')
             self._popen.wait()
+            self._qtest.close()
             os.remove(self._monitor_path)
+            os.remove(self._qtest_path)
             os.remove(self._qemu_log_path)
             self._popen = None
 
@@ -143,6 +186,10 @@ class VM(object):
 
         return self._qmp.cmd(cmd, args=qmp_args)
 
+    def qtest(self, cmd):
+        '''Send a qtest command, e.g. to access guest memory'''
+        return self._qtest.cmd(cmd)
+
     def get_qmp_event(self, wait=False):
         '''Poll for one queued QMP events and return it'''
         return self._qmp.pull_event(wait=wait)
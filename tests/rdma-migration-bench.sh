@@ -0,0 +1,153 @@
+#!/bin/sh
+#
+# RDMA migration throughput and CPU usage benchmark
+#
+# Migrates a guest between two QEMU processes on this host over x-rdma:, once
+# for each combination of the x-rdma-pin-all and x-rdma-pipeline
+# capabilities, and reports the migration time and throughput together with
+# the CPU time used by the source and the destination.
+#
+# Without RDMA hardware, set RXE_NETDEV to an Ethernet interface with an IPv4
+# address and run as root: a soft-RoCE (rdma_rxe) link is then attached to it
+# for the duration of the benchmark and both QEMUs talk to each other through
+# it.  Otherwise, set RDMA_ADDR to the address of an existing RDMA link.
+#
+# Environment:
+#   QEMU        system emulator (default: x86_64-softmmu/qemu-system-x86_64)
+#   RDMA_ADDR   local IPv4 address of the RDMA link
+#   RDMA_PORT   first port to use (default: 4444)
+#   RXE_NETDEV  interface to attach a soft-RoCE link to
+#   GUEST_ARGS  guest options (default: -m 1024).  An idle guest mostly has
+#               zero pages; boot an image that dirties its memory (see the
+#               "stress" example in docs/rdma.txt) for meaningful numbers.
+#   WARMUP      seconds the guest runs before migrating (default: 10)
+#   SPEED       migrate_set_speed value (default: 100g)
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+
+QEMU=${QEMU:-x86_64-softmmu/qemu-system-x86_64}
+RDMA_PORT=${RDMA_PORT:-4444}
+GUEST_ARGS=${GUEST_ARGS:--m 1024}
+WARMUP=${WARMUP:-10}
+SPEED=${SPEED:-100g}
+
+die() {
+    echo "$0: $*" >&2
+    exit 1
+}
+
+command -v socat >/dev/null || die "socat is needed to talk to the monitors"
+[ -x "$QEMU" ] || die "cannot run $QEMU, set QEMU"
+
+tmp=$(mktemp -d) || exit 1
+rxe_link=
+cleanup() {
+    for pid in $src_pid $dst_pid; do
+        kill $pid 2>/dev/null
+    done
+    wait 2>/dev/null
+    [ -n "$rxe_link" ] && rdma link delete "$rxe_link"
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if [ -n "$RXE_NETDEV" ]; then
+    modprobe rdma_rxe || die "cannot load rdma_rxe"
+    rdma link add rxe_bench type rxe netdev "$RXE_NETDEV" ||
+        die "cannot attach soft-RoCE to $RXE_NETDEV"
+    rxe_link=rxe_bench
+    RDMA_ADDR=${RDMA_ADDR:-$(ip -4 -o addr show dev "$RXE_NETDEV" |
+                             awk '{ sub("/.*", "", $4); print $4; exit }')}
+fi
+[ -n "$RDMA_ADDR" ] || die "set RDMA_ADDR or RXE_NETDEV"
+
+# hmp SOCKET COMMAND: run a monitor command and print its output
+hmp() {
+    echo "$2" | socat - "UNIX-CONNECT:$1" | tr -d '\r' |
+        grep -v '^QEMU .* monitor\|^(qemu)'
+}
+
+# wait_socket SOCKET: wait until the monitor accepts connections
+wait_socket() {
+    i=0
+    until [ -S "$1" ] && hmp "$1" "" >/dev/null 2>&1; do
+        i=$((i + 1))
+        [ $i -lt 100 ] || die "QEMU did not start"
+        sleep 0.1
+    done
+}
+
+# cpu_ticks PID: user and system time of a process, in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# field OUTPUT NAME: value of a "name: value unit" line of info migrate
+field() {
+    echo "$1" | sed -n "s/^$2: *\([0-9.]*\).*/\1/p"
+}
+
+hz=$(getconf CLK_TCK)
+port=$RDMA_PORT
+
+printf "%-8s %-8s %10s %12s %10s %10s %8s %8s\n" \
+    pin-all pipeline "time (ms)" "ram (MB)" "Mbps" "down (ms)" "src CPU" \
+    "dst CPU"
+
+for pin_all in off on; do
+    for pipeline in off on; do
+        uri=x-rdma:$RDMA_ADDR:$port
+        port=$((port + 1))
+
+        $QEMU $GUEST_ARGS -display none -incoming "$uri" \
+            -monitor "unix:$tmp/dst.sock,server,nowait" &
+        dst_pid=$!
+        $QEMU $GUEST_ARGS -display none \
+            -monitor "unix:$tmp/src.sock,server,nowait" &
+        src_pid=$!
+        wait_socket "$tmp/dst.sock"
+        wait_socket "$tmp/src.sock"
+        sleep "$WARMUP"
+
+        hmp "$tmp/src.sock" "migrate_set_capability x-rdma-pin-all $pin_all"
+        hmp "$tmp/src.sock" "migrate_set_capability x-rdma-pipeline $pipeline"
+        hmp "$tmp/src.sock" "migrate_set_speed $SPEED"
+
+        src_cpu=$(cpu_ticks $src_pid)
+        dst_cpu=$(cpu_ticks $dst_pid)
+        hmp "$tmp/src.sock" "migrate -d $uri"
+
+        while :; do
+            info=$(hmp "$tmp/src.sock" "info migrate")
+            case $info in
+            *"Migration status: completed"*) break ;;
+            *"Migration status: failed"*|*"Migration status: cancelled"*)
+                die "migration with pin-all $pin_all," \
+                    "pipeline $pipeline failed" ;;
+            esac
+            sleep 0.1
+        done
+
+        src_cpu=$(($(cpu_ticks $src_pid) - src_cpu))
+        dst_cpu=$(($(cpu_ticks $dst_pid) - dst_cpu))
+        total=$(field "$info" "total time")
+        ram=$(field "$info" "transferred ram")
+        mbps=$(field "$info" "throughput")
+        downtime=$(field "$info" "downtime")
+
+        # CPU usage in percent of one host CPU over the migration
+        printf "%-8s %-8s %10s %12s %10s %10s %7s%% %7s%%\n" \
+            $pin_all $pipeline "$total" $((ram / 1024)) "$mbps" "$downtime" \
+            $((src_cpu * 100000 / hz / total)) \
+            $((dst_cpu * 100000 / hz / total))
+
+        hmp "$tmp/src.sock" "quit" >/dev/null
+        hmp "$tmp/dst.sock" "quit" >/dev/null
+        wait
+        src_pid=
+        dst_pid=
+    done
+done
@@ -13,6 +13,8 @@
 
 #include <glib.h>
 #include "block/coroutine.h"
+#include "block/aio.h"
+#include "qemu/thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -150,6 +152,106 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that terminated coroutines are reused
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void test_pool(void)
+{
+    Coroutine *coroutines[256];
+    CoroutinePoolStats before, after;
+    int i;
+
+    if (!CONFIG_COROUTINE_POOL) {
+        return;
+    }
+
+    /* Keep more coroutines alive than the initial pool size */
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        coroutines[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+
+    qemu_coroutine_pool_get_stats(&before);
+    g_assert_cmpint(before.pooled, >, 0);
+
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        coroutines[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+    qemu_coroutine_pool_get_stats(&after);
+    g_assert_cmpint(after.hits + after.release_hits, >,
+                    before.hits + before.release_hits);
+
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+}
+
+#ifdef CONFIG_COROUTINE_CPC
+/*
+ * Check that a detached coroutine runs on a worker thread and comes back to
+ * the AioContext it detached from
+ */
+
+typedef struct {
+    AioContext *ctx;
+    cpc_sched *sched;
+    QemuThread home;
+    bool detached_on_worker;
+    bool attached_at_home;
+    bool done;
+} DetachData;
+
+static void coroutine_fn detach_and_attach(void *opaque)
+{
+    DetachData *data = opaque;
+
+    cpc_attach(data->sched);
+    data->detached_on_worker = !qemu_thread_is_self(&data->home);
+    cpc_attach(cpc_default_sched);
+    data->attached_at_home = qemu_thread_is_self(&data->home) &&
+                             aio_get_current_context() == data->ctx;
+    data->done = true;
+}
+
+static void enter_from_bh(void *opaque)
+{
+    qemu_coroutine_enter(opaque, NULL);
+}
+
+static void test_detach(void)
+{
+    DetachData data = {
+        .ctx = aio_context_new(),
+        .sched = cpc_sched_new(2),
+    };
+    Coroutine *co = qemu_coroutine_create(detach_and_attach);
+    QEMUBH *bh = aio_bh_new(data.ctx, enter_from_bh, co);
+
+    qemu_thread_get_self(&data.home);
+    qemu_bh_schedule(bh);
+    while (!data.done) {
+        aio_poll(data.ctx, true);
+    }
+
+    g_assert(data.detached_on_worker);
+    g_assert(data.attached_at_home);
+
+    qemu_bh_delete(bh);
+    cpc_sched_free(data.sched);
+    aio_context_unref(data.ctx);
+}
+#endif
+
 /*
  * Lifecycle benchmark
  */
@@ -239,10 +341,14 @@ int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/pool", test_pool);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+#ifdef CONFIG_COROUTINE_CPC
+    g_test_add_func("/basic/detach", test_detach);
+#endif
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
@@ -0,0 +1,135 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void check_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t *data = get_cached_data(cache, addr);
+
+    g_assert(data);
+    g_assert_cmpint(data[0], ==, (uint8_t)(addr / PAGE_SIZE));
+    g_assert_cmpint(data[PAGE_SIZE - 1], ==, (uint8_t)(addr / PAGE_SIZE));
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    g_assert(cache);
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(!get_cached_data(cache, 0));
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        g_assert(!cache_insert(cache, addr, page));
+    }
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        check_page(cache, addr);
+    }
+
+    /* Updating a cached page does not evict anything */
+    fill_page(page, PAGE_SIZE);
+    g_assert(!cache_insert(cache, 0, page));
+    check_page(cache, PAGE_SIZE);
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 1);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_conflict(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t stride = NUM_PAGES * PAGE_SIZE;
+    int i, ways = 0;
+
+    /* Pages one cache size apart map to the same set */
+    for (i = 0; i < NUM_PAGES; i++) {
+        fill_page(page, i * stride);
+        if (cache_insert(cache, i * stride, page)) {
+            break;
+        }
+        ways++;
+    }
+    g_assert_cmpint(ways, >, 1);
+    g_assert_cmpint(ways, <, NUM_PAGES);
+
+    /* The least recently used page was evicted */
+    g_assert(!cache_is_cached(cache, 0));
+    for (i = 1; i <= ways; i++) {
+        g_assert(cache_is_cached(cache, i * stride));
+    }
+
+    /* Using a page protects it from the next eviction */
+    check_page(cache, stride);
+    fill_page(page, (ways + 1) * stride);
+    g_assert(cache_insert(cache, (ways + 1) * stride, page));
+    g_assert(cache_is_cached(cache, stride));
+    g_assert(!cache_is_cached(cache, 2 * stride));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int cached = 0;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 4), ==, NUM_PAGES * 4);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        check_page(cache, addr);
+    }
+
+    /* Shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr)) {
+            g_assert(addr >= NUM_PAGES / 2 * PAGE_SIZE);
+            check_page(cache, addr);
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, ==, NUM_PAGES / 2);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert", test_insert);
+    g_test_add_func("/page-cache/conflict", test_conflict);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -179,6 +179,105 @@ static void test_encode_decode(void)
     }
 }
 
+/* Changes nr_runs runs of up to max_len bytes at random offsets */
+static void dirty_page(uint8_t *page, int nr_runs, int max_len)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < nr_runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            page[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_generic(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    int i, j, dlen, expected_len;
+
+    for (i = 0; i < 10000; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old[j] = g_test_rand_int_range(0, 256);
+        }
+        memcpy(new, old, PAGE_SIZE);
+        dirty_page(new, g_test_rand_int_range(0, 64),
+                   g_test_rand_int_range(1, 128));
+
+        /* The vectorized encoder must produce exactly the same stream */
+        expected_len = xbzrle_encode_buffer_generic(old, new, PAGE_SIZE,
+                                                    expected, PAGE_SIZE);
+        dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                    PAGE_SIZE);
+        g_assert_cmpint(dlen, ==, expected_len);
+        if (dlen > 0) {
+            g_assert(memcmp(compressed, expected, dlen) == 0);
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen, old,
+                                                 PAGE_SIZE), <=, PAGE_SIZE);
+            g_assert(memcmp(old, new, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(expected);
+}
+
+typedef int EncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                       uint8_t *dst, int dlen);
+
+static double bench_encode(EncodeFunc *encode, uint8_t *old, uint8_t *new,
+                           int nr_pages)
+{
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, n;
+
+    g_test_timer_start();
+    for (n = 0; n < 100; n++) {
+        for (i = 0; i < nr_pages; i++) {
+            encode(old + i * PAGE_SIZE, new + i * PAGE_SIZE, PAGE_SIZE,
+                   compressed, PAGE_SIZE);
+        }
+    }
+    g_free(compressed);
+
+    /* MB/s of guest memory */
+    return 100.0 * nr_pages * PAGE_SIZE / g_test_timer_elapsed() / 1e6;
+}
+
+static void bench_encode_dirty(const void *opaque)
+{
+    int nr_runs = GPOINTER_TO_INT(opaque);
+    int nr_pages = 1024;
+    uint8_t *old = g_malloc(nr_pages * PAGE_SIZE);
+    uint8_t *new = g_malloc(nr_pages * PAGE_SIZE);
+    double generic, best;
+    int i;
+
+    for (i = 0; i < nr_pages * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(new, old, nr_pages * PAGE_SIZE);
+    for (i = 0; i < nr_pages; i++) {
+        dirty_page(new + i * PAGE_SIZE, nr_runs, 16);
+    }
+
+    generic = bench_encode(xbzrle_encode_buffer_generic, old, new, nr_pages);
+    best = bench_encode(xbzrle_encode_buffer, old, new, nr_pages);
+    g_test_message("%d dirty runs per page: generic %.0f MB/s, "
+                   "vectorized %.0f MB/s", nr_runs, generic, best);
+    g_test_maximized_result(best, "%.0f MB/s", best);
+
+    g_free(old);
+    g_free(new);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +290,16 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_generic", test_encode_generic);
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/xbzrle/bench/unchanged", GINT_TO_POINTER(0),
+                             bench_encode_dirty);
+        g_test_add_data_func("/xbzrle/bench/sparse", GINT_TO_POINTER(4),
+                             bench_encode_dirty);
+        g_test_add_data_func("/xbzrle/bench/dense", GINT_TO_POINTER(64),
+                             bench_encode_dirty);
+    }
 
     return g_test_run();
 }
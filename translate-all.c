@@ -584,6 +584,45 @@ static inline void code_gen_alloc(size_t tb_size)
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+/* Split the code buffer and the TB array into regions.  Each region must
+   have room for a good number of maximum-sized TBs; small buffers end up
+   with a single region, which behaves like the old global flush.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t margin = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n;
+
+    n = tcg_ctx.code_gen_buffer_size / (4 * margin);
+    n = MAX(1, MIN(n, CODE_GEN_MAX_REGIONS));
+    ctx->nb_regions = n;
+    ctx->region_size = (tcg_ctx.code_gen_buffer_size / n) &
+        ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / n;
+
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->code_start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->code_end = r->code_start + ctx->region_size - margin;
+        r->code_ptr = r->code_start;
+        r->tbs = ctx->tbs + i * ctx->region_max_tbs;
+        r->nb_tbs = 0;
+    }
+    /* the last region also gets the rounding leftovers */
+    ctx->regions[n - 1].code_end = tcg_ctx.code_gen_buffer +
+        tcg_ctx.code_gen_buffer_max_size;
+    ctx->cur_region = 0;
+}
+
+static inline uint8_t *tb_region_code_ptr(int i)
+{
+    if (i == tcg_ctx.tb_ctx.cur_region) {
+        return tcg_ctx.code_gen_ptr;
+    }
+    return tcg_ctx.tb_ctx.regions[i].code_ptr;
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -591,6 +630,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    tb_regions_init();
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
@@ -606,20 +646,40 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* One host thread per vCPU needs TLS, atomically patchable direct jumps
+   and a host whose plain accesses are at least as strongly ordered as the
+   guest requires.  */
+bool tcg_mttcg_supported(void)
+{
+#if defined(CONFIG_LINUX) && defined(CONFIG_SOFTMMU) && \
+    defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_TARGET_DEFAULT_MO)
+    return (TCG_GUEST_DEFAULT_MO & ~TCG_TARGET_DEFAULT_MO) == 0;
+#else
+    return false;
+#endif
+}
+
+/* Allocate a new translation block in the current region.  Returns NULL
+   if the region holds too many translation blocks or too much generated
+   code; the caller must then move on to the next region. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tcg_ctx.tb_ctx.region_max_tbs ||
+        tcg_ctx.code_gen_ptr >= r->code_end) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->exit_count[0] = tb->exit_count[1] = 0;
+    tb->trace_nb_cond = 0;
+    tb->trace_taken = 0;
+    tb->invalid = false;
     return tb;
 }
 
@@ -628,9 +688,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -677,11 +739,20 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+#if !defined(CONFIG_USER_ONLY)
+static bool tb_flush_queued;
+static bool tb_evict_queued;
+#endif
+
+static void do_tb_flush(void *data)
 {
+    CPUArchState *env1 = data;
     CPUState *cpu;
+    int i;
+
+#if !defined(CONFIG_USER_ONLY)
+    tb_flush_queued = false;
+#endif
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -695,6 +766,12 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        tcg_ctx.tb_ctx.regions[i].nb_tbs = 0;
+        tcg_ctx.tb_ctx.regions[i].code_ptr =
+            tcg_ctx.tb_ctx.regions[i].code_start;
+    }
+    tcg_ctx.tb_ctx.cur_region = 0;
 
     for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -712,6 +789,74 @@ void tb_flush(CPUArchState *env1)
     tcg_ctx.tb_ctx.tb_flush_count++;
 }
 
+/* flush all the translation blocks */
+/* XXX: tb_flush is not thread safe in user mode */
+void tb_flush(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        /* other vCPU threads may be executing from the code buffer; the
+           flush runs once all of them have left cpu_exec() */
+        if (!tb_flush_queued) {
+            tb_flush_queued = true;
+            async_safe_run_on_cpu(ENV_GET_CPU(env1), do_tb_flush, env1);
+        }
+        return;
+    }
+#endif
+    do_tb_flush(env1);
+}
+
+/* Move allocation to the next region, invalidating the translations it
+   still holds: those are the oldest ones.  tb_phys_invalidate() unchains
+   every jump into and out of them.  */
+static void do_tb_evict_region(void *data)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int next = (ctx->cur_region + 1) % ctx->nb_regions;
+    TBRegion *r = &ctx->regions[next];
+    int invalidate_count = ctx->tb_phys_invalidate_count;
+    int i;
+
+#if !defined(CONFIG_USER_ONLY)
+    tb_evict_queued = false;
+#endif
+    ctx->regions[ctx->cur_region].code_ptr = tcg_ctx.code_gen_ptr;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    /* only count invalidations caused by guest code modification */
+    ctx->tb_phys_invalidate_count = invalidate_count;
+
+    ctx->nb_tbs -= r->nb_tbs;
+    ctx->region_evict_tbs += r->nb_tbs;
+    ctx->region_evict_count++;
+    r->nb_tbs = 0;
+    r->code_ptr = r->code_start;
+    ctx->cur_region = next;
+    tcg_ctx.code_gen_ptr = r->code_start;
+}
+
+static void tb_evict_region(CPUArchState *env)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        /* other vCPU threads may be executing code from the region */
+        if (!tb_evict_queued) {
+            tb_evict_queued = true;
+            async_safe_run_on_cpu(ENV_GET_CPU(env), do_tb_evict_region, NULL);
+        }
+        return;
+    }
+#endif
+    do_tb_evict_region(NULL);
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -847,6 +992,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+    tb->invalid = true;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -949,10 +1095,15 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
-        /* cannot fail at this point */
+        /* the current region is full, recycle the oldest one */
+        tb_evict_region(env);
         tb = tb_alloc(pc);
+        if (!tb) {
+            /* With multi-threaded TCG the eviction is deferred until every
+               vCPU has stopped; tb_evict_region() already asked this one
+               to. */
+            cpu_loop_exit(env);
+        }
         /* Don't forget to invalidate previous TB info.  */
         tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
@@ -961,6 +1112,8 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    /* set again by tb_link_page(), but tb_trace_hot_exit() needs it */
+    tb->page_addr[0] = phys_pc & TARGET_PAGE_MASK;
     cpu_gen_code(env, tb, &code_gen_size);
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
@@ -975,6 +1128,82 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     return tb;
 }
 
+/* Re-translate a TB that has become hot as a trace: the frontend goes on
+   through direct branches instead of stopping at the first one, so that
+   the optimizer and the register allocator see the whole path.  The
+   original TB is invalidated, which unchains the jumps into it.  */
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    TranslationBlock *trace;
+    int invalidate_count, evict_count, flush_count;
+    bool evicted;
+
+    if (use_icount || singlestep || tb->invalid ||
+        (tb->cflags & (CF_TRACE | CF_COUNT_MASK | CF_LAST_IO)) ||
+        ENV_GET_CPU(env)->singlestep_enabled ||
+        !QTAILQ_EMPTY(&env->breakpoints)) {
+        return tb;
+    }
+    evict_count = ctx->region_evict_count;
+    flush_count = ctx->tb_flush_count;
+    trace = tb_gen_code(env, tb->pc, tb->cs_base, tb->flags,
+                        tb->cflags | CF_TRACE);
+    trace->exec_count = TB_TRACE_THRESHOLD;
+    ctx->tb_trace_count++;
+
+    /* Making room for 'trace' may have evicted the region holding 'tb',
+       which then became the current one, and 'tb' may already have been
+       reused.  Any other eviction leaves 'tb' alone.  */
+    r = &ctx->regions[ctx->cur_region];
+    evicted = ctx->tb_flush_count != flush_count ||
+              (ctx->region_evict_count != evict_count &&
+               tb >= r->tbs && tb < r->tbs + ctx->region_max_tbs);
+    if (!evicted && !tb->invalid) {
+        invalidate_count = ctx->tb_phys_invalidate_count;
+        tb_phys_invalidate(tb, -1);
+        ctx->tb_phys_invalidate_count = invalidate_count;
+    }
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(trace->pc)] = trace;
+    return trace;
+}
+
+/* Called by frontends while translating 'trace' at a conditional branch
+   ending the guest block that starts at 'pc', in the same page.  Returns
+   the exit (0 or 1) through which the TB for that block was left most of
+   the time, or -1 if there is no such profile.  */
+int tb_trace_hot_exit(TranslationBlock *trace, target_ulong pc)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+    uint64_t total;
+
+    phys_pc = trace->page_addr[0] + (pc & ~TARGET_PAGE_MASK);
+    for (tb = tcg_ctx.tb_ctx.tb_phys_hash[tb_phys_hash_func(phys_pc)];
+         tb != NULL; tb = tb->phys_hash_next) {
+        if (tb->pc == pc && tb->page_addr[0] == trace->page_addr[0] &&
+            tb->cs_base == trace->cs_base && tb->flags == trace->flags &&
+            !(tb->cflags & CF_TRACE)) {
+            break;
+        }
+    }
+    if (!tb) {
+        return -1;
+    }
+    total = (uint64_t)tb->exit_count[0] + tb->exit_count[1];
+    if (total < TB_TRACE_THRESHOLD / 4) {
+        return -1;
+    }
+    if (tb->exit_count[0] * 8 >= total * 7) {
+        return 0;
+    }
+    if (tb->exit_count[1] * 8 >= total * 7) {
+        return 1;
+    }
+    return -1;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1334,23 +1563,29 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        tc_ptr >= (uintptr_t)(tcg_ctx.code_gen_buffer +
+                              tcg_ctx.code_gen_buffer_size)) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+        tcg_ctx.tb_ctx.region_size;
+    i = MIN(i, tcg_ctx.tb_ctx.nb_regions - 1);
+    r = &tcg_ctx.tb_ctx.regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_code_ptr(i)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1360,7 +1595,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1503,36 +1738,44 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t host_code_size;
     TranslationBlock *tb;
+    TBRegion *r;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    host_code_size = 0;
+    for (j = 0; j < tcg_ctx.tb_ctx.nb_regions; j++) {
+        r = &tcg_ctx.tb_ctx.regions[j];
+        host_code_size += tb_region_code_ptr(j) - r->code_start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+                host_code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1540,12 +1783,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? host_code_size /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) host_code_size /
+                                   target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1558,6 +1799,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "region evict count  %d (%d TBs)\n",
+            tcg_ctx.tb_ctx.region_evict_count,
+            tcg_ctx.tb_ctx.region_evict_tbs);
+    cpu_fprintf(f, "TB trace count      %d\n", tcg_ctx.tb_ctx.tb_trace_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
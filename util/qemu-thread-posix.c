@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 
 static void error_exit(int err, const char *msg)
 {
@@ -313,6 +314,46 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+static pthread_key_t exit_key;
+
+static void qemu_thread_atexit_run(void *opaque)
+{
+    NotifierList *list = opaque;
+
+    notifier_list_notify(list, NULL);
+    free(list);
+}
+
+static void __attribute__((constructor)) qemu_thread_atexit_init(void)
+{
+    int err;
+
+    err = pthread_key_create(&exit_key, qemu_thread_atexit_run);
+    if (err) {
+        error_exit(err, __func__);
+    }
+}
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    NotifierList *list = pthread_getspecific(exit_key);
+
+    if (!list) {
+        list = malloc(sizeof(*list));
+        if (!list) {
+            error_exit(ENOMEM, __func__);
+        }
+        notifier_list_init(list);
+        pthread_setspecific(exit_key, list);
+    }
+    notifier_list_add(list, notifier);
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
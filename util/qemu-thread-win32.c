@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include <process.h>
 #include <assert.h>
 #include <limits.h>
@@ -240,6 +241,17 @@ struct QemuThreadData {
 };
 
 static __thread QemuThreadData *qemu_thread_data;
+static __thread NotifierList thread_exit;
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    notifier_list_add(&thread_exit, notifier);
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
 
 static unsigned __stdcall win32_start_routine(void *arg)
 {
@@ -260,6 +272,7 @@ void qemu_thread_exit(void *arg)
 {
     QemuThreadData *data = qemu_thread_data;
 
+    notifier_list_notify(&thread_exit, NULL);
     if (data) {
         assert(data->mode != QEMU_THREAD_DETACHED);
         data->ret = arg;
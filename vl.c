@@ -427,6 +427,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "tcg_threads",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG vCPU threading model (single or multi)",
         },
         { /* End of list */ }
     },
@@ -4182,6 +4186,10 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    if (tcg_enabled()) {
+        qemu_tcg_configure(qemu_opt_get(machine_opts, "tcg_threads"));
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
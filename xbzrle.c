@@ -11,8 +11,17 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,13 +32,189 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/* Returns the offset of the first byte at or after i where old_buf and
+ * new_buf differ (find_diff_*) or are equal (find_same_*), or slen if there
+ * is none */
+typedef int XBZRLEFindFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+static int find_diff_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    for (; i < slen && i % sizeof(long); i++) {
+        if (old_buf[i] != new_buf[i]) {
+            return i;
+        }
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_same_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    unsigned long xor;
+
+    /* not aligned to sizeof(long) */
+    for (; i < slen && i % sizeof(long); i++) {
+        if (old_buf[i] == new_buf[i]) {
+            return i;
+        }
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        xor = *(unsigned long *)(old_buf + i) ^
+              *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+/* 16 bytes at a time; bit n of the movemask is set if byte n is equal */
+static int find_diff_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 16 <= slen; i += 16) {
+        eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                           _mm_loadu_si128((__m128i *)(new_buf + i))));
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_same_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 16 <= slen; i += 16) {
+        eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                           _mm_loadu_si128((__m128i *)(new_buf + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static XBZRLEFindFunc *xbzrle_find_diff = find_diff_sse2;
+static XBZRLEFindFunc *xbzrle_find_same = find_same_sse2;
+#else
+static XBZRLEFindFunc *xbzrle_find_diff = find_diff_long;
+static XBZRLEFindFunc *xbzrle_find_same = find_same_long;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static int __attribute__((target("avx2")))
+find_diff_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 32 <= slen; i += 32) {
+        eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old_buf + i)),
+                              _mm256_loadu_si256((__m256i *)(new_buf + i))));
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int __attribute__((target("avx2")))
+find_same_avx2(const uint8_t *old_buf, const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 32 <= slen; i += 32) {
+        eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old_buf + i)),
+                              _mm256_loadu_si256((__m256i *)(new_buf + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static bool cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) ||
+        !(c & bit_OSXSAVE) || !(c & bit_AVX) ||
+        __get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    /* The OS must save the YMM registers */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    if (cpu_has_avx2()) {
+        xbzrle_find_diff = find_diff_avx2;
+        xbzrle_find_same = find_same_avx2;
+    }
+}
+#endif
+
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                XBZRLEFindFunc *find_diff,
+                                XBZRLEFindFunc *find_same)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    int d = 0, i = 0, next;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +225,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        next = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = next - i;
+        i = next;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,54 +241,41 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        next = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = next - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = next;
     }
 
     return d;
 }
 
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_find_diff, xbzrle_find_same);
+}
+
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                 uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_diff_long, find_same_long);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;